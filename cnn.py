@@ -3,7 +3,11 @@ import BaseHTTPServer
 import SimpleHTTPServer
 import json
 import os
+import Queue
 import sys
+import threading
+import time
+import urlparse
 
 from cnnModule import *
 
@@ -12,25 +16,274 @@ if len(sys.argv) == 1:
 else:
     web_port_number = int(sys.argv[1])
 
+# Optional limit for the memory used by the data set, in MB
+if len(sys.argv) > 2:
+    SetMaxResidentMB(int(sys.argv[2]))
+
+# Stages every classification request is traced through, in order: waiting
+# for a handler thread, reading the request and waiting for the classifier,
+# loading the network (only the first request), fetching the samples from the
+# data set, classifying them and writing the reply.
+STAGES = ['queue', 'load', 'fetch', 'infer', 'serialize', 'total']
+
+# Upper bounds of the histogram buckets, in seconds
+BUCKETS = [0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0]
+
+# The quantiles are taken over the last WINDOW requests, the throughput over
+# the last RATE_WINDOW seconds.
+WINDOW = 1024
+RATE_WINDOW = 60.0
+
+class Metrics:
+	def __init__(self):
+		self.lock = threading.Lock()
+		self.requests = 0
+		self.images = 0
+		self.buckets = dict((s, [0] * (len(BUCKETS) + 1)) for s in STAGES)
+		self.sums = dict((s, 0.0) for s in STAGES)
+		self.recent = dict((s, []) for s in STAGES)
+		self.arrivals = []
+
+	def record(self, images, trace):
+		now = time.time()
+		with self.lock:
+			self.requests += 1
+			self.images += images
+			for s in STAGES:
+				t = trace[s]
+				i = 0
+				while i < len(BUCKETS) and t > BUCKETS[i]:
+					i += 1
+				self.buckets[s][i] += 1
+				self.sums[s] += t
+				self.recent[s].append(t)
+				del self.recent[s][:-WINDOW]
+			self.arrivals.append((now, images))
+			while self.arrivals[0][0] < now - RATE_WINDOW:
+				self.arrivals.pop(0)
+
+	def render(self):
+		out = []
+		with self.lock:
+			out.append('# HELP cnn_requests_total Classification requests served.')
+			out.append('# TYPE cnn_requests_total counter')
+			out.append('cnn_requests_total %d' % self.requests)
+			out.append('# HELP cnn_images_total Images classified.')
+			out.append('# TYPE cnn_images_total counter')
+			out.append('cnn_images_total %d' % self.images)
+			out.append('# HELP cnn_images_per_second Images classified per second over the last %d s.' % RATE_WINDOW)
+			out.append('# TYPE cnn_images_per_second gauge')
+			out.append('cnn_images_per_second %f' % (sum(n for t, n in self.arrivals) / RATE_WINDOW))
+
+			out.append('# HELP cnn_request_stage_seconds Time spent in each stage of a request.')
+			out.append('# TYPE cnn_request_stage_seconds histogram')
+			for s in STAGES:
+				count = 0
+				for i, le in enumerate(BUCKETS + ['+Inf']):
+					count += self.buckets[s][i]
+					out.append('cnn_request_stage_seconds_bucket{stage="%s",le="%s"} %d' % (s, le, count))
+				out.append('cnn_request_stage_seconds_sum{stage="%s"} %f' % (s, self.sums[s]))
+				out.append('cnn_request_stage_seconds_count{stage="%s"} %d' % (s, count))
+
+			out.append('# HELP cnn_request_stage_quantile_seconds Quantiles of the stage times over the last %d requests.' % WINDOW)
+			out.append('# TYPE cnn_request_stage_quantile_seconds gauge')
+			for s in STAGES:
+				recent = sorted(self.recent[s])
+				for q in [0.5, 0.95, 0.99]:
+					v = recent[min(len(recent) - 1, int(q * len(recent)))] if recent else 0.0
+					out.append('cnn_request_stage_quantile_seconds{stage="%s",quantile="%s"} %f' % (s, q, v))
+
+		stats = GetStats()
+		if stats is not None:
+			for k, what in [('hits', 'Sample lookups served from a mapped batch.'),
+			                ('misses', 'Sample lookups that had to map their batch.'),
+			                ('evictions', 'Batches unmapped to stay within the memory budget.')]:
+				out.append('# HELP cnn_data_%s_total %s' % (k, what))
+				out.append('# TYPE cnn_data_%s_total counter' % k)
+				out.append('cnn_data_%s_total %d' % (k, stats[k]))
+			lookups = stats['hits'] + stats['misses']
+			out.append('# HELP cnn_data_hit_ratio Fraction of sample lookups served from mapped batches.')
+			out.append('# TYPE cnn_data_hit_ratio gauge')
+			out.append('cnn_data_hit_ratio %f' % (float(stats['hits']) / lookups if lookups else 0.0))
+			out.append('# HELP cnn_data_resident_bytes Bytes of the data set currently mapped.')
+			out.append('# TYPE cnn_data_resident_bytes gauge')
+			out.append('cnn_data_resident_bytes %d' % stats['resident'])
+			out.append('# HELP cnn_data_cache_bytes Size of the preconverted image cache, 0 without one.')
+			out.append('# TYPE cnn_data_cache_bytes gauge')
+			out.append('cnn_data_cache_bytes %d' % stats['cache_bytes'])
+
+			out.append('# HELP cnn_model_version Version of the network in use, one more with every reload.')
+			out.append('# TYPE cnn_model_version gauge')
+			out.append('cnn_model_version %d' % stats['model_version'])
+			for k, what in [('reloads', 'Snapshot reloads that succeeded.'),
+			                ('reload_failures', 'Snapshot reloads that failed and left the network as it was.')]:
+				out.append('# HELP cnn_model_%s_total %s' % (k, what))
+				out.append('# TYPE cnn_model_%s_total counter' % k)
+				out.append('cnn_model_%s_total %d' % (k, stats[k]))
+			out.append('# HELP cnn_model_reload_seconds Duration of the last reload.')
+			out.append('# TYPE cnn_model_reload_seconds gauge')
+			out.append('cnn_model_reload_seconds %f' % reloader.seconds)
+		return '\n'.join(out) + '\n'
+
+metrics = Metrics()
+
+# POST /reload loads a new snapshot on a background thread while requests go
+# on with the current network, then switches to it (see cnn_reload). The body
+# may name the snapshot directory as {"snapshot": "<dir>"}, otherwise the
+# current one is read again.
+class Reloader:
+	def __init__(self):
+		self.lock = threading.Lock()
+		self.running = False
+		self.seconds = 0.0
+
+	def start(self, snapshot):
+		with self.lock:
+			if self.running:
+				return False
+			self.running = True
+		threading.Thread(target=self.run, args=(snapshot,)).start()
+		return True
+
+	def run(self, snapshot):
+		start = time.time()
+		try:
+			version = Reload(snapshot)
+			print 'RELOADED: model version %d in %.2f ms' % (version, 1000.0 * (time.time() - start))
+		except RuntimeError, e:
+			print 'RELOAD FAILED: %s' % e
+		with self.lock:
+			self.running = False
+			self.seconds = time.time() - start
+
+reloader = Reloader()
+
+# Connections are accepted as soon as they arrive and wait in a queue for one
+# of HANDLERS threads, so a request's queue time counts from its arrival
+# instead of from the moment a busy server got round to accepting it. The
+# classifications themselves run one at a time (classify_lock), each of them
+# already uses all cores.
+HANDLERS = 8
+
+classify_lock = threading.Lock()
+
+class webServer(BaseHTTPServer.HTTPServer):
+	def start_handlers(self):
+		self.waiting = Queue.Queue()
+		self.current = threading.local()
+		for i in range(HANDLERS):
+			t = threading.Thread(target=self.handle_queue)
+			t.daemon = True
+			t.start()
+
+	def process_request(self, request, client_address):
+		self.waiting.put((time.time(), request, client_address))
+
+	def handle_queue(self):
+		while True:
+			arrival, request, client_address = self.waiting.get()
+			self.current.arrival = arrival
+			try:
+				self.finish_request(request, client_address)
+			except Exception:
+				self.handle_error(request, client_address)
+			self.shutdown_request(request)
+
 class webHandler(SimpleHTTPServer.SimpleHTTPRequestHandler):
-	def do_POST(self):
-		data_string = self.rfile.read(int(self.headers['Content-Length']))
+	def do_GET(self):
+		if urlparse.urlparse(self.path).path != '/metrics':
+			return SimpleHTTPServer.SimpleHTTPRequestHandler.do_GET(self)
 
+		body = metrics.render()
 		self.send_response(200)
-		self.send_header('Content-type','text/html')
+		self.send_header('Content-type', 'text/plain; version=0.0.4')
+		self.send_header('Content-Length', str(len(body)))
+		self.end_headers()
+		self.wfile.write(body)
+
+	def reject(self, message):
+		self.send_response(400)
+		self.send_header('Content-type', 'application/json')
 		self.end_headers()
+		self.wfile.write(json.dumps({'error': message}))
 
-		samples = json.loads(data_string)
-		print '--------------------------------------------------------------------------------'
-		print 'RECEIVED CLASSIFICATION REQUEST: ' + ','.join([str(x) for x in samples])
+	def do_POST(self):
+		data_string = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+
+		if urlparse.urlparse(self.path).path == '/reload':
+			snapshot = json.loads(data_string).get('snapshot') if data_string.strip() else None
+			started = reloader.start(snapshot)
+			self.send_response(202 if started else 409)
+			self.send_header('Content-type', 'application/json')
+			self.end_headers()
+			self.wfile.write(json.dumps({'reloading': started}))
+			return
+
+		# /classify takes the images themselves as an application/octet-stream
+		# body, IMAGE_BYTES each (see cnn_classify_images), instead of a JSON
+		# list of sample indices; the network reads them straight from the body
+		raw = urlparse.urlparse(self.path).path == '/classify'
+		if raw and len(data_string) % IMAGE_BYTES != 0:
+			self.reject('body must be a multiple of %d bytes' % IMAGE_BYTES)
+			return
+
+		# ?probs adds the probabilities of all classes ('p'), ?top=k the k
+		# most likely [label, probability] pairs ('top') of every sample
+		query = urlparse.parse_qs(urlparse.urlparse(self.path).query, keep_blank_values=True)
+		topk = -1
+		if 'top' in query:
+			try:
+				topk = int(query['top'][0])
+			except ValueError:
+				topk = 0
+			if not 1 <= topk <= 10:
+				self.reject('top must be an integer from 1 to 10')
+				return
+		elif 'probs' in query:
+			topk = 0
+		extra = 'top' if topk > 0 else 'p'
 
-		dt = RunCNNClassifier(samples)
+		with classify_lock:
+			self.send_response(200)
+			self.send_header('Content-type','text/html')
+			self.end_headers()
 
-		responses = samples
+			print '--------------------------------------------------------------------------------'
+			if raw:
+				samples = len(data_string) / IMAGE_BYTES
+				print 'RECEIVED CLASSIFICATION REQUEST: %d images' % samples
+			else:
+				samples = json.loads(data_string)
+				print 'RECEIVED CLASSIFICATION REQUEST: ' + ','.join([str(x) for x in samples])
 
-		print 'SENDING RESPONSES: ' + ','.join([str(x) for x in responses])
-		self.wfile.write(json.dumps({'dt':dt, 'r':responses}))
-		print '--------------------------------------------------------------------------------'
+			reply = {}
+			classify_start = time.time()
+			if raw and topk >= 0:
+				dt, responses, reply[extra] = ClassifyImages(data_string, topk)
+			elif raw:
+				dt, responses = ClassifyImages(data_string)
+			elif topk >= 0:
+				dt, reply[extra] = RunCNNClassifier(samples, topk)
+				responses = samples
+			else:
+				dt = RunCNNClassifier(samples)
+				responses = samples
+			classify_end = time.time()
+
+			reply['dt'] = dt
+			reply['r'] = responses
+
+			print 'SENDING RESPONSES: ' + ','.join([str(x) for x in responses])
+			self.wfile.write(json.dumps(reply))
+			reply_end = time.time()
+
+			trace = dict((k, v / 1000.0) for k, v in GetTrace().items())
+			trace['queue'] = classify_start - self.server.current.arrival
+			trace['serialize'] = reply_end - classify_end
+			trace['total'] = reply_end - self.server.current.arrival
+			metrics.record(len(responses), trace)
+			print 'TRACE: ' + ', '.join(['%s %.2f ms' % (s, 1000.0 * trace[s]) for s in STAGES])
+			print '--------------------------------------------------------------------------------'
 
 		return
 
@@ -41,11 +294,16 @@ print '          *** CS 61C, Summer 2018: Project 4 ***'
 print
 
 try:
-	server = BaseHTTPServer.HTTPServer(('', web_port_number), webHandler)
+	server = webServer(('', web_port_number), webHandler)
+	server.start_handlers()
 	print 'Launched web server! Open your browser and open the following page:'
 	print
 	print 'http://localhost:%d' % web_port_number
 	print
+	print 'Metrics are at http://localhost:%d/metrics' % web_port_number
+	print 'POST to http://localhost:%d/reload reloads the snapshot' % web_port_number
+	print 'POST images to http://localhost:%d/classify to classify them' % web_port_number
+	print
 	print 'Press CTRL+C to terminate'
 	
 	os.chdir('web')
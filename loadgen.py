@@ -0,0 +1,206 @@
+#!/usr/bin/python
+# Load generator for the classification server (cnn.py). It sends the same
+# JSON lists of sample indices to /run that web/index.html sends, either in a
+# closed loop (a fixed number of clients, each sending its next request as
+# soon as the last one is answered) or in an open loop (requests arrive at a
+# fixed average rate, Poisson distributed, no matter how fast the server is),
+# and reports throughput, latency percentiles and errors.
+#
+# Usage: python2.7 loadgen.py [options]
+#   --url URL            server to load (http://localhost:12345/run)
+#   --concurrency N      closed loop with N clients (default 4)
+#   --rate R             open loop with R requests/s instead
+#   --mix SIZE:WEIGHT,.. images per request and how often each size is
+#                        picked (default 1:60,8:30,64:10)
+#   --duration S         seconds to send requests for (default 10)
+#   --samples N          indices are drawn from 0..N-1 (default 50000)
+#   --seed N             random seed (default 61)
+#   --raw                send random images to /classify instead of indices
+#   --wait S             wait up to S seconds for the server to come up
+#
+# In the open loop, latency is measured from the time a request was due, so
+# time it spent waiting for a free connection counts as well.
+#
+# cnn.py reads requests on several threads but classifies them one at a time,
+# so clients beyond the first mostly add queueing: throughput stays about the
+# same and the extra latency shows up in its "queue" stage.
+
+import httplib
+import json
+import optparse
+import random
+import socket
+import sys
+import threading
+import time
+import urlparse
+
+parser = optparse.OptionParser()
+parser.add_option('--url', default='http://localhost:12345/run')
+parser.add_option('--concurrency', type='int', default=4)
+parser.add_option('--rate', type='float', default=0.0)
+parser.add_option('--mix', default='1:60,8:30,64:10')
+parser.add_option('--duration', type='float', default=10.0)
+parser.add_option('--samples', type='int', default=50000)
+parser.add_option('--seed', type='int', default=61)
+parser.add_option('--wait', type='float', default=0.0)
+parser.add_option('--raw', action='store_true', default=False)
+opts, args = parser.parse_args()
+
+url = urlparse.urlparse(opts.url)
+path = url.path or '/run'
+if opts.raw and path == '/run':
+	path = '/classify'
+mix = []
+for item in opts.mix.split(','):
+	size, weight = item.split(':')
+	mix.append((int(size), float(weight)))
+total_weight = sum(w for s, w in mix)
+
+lock = threading.Lock()
+latencies = []
+images = [0]
+errors = {}
+
+def pick_size(rng):
+	x = rng.random() * total_weight
+	for size, weight in mix:
+		x -= weight
+		if x < 0:
+			return size
+	return mix[-1][0]
+
+def send(conn, rng, due):
+	size = pick_size(rng)
+	if opts.raw:
+		# Random pixels, a 32x32 image as three planes of 1024 bytes each
+		body = ''.join([chr(rng.getrandbits(8)) for i in range(3072 * size)])
+		content_type = 'application/octet-stream'
+	else:
+		body = json.dumps([rng.randrange(opts.samples) for i in range(size)])
+		content_type = 'application/json'
+	error = None
+	try:
+		conn.request('POST', path, body, {'Content-Type': content_type})
+		resp = conn.getresponse()
+		reply = resp.read()
+		if resp.status != 200:
+			error = 'HTTP %d' % resp.status
+		elif len(json.loads(reply)['r']) != size:
+			error = 'short reply'
+	except Exception, e:
+		error = type(e).__name__
+		conn.close()
+	end = time.time()
+	with lock:
+		if error is None:
+			latencies.append(end - due)
+			images[0] += size
+		else:
+			errors[error] = errors.get(error, 0) + 1
+
+def connect():
+	return httplib.HTTPConnection(url.hostname, url.port or 80, timeout=60)
+
+def closed_client(seed, stop):
+	rng = random.Random(seed)
+	conn = connect()
+	while time.time() < stop:
+		send(conn, rng, time.time())
+	conn.close()
+
+# Open loop: a dispatcher draws the arrival times and hands them to a pool of
+# senders through a queue, growing the pool whenever all senders are busy.
+def open_loop(start, stop):
+	rng = random.Random(opts.seed)
+	due = []
+	cv = threading.Condition()
+	idle = [0]
+	done = [False]
+
+	def sender(seed):
+		rng = random.Random(seed)
+		conn = connect()
+		while True:
+			with cv:
+				idle[0] += 1
+				while not due and not done[0]:
+					cv.wait()
+				idle[0] -= 1
+				if not due:
+					break
+				t = due.pop(0)
+			send(conn, rng, t)
+		conn.close()
+
+	senders = []
+	t = start
+	while True:
+		t += rng.expovariate(opts.rate)
+		if t >= stop:
+			break
+		delay = t - time.time()
+		if delay > 0:
+			time.sleep(delay)
+		with cv:
+			due.append(t)
+			if idle[0] == 0:
+				s = threading.Thread(target=sender, args=(opts.seed + len(senders) + 1,))
+				s.start()
+				senders.append(s)
+			cv.notify()
+	with cv:
+		done[0] = True
+		cv.notify_all()
+	for s in senders:
+		s.join()
+	return len(senders)
+
+def percentile(values, q):
+	return values[min(len(values) - 1, int(q * len(values)))]
+
+# The server loads the network on its first request, so that one is sent
+# (and not counted) before the clock starts.
+deadline = time.time() + opts.wait
+while True:
+	try:
+		socket.create_connection((url.hostname, url.port or 80)).close()
+		break
+	except socket.error:
+		if time.time() > deadline:
+			print 'ERROR: No server at %s' % opts.url
+			sys.exit(1)
+		time.sleep(0.1)
+conn = connect()
+send(conn, random.Random(opts.seed), time.time())
+conn.close()
+del latencies[:]
+images[0] = 0
+errors.clear()
+
+start = time.time()
+stop = start + opts.duration
+if opts.rate > 0:
+	print 'Open loop: %.1f requests/s for %.0f s, mix %s' % (opts.rate, opts.duration, opts.mix)
+	clients = open_loop(start, stop)
+else:
+	print 'Closed loop: %d clients for %.0f s, mix %s' % (opts.concurrency, opts.duration, opts.mix)
+	threads = [threading.Thread(target=closed_client, args=(opts.seed + i, stop))
+	           for i in range(opts.concurrency)]
+	for t in threads:
+		t.start()
+	for t in threads:
+		t.join()
+	clients = opts.concurrency
+elapsed = time.time() - start
+
+latencies.sort()
+print 'REQUESTS: %d ok, %d errors, %d connections' % (len(latencies), sum(errors.values()), clients)
+for e in sorted(errors):
+	print '  %s: %d' % (e, errors[e])
+print 'THROUGHPUT: %.2f requests/s, %.2f images/s' % (len(latencies) / elapsed, images[0] / elapsed)
+if latencies:
+	print 'LATENCY (ms): p50 %.2f, p95 %.2f, p99 %.2f, max %.2f' % tuple(
+		1000.0 * x for x in [percentile(latencies, 0.5), percentile(latencies, 0.95),
+		                     percentile(latencies, 0.99), latencies[-1]])
+sys.exit(1 if errors or not latencies else 0)
@@ -0,0 +1,315 @@
+// API tests -------------------------------------------------------------------
+
+// 'cnn apitest' runs the libcnn paths that 'cnn partest' does not: the
+// worker pool, the probabilities of all classes and the top-k, classifying
+// pixels that are not looked up in the data set, the image cache, reloading
+// under load and the LRU budget of the data set. All cases except lru
+// classify the same samples, spread over the whole data set, and print PAR
+// lines like partest, which run_test.sh compares against ref/api<n>.txt; lru
+// prints its counters after every step. Anything else that goes wrong is
+// reported as an ERROR and makes the command fail.
+
+#define APITEST_SIZE 100
+#define APITEST_STRIDE 7919
+#define APITEST_BATCH (10000 * CIFAR_RECORD)
+#define APITEST_BADSNAP "out/api_badsnap"
+#define APITEST_CACHE "out/api_images.cache"
+#define APITEST_RELOADS 6
+
+static void apitest_fail(const char* what, int err) {
+  printf("ERROR: %s: %s\n", what, cnn_strerror(err));
+  exit(1);
+}
+
+// Every APITEST_STRIDE-th sample, wrapping around at the end of the data
+// set. Unlike partest's rand(), that is the same everywhere.
+static int* apitest_samples(int n) {
+  int* samples = (int*)malloc(sizeof(int)*n);
+  int size = data_size(DATA_FOLDER);
+  assert(size > 0);
+  for (int i = 0; i < n; i++)
+    samples[i] = (int)((long)i * APITEST_STRIDE % size);
+  return samples;
+}
+
+static cnn_ctx_t* apitest_open(cnn_options_t* opts) {
+  int err;
+  cnn_ctx_t* ctx = cnn_open(opts, &err);
+  if (ctx == NULL)
+    apitest_fail("cnn_open", err);
+  return ctx;
+}
+
+static void apitest_print(const double* output, int n) {
+  for (int i = 0; i < n; i++)
+    printf("PAR%d,%lf\n", i, output[i]);
+}
+
+// Requests of 1 to 64 samples on two workers and both priority classes,
+// collected with cnn_wait in whatever order they finish.
+static void apitest_async(int* samples, int n, double* output) {
+  cnn_options_t opts = { 0 };
+  opts.image_cache = "";
+  opts.workers = 2;
+  cnn_ctx_t* ctx = apitest_open(&opts);
+
+  int requests = 0;
+  int64_t first = -1;
+  for (int off = 0, size = 1; off < n; off += size, size = size * 3 % 64 + 1) {
+    if (size > n - off)
+      size = n - off;
+    int64_t id = cnn_submit_ex(ctx, samples + off, size, output + off, NULL,
+                               requests % 2 ? CNN_PRIO_BULK : CNN_PRIO_INTERACTIVE, 0);
+    if (id < 0)
+      apitest_fail("cnn_submit_ex", (int)id);
+    if (first < 0)
+      first = id;
+    requests++;
+  }
+
+  cnn_completion_t c;
+  int err;
+  while ((err = cnn_wait(ctx, &c)) == CNN_OK) {
+    if (c.status != CNN_OK)
+      apitest_fail("request", c.status);
+    requests--;
+  }
+  if (requests != 0)
+    apitest_fail("cnn_wait", err);
+  if ((err = cnn_wait_for(ctx, first, &c)) != CNN_ERR_EMPTY)
+    apitest_fail("cnn_wait_for on a returned request", err);
+  if ((err = cnn_poll(ctx, &c)) != CNN_ERR_EMPTY)
+    apitest_fail("cnn_poll without requests", err);
+  cnn_close(ctx);
+}
+
+// The pixels of the samples, copied out of the data set, as /classify gets
+// them.
+static void apitest_images(int* samples, int n, double* output) {
+  uint8_t* images = (uint8_t*)malloc((size_t)CNN_IMAGE_BYTES * (n > 0 ? n : 1));
+  for (int i = 0; i < n; i++) {
+    uint8_t* batch = map_batch(DATA_FOLDER, samples[i] / 10000);
+    assert(batch != NULL);
+    memcpy(images + (size_t)i * CNN_IMAGE_BYTES,
+           batch + (size_t)(samples[i] % 10000) * CIFAR_RECORD + 1, CNN_IMAGE_BYTES);
+    unmap_batch(batch);
+  }
+
+  cnn_options_t opts = { 0 };
+  opts.image_cache = "";
+  cnn_ctx_t* ctx = apitest_open(&opts);
+  int err = cnn_classify_images(ctx, images, n, output);
+  if (err != CNN_OK)
+    apitest_fail("cnn_classify_images", err);
+  cnn_close(ctx);
+  free(images);
+}
+
+// The samples read from an image cache written for the test.
+static void apitest_cache(int* samples, int n, double* output) {
+  if (write_image_cache(DATA_FOLDER, APITEST_CACHE) < 0)
+    apitest_fail("write_image_cache", CNN_ERR_IO);
+
+  cnn_options_t opts = { 0 };
+  opts.image_cache = APITEST_CACHE;
+  cnn_ctx_t* ctx = apitest_open(&opts);
+  cnn_stats_t st;
+  cnn_get_stats(ctx, &st);
+  if (st.cache_bytes == 0)
+    apitest_fail("image cache not in use", CNN_OK);
+  int err = cnn_classify(ctx, samples, n, output);
+  if (err != CNN_OK)
+    apitest_fail("cnn_classify", err);
+  cnn_close(ctx);
+  unlink(APITEST_CACHE);
+}
+
+typedef struct apitest_reloader {
+  cnn_ctx_t* ctx;
+  volatile int done;
+  int err;
+} apitest_reloader_t;
+
+// Reload the snapshot, and every other time try the truncated one, which
+// has to be rejected without changing the model in use.
+static void* apitest_reload_loop(void* arg) {
+  apitest_reloader_t* r = (apitest_reloader_t*)arg;
+  cnn_stats_t before, after;
+  for (int i = 0; i < APITEST_RELOADS && r->err == CNN_OK; i++) {
+    cnn_get_stats(r->ctx, &before);
+    int err = cnn_reload(r->ctx, (i % 2) ? APITEST_BADSNAP : NULL);
+    cnn_get_stats(r->ctx, &after);
+    if ((i % 2) && (err != CNN_ERR_IO || after.model_version != before.model_version))
+      r->err = (err != CNN_OK) ? err : CNN_ERR_ARG;
+    else if (!(i % 2) && err != CNN_OK)
+      r->err = err;
+  }
+  r->done = 1;
+  return NULL;
+}
+
+static void apitest_reload(int* samples, int n, double* output) {
+  char fn[1024];
+  struct stat st;
+  mkdir(APITEST_BADSNAP, 0755);
+  network_t* net = load_cnn_snapshot();
+  int saved = save_cnn_snapshot(net, APITEST_BADSNAP);
+  free_network(net);
+  if (saved != 0)
+    apitest_fail("save_cnn_snapshot", CNN_ERR_IO);
+  snprintf(fn, sizeof(fn), "%s/layer10_fc.txt", APITEST_BADSNAP);
+  if (stat(fn, &st) != 0 || truncate(fn, st.st_size / 2) != 0)
+    apitest_fail("truncate", CNN_ERR_IO);
+
+  cnn_options_t opts = { 0 };
+  opts.image_cache = "";
+  cnn_ctx_t* ctx = apitest_open(&opts);
+  int err = cnn_classify(ctx, samples, n, output);
+  if (err != CNN_OK)
+    apitest_fail("cnn_classify", err);
+
+  // Classify the samples again and again while the snapshot is reloaded.
+  double* again = (double*)malloc(sizeof(double)*(n > 0 ? n : 1));
+  apitest_reloader_t r = { ctx, 0, CNN_OK };
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, apitest_reload_loop, &r) != 0)
+    apitest_fail("pthread_create", CNN_ERR_NOMEM);
+  do {
+    err = cnn_classify(ctx, samples, n, again);
+    if (err != CNN_OK)
+      apitest_fail("cnn_classify during reload", err);
+    if (memcmp(again, output, sizeof(double)*n) != 0)
+      apitest_fail("output changed during reload", CNN_OK);
+  } while (!r.done);
+  pthread_join(thread, NULL);
+  if (r.err != CNN_OK)
+    apitest_fail("cnn_reload", r.err);
+
+  cnn_stats_t stats;
+  cnn_get_stats(ctx, &stats);
+  if (stats.reloads != APITEST_RELOADS / 2 || stats.reload_failures != APITEST_RELOADS / 2 ||
+      stats.model_version != 1 + APITEST_RELOADS / 2)
+    apitest_fail("reload counters", CNN_OK);
+  free(again);
+  cnn_close(ctx);
+
+  const char* layers[] = { "layer1_conv.txt", "layer4_conv.txt", "layer7_conv.txt", "layer10_fc.txt" };
+  for (int i = 0; i < 4; i++) {
+    snprintf(fn, sizeof(fn), "%s/%s", APITEST_BADSNAP, layers[i]);
+    unlink(fn);
+  }
+  rmdir(APITEST_BADSNAP);
+}
+
+// The probabilities of all classes, printed like 'cnn partest n all' does,
+// and the k most likely classes (k > 0) like 'cnn partest n top<k>'.
+static void apitest_probs(int* samples, int n, int k) {
+  cnn_options_t opts = { 0 };
+  opts.image_cache = "";
+  cnn_ctx_t* ctx = apitest_open(&opts);
+  double* probs = (double*)malloc(sizeof(double)*CNN_CLASSES*n);
+  int* labels = (int*)malloc(sizeof(int)*CNN_CLASSES*n);
+  double* scores = (double*)malloc(sizeof(double)*CNN_CLASSES*n);
+  int err = cnn_classify_probs(ctx, samples, n, probs);
+  if (err != CNN_OK)
+    apitest_fail("cnn_classify_probs", err);
+  if (k > 0 && (err = cnn_classify_topk(ctx, samples, n, k, labels, scores)) != CNN_OK)
+    apitest_fail("cnn_classify_topk", err);
+
+  for (int i = 0; i < n; i++) {
+    printf("PAR%d,%lf", i, probs[CNN_CLASSES*i + CNN_CAT]);
+    for (int j = 0; j < ((k > 0) ? k : CNN_CLASSES); j++) {
+      if (k > 0)
+        printf(",%s:%lf", cnn_class_name(labels[k*i + j]), scores[k*i + j]);
+      else
+        printf(",%lf", probs[CNN_CLASSES*i + j]);
+    }
+    printf("\n");
+  }
+  free(probs);
+  free(labels);
+  free(scores);
+  cnn_close(ctx);
+}
+
+static void apitest_lru_step(cnn_ctx_t* ctx, int step, int sample) {
+  if (sample >= 0) {
+    double prob;
+    int err = cnn_classify(ctx, &sample, 1, &prob);
+    if (err != CNN_OK)
+      apitest_fail("cnn_classify", err);
+  }
+  cnn_stats_t st;
+  cnn_get_stats(ctx, &st);
+  printf("LRU%d,%llu,%llu,%llu,%zu\n", step, (unsigned long long)st.hits,
+         (unsigned long long)st.misses, (unsigned long long)st.evictions,
+         st.resident / APITEST_BATCH);
+}
+
+// Single samples from all five batches with room for two of them: hits,
+// misses, evictions and batches mapped after every step, and after the
+// budget shrinks to one batch.
+static void apitest_lru() {
+  assert(data_size(DATA_FOLDER) >= 50000);
+  cnn_options_t opts = { 0 };
+  opts.image_cache = "";
+  opts.max_resident = 2 * APITEST_BATCH;
+  cnn_ctx_t* ctx = apitest_open(&opts);
+
+  const int steps[] = { 0, 1, 10000, 20000, 2, 30000, 10001, 30001, 40000 };
+  int n = (int)(sizeof(steps) / sizeof(int));
+  for (int i = 0; i < n; i++)
+    apitest_lru_step(ctx, i, steps[i]);
+  cnn_set_max_resident(ctx, APITEST_BATCH);
+  apitest_lru_step(ctx, n, -1);
+  apitest_lru_step(ctx, n + 1, 40001);
+  cnn_close(ctx);
+}
+
+/*
+ * Usage: cnn apitest <async|images|cache|reload|probs|top<k>> [samples]
+ *        cnn apitest lru
+ *
+ * The default is 100 samples.
+ */
+
+int do_apitest(int argc, char** argv) {
+  if (argc < 1) {
+    printf("Usage: ./cnn apitest <async|images|cache|reload|probs|top<k>> [samples]\n"
+           "       ./cnn apitest lru\n");
+    return 2;
+  }
+  if (!strcmp(argv[0], "lru")) {
+    apitest_lru();
+    return 0;
+  }
+
+  int n = (argc > 1) ? atoi(argv[1]) : APITEST_SIZE;
+  assert(n > 0);
+  int* samples = apitest_samples(n);
+  double* output = (double*)malloc(sizeof(double)*n);
+  if (!strcmp(argv[0], "probs") || !strncmp(argv[0], "top", 3)) {
+    int k = (argv[0][0] == 't') ? atoi(argv[0] + 3) : 0;
+    assert(argv[0][0] != 't' || (k > 0 && k <= CNN_CLASSES));
+    apitest_probs(samples, n, k);
+    free(samples);
+    free(output);
+    return 0;
+  } else if (!strcmp(argv[0], "async")) {
+    apitest_async(samples, n, output);
+  } else if (!strcmp(argv[0], "images")) {
+    apitest_images(samples, n, output);
+  } else if (!strcmp(argv[0], "cache")) {
+    apitest_cache(samples, n, output);
+  } else if (!strcmp(argv[0], "reload")) {
+    apitest_reload(samples, n, output);
+  } else {
+    printf("ERROR: Unknown test %s\n", argv[0]);
+    return 2;
+  }
+  apitest_print(output, n);
+
+  free(samples);
+  free(output);
+  return 0;
+}
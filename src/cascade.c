@@ -0,0 +1,253 @@
+// Cascade ---------------------------------------------------------------------
+
+// 'cnn cascade train' fits the first stage of the cascade (see cascade_t) to
+// the cat probabilities of the full network on the first images of the data
+// set: logistic regression on the pooled features, with the full network's
+// output as soft target. 'cnn cascade eval' then classifies images the
+// first stage has not seen, with the full network and with the cascade at a
+// few thresholds, and compares speed and cat decisions.
+
+#define CASCADE_SIZE 10000
+#define CASCADE_EVAL_BATCH 4
+#define CASCADE_EPOCHS 300
+#define CASCADE_RATE 0.5
+#define CASCADE_L2 1e-4
+#define CASCADE_TRIALS 3
+
+static const double cascade_thresholds[] = { 0.01, 0.02, 0.05, 0.1, 0.2 };
+
+// The first n records of a batch of the data set, as network input.
+static const uint8_t** cascade_input(uint8_t* data, int n) {
+  const uint8_t** input = (const uint8_t**)malloc(sizeof(uint8_t*)*n);
+  for (int i = 0; i < n; i++)
+    input[i] = data + (size_t)i * CIFAR_RECORD + 1;
+  return input;
+}
+
+// Features of n images, CASCADE_FEATURES per image.
+static double* cascade_extract(network_t* net, const uint8_t** input, int n) {
+  double* f = NULL;
+  posix_memalign((void**)&f, 32, sizeof(double)*CASCADE_FEATURES*n);
+
+  #pragma omp parallel
+  {
+    batch_t* batch = make_batch(net, IMG_LANES);
+    #pragma omp for
+    for (int i = 0; i < n; i += IMG_LANES) {
+      int e = (n - i < IMG_LANES) ? n - i - 1 : IMG_LANES - 1;
+      net_forward_first(net, batch, input + i, 0, e);
+      for (int j = 0; j <= e; j++)
+        cascade_features(batch[3][j], f + (size_t)(i + j) * CASCADE_FEATURES);
+    }
+    free_batch(batch, IMG_LANES);
+  }
+  return f;
+}
+
+// Fit c to the targets by gradient descent on the mean cross entropy. The
+// features are standardized for the descent, and the scaling is folded into
+// the weights afterwards. Returns the final mean cross entropy.
+static double cascade_fit(const double* f, const double* target, int n, cascade_t* c) {
+  double mean[CASCADE_FEATURES] = { 0 };
+  double scale[CASCADE_FEATURES] = { 0 };
+  for (int i = 0; i < n; i++)
+    for (int k = 0; k < CASCADE_FEATURES; k++)
+      mean[k] += f[(size_t)i * CASCADE_FEATURES + k] / n;
+  for (int i = 0; i < n; i++)
+    for (int k = 0; k < CASCADE_FEATURES; k++) {
+      double d = f[(size_t)i * CASCADE_FEATURES + k] - mean[k];
+      scale[k] += d * d / n;
+    }
+  for (int k = 0; k < CASCADE_FEATURES; k++)
+    scale[k] = (scale[k] > 1e-12) ? 1.0 / sqrt(scale[k]) : 0.0;
+  double* zs = (double*)malloc(sizeof(double)*CASCADE_FEATURES*n);
+  for (int i = 0; i < n; i++)
+    for (int k = 0; k < CASCADE_FEATURES; k++)
+      zs[(size_t)i * CASCADE_FEATURES + k] = (f[(size_t)i * CASCADE_FEATURES + k] - mean[k]) * scale[k];
+
+  double w[CASCADE_FEATURES] = { 0 };
+  double prior = 0.0;
+  for (int i = 0; i < n; i++)
+    prior += target[i] / n;
+  prior = fmin(fmax(prior, 1e-6), 1.0 - 1e-6);
+  double bias = log(prior / (1.0 - prior));
+  double loss = 0.0;
+
+  for (int epoch = 0; epoch < CASCADE_EPOCHS; epoch++) {
+    double grad[CASCADE_FEATURES] = { 0 };
+    double grad_bias = 0.0;
+    loss = 0.0;
+    for (int i = 0; i < n; i++) {
+      const double* z = zs + (size_t)i * CASCADE_FEATURES;
+      double a = bias;
+      for (int k = 0; k < CASCADE_FEATURES; k++)
+        a += w[k] * z[k];
+      double p = 1.0 / (1.0 + exp(-a));
+      double d = p - target[i];
+      for (int k = 0; k < CASCADE_FEATURES; k++)
+        grad[k] += d * z[k];
+      grad_bias += d;
+      p = fmin(fmax(p, 1e-12), 1.0 - 1e-12);
+      loss -= (target[i] * log(p) + (1.0 - target[i]) * log(1.0 - p)) / n;
+    }
+    for (int k = 0; k < CASCADE_FEATURES; k++)
+      w[k] -= CASCADE_RATE * (grad[k] / n + CASCADE_L2 * w[k]);
+    bias -= CASCADE_RATE * grad_bias / n;
+  }
+
+  free(zs);
+
+  c->bias = bias;
+  for (int k = 0; k < CASCADE_FEATURES; k++) {
+    c->w[k] = w[k] * scale[k];
+    c->bias -= w[k] * scale[k] * mean[k];
+  }
+  return loss;
+}
+
+static int cascade_train(int argc, char** argv) {
+  int num_samples = (argc > 0) ? atoi(argv[0]) : CASCADE_SIZE;
+  const char* fn = (argc > 1) ? argv[1] : CASCADE_FILE;
+  assert(num_samples > 0 && num_samples <= 10000);
+
+  printf("Making network...\n");
+  network_t* net = load_cnn_snapshot();
+  uint8_t* data = load_batch(DATA_FOLDER, 0);
+  assert(data != NULL);
+  const uint8_t** input = cascade_input(data, num_samples);
+
+  printf("Classifying %d pictures with the full network...\n", num_samples);
+  double* target = (double*)malloc(sizeof(double)*num_samples);
+  net_classify_cats(net, input, target, num_samples);
+  double* f = cascade_extract(net, input, num_samples);
+
+  printf("Fitting the first stage...\n");
+  cascade_t* c = NULL;
+  posix_memalign((void**)&c, 32, sizeof(cascade_t));
+  double loss = cascade_fit(f, target, num_samples, c);
+  printf("Cross entropy against the full network: %lf\n\n", loss);
+
+  // How the thresholds would do on the training images.
+  int cats = 0;
+  for (int i = 0; i < num_samples; i++)
+    cats += target[i] > 0.5;
+  printf("THRESHOLD   rejected   cats lost\n");
+  for (int t = 0; t < (int)(sizeof(cascade_thresholds) / sizeof(double)); t++) {
+    int rejected = 0;
+    int lost = 0;
+    for (int i = 0; i < num_samples; i++) {
+      if (cascade_score(c, f + (size_t)i * CASCADE_FEATURES) < cascade_thresholds[t]) {
+        rejected++;
+        lost += target[i] > 0.5;
+      }
+    }
+    printf("%9.2lf   %7.2lf%%   %4d of %d\n", cascade_thresholds[t],
+           100.0 * rejected / num_samples, lost, cats);
+  }
+
+  if (save_cascade(fn, c) != 0) {
+    printf("ERROR: Cannot write %s\n", fn);
+    return 1;
+  }
+  printf("\nWrote %s\n\n", fn);
+
+  free(c);
+  free(f);
+  free(target);
+  free(input);
+  free(data);
+  free_network(net);
+  return 0;
+}
+
+// Best rate of TRIALS runs of net_classify_cats, in Cat/s.
+static double cascade_trial(network_t* net, const uint8_t** input, double* output, int n) {
+  double best = 0.0;
+  for (int r = 0; r < CASCADE_TRIALS; r++) {
+    uint64_t start_time = timestamp_us();
+    net_classify_cats(net, input, output, n);
+    uint64_t end_time = timestamp_us();
+    double rate = 1e6 * n / (double)(end_time - start_time);
+    if (rate > best)
+      best = rate;
+  }
+  return best;
+}
+
+static int cascade_eval(int argc, char** argv) {
+  int num_samples = (argc > 0) ? atoi(argv[0]) : CASCADE_SIZE;
+  const char* fn = CASCADE_FILE;
+  assert(num_samples > 0 && num_samples <= 10000);
+
+  network_t* net = load_cnn_snapshot();
+  cascade_t* c = load_cascade(fn);
+  if (c == NULL) {
+    printf("ERROR: Cannot read %s, run './cnn cascade train' first\n", fn);
+    return 1;
+  }
+  uint8_t* data = load_batch(DATA_FOLDER, CASCADE_EVAL_BATCH);
+  assert(data != NULL);
+  const uint8_t** input = cascade_input(data, num_samples);
+  double* full = (double*)malloc(sizeof(double)*num_samples);
+  double* output = (double*)malloc(sizeof(double)*num_samples);
+
+  printf("Classifying pictures %d to %d...\n\n", CASCADE_EVAL_BATCH * 10000,
+         CASCADE_EVAL_BATCH * 10000 + num_samples - 1);
+  double full_rate = cascade_trial(net, input, full, num_samples);
+  int cats = 0;
+  int correct = 0;
+  for (int i = 0; i < num_samples; i++) {
+    cats += full[i] > 0.5;
+    correct += (full[i] > 0.5) == (input[i][-1] == CAT_LABEL);
+  }
+
+  printf("THRESHOLD     passed       Cat/s   speedup   agreement   cats kept   accuracy\n");
+  printf("     full    100.00%% %11.2lf     1.00x     100.00%%     100.00%%    %6.2lf%%\n",
+         full_rate, 100.0 * correct / num_samples);
+
+  net->cascade = c;
+  int thresholds = (argc > 1) ? argc - 1 : (int)(sizeof(cascade_thresholds) / sizeof(double));
+  for (int t = 0; t < thresholds; t++) {
+    net->cascade_threshold = (argc > 1) ? atof(argv[t + 1]) : cascade_thresholds[t];
+    net->cascade_passed = 0;
+    double rate = cascade_trial(net, input, output, num_samples);
+
+    int agree = 0;
+    int kept = 0;
+    correct = 0;
+    for (int i = 0; i < num_samples; i++) {
+      agree += (output[i] > 0.5) == (full[i] > 0.5);
+      kept += output[i] > 0.5 && full[i] > 0.5;
+      correct += (output[i] > 0.5) == (input[i][-1] == CAT_LABEL);
+    }
+    printf("%9.2lf    %6.2lf%% %11.2lf    %5.2lfx     %6.2lf%%     %6.2lf%%    %6.2lf%%\n",
+           net->cascade_threshold,
+           100.0 * net->cascade_passed / ((double)CASCADE_TRIALS * num_samples), rate,
+           rate / full_rate, 100.0 * agree / num_samples,
+           cats > 0 ? 100.0 * kept / cats : 100.0, 100.0 * correct / num_samples);
+  }
+  printf("\n");
+
+  free(full);
+  free(output);
+  free(input);
+  free(data);
+  free_network(net);
+  return 0;
+}
+
+/*
+ * Usage: cnn cascade train [samples] [file]
+ *        cnn cascade eval [samples] [threshold...]
+ */
+
+int do_cascade(int argc, char** argv) {
+  if (argc > 0 && !strcmp(argv[0], "train"))
+    return cascade_train(argc - 1, argv + 1);
+  if (argc > 0 && !strcmp(argv[0], "eval"))
+    return cascade_eval(argc - 1, argv + 1);
+
+  printf("Usage: ./cnn cascade train [samples] [file]\n");
+  printf("       ./cnn cascade eval [samples] [threshold...]\n");
+  return 2;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
@@ -5,6 +6,8 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
+#include "cnn.h"
 #include "timestamp.c"
 
 // Include SSE intrinsics
@@ -31,19 +34,73 @@
 /*
  * Represents a three-dimensional array of numbers, and its size. The numbers
  * at (x,y,d) are stored in array w at location ((v->sx * y)+x)*v->depth+d.
+ *
+ * The activations between the layers are channel-blocked instead: the depth
+ * is split into blocks of VOL_BLOCK channels (one AVX register of doubles)
+ * and each block is stored as its own sx*sy*VOL_BLOCK array, so (x,y,d) is at
+ * ((d/VOL_BLOCK * v->sy + y) * v->sx + x)*VOL_BLOCK + d%VOL_BLOCK. The layers
+ * can then process VOL_BLOCK channels of a pixel with a single vector load.
+ */
+
+#define VOL_BLOCK 4
+
+/*
+ * Storage precision of the channel-blocked activations and of the packed
+ * convolution weights. A CNN_HALF build (make HALF=1, which needs F16C)
+ * stores them as IEEE half floats, a quarter of the bytes of a double, and
+ * the kernels convert VOL_BLOCK values at a time to doubles in registers
+ * with st_load and back with st_store. All arithmetic stays in double.
+ * Otherwise store_t is double and the two are plain vector loads and stores.
  */
 
+#ifdef CNN_HALF
+typedef uint16_t store_t;
+
+static inline __m256d st_load(const store_t* p) {
+    return _mm256_cvtps_pd(_mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)p)));
+}
+
+static inline void st_store(store_t* p, __m256d v) {
+    _mm_storel_epi64((__m128i*)p, _mm_cvtps_ph(_mm256_cvtpd_ps(v), _MM_FROUND_TO_NEAREST_INT));
+}
+#else
+typedef double store_t;
+
+static inline __m256d st_load(const store_t* p) {
+    return _mm256_load_pd(p);
+}
+
+static inline void st_store(store_t* p, __m256d v) {
+    _mm256_store_pd(p, v);
+}
+#endif
+
 typedef struct vol {
     uint64_t sx,sy,depth;
     double* w;
+    int blocked;
+    // the values of a channel-blocked volume in storage precision: w itself,
+    // or in a CNN_HALF build a separate array (and w is NULL, while b is
+    // NULL for the other volumes)
+    store_t* b;
 } vol_t;
 
+static inline uint64_t vol_index(vol_t* v, int x, int y, int d) {
+    if (v->blocked)
+        return (((uint64_t)(d / VOL_BLOCK) * v->sy + y) * v->sx + x) * VOL_BLOCK + d % VOL_BLOCK;
+    return ((v->sx * y)+x)*v->depth+d;
+}
+
 /*
  * Set the value at a specific entry of the array.
  */
 
 static inline double get_vol(vol_t* v, int x, int y, int d) {
-    return v->w[((v->sx * y)+x)*v->depth+d];
+#ifdef CNN_HALF
+    if (v->blocked)
+        return _cvtsh_ss(v->b[vol_index(v, x, y, d)]);
+#endif
+    return v->w[vol_index(v, x, y, d)];
 }
 
 /*
@@ -51,19 +108,34 @@ static inline double get_vol(vol_t* v, int x, int y, int d) {
  */
 
 static inline void set_vol(vol_t* v, int x, int y, int d, double val) {
-    v->w[((v->sx * y)+x)*v->depth+d] = val;
+#ifdef CNN_HALF
+    if (v->blocked) {
+        v->b[vol_index(v, x, y, d)] = _cvtss_sh((float)val, _MM_FROUND_TO_NEAREST_INT);
+        return;
+    }
+#endif
+    v->w[vol_index(v, x, y, d)] = val;
 }
 
 /*
- * Allocate a new array with specific dimensions and default value v.
+ * Allocate a new array with specific dimensions and default value v. The
+ * data is aligned for AVX loads.
  */
 
 static vol_t* make_vol(int sx, int sy, int d, double v) {
     vol_t* out = (vol_t*)malloc(sizeof(struct vol));
-    out->w = (double*)malloc(sizeof(double)*(sx*sy*d));
+    void* w = NULL;
+    posix_memalign(&w, 32, sizeof(double)*(sx*sy*d));
+    out->w = (double*)w;
     out->sx = sx;
     out->sy = sy;
     out->depth = d;
+    out->blocked = 0;
+#ifdef CNN_HALF
+    out->b = NULL;
+#else
+    out->b = out->w;
+#endif
 #pragma omp parallel
     {
 #pragma omp for
@@ -75,6 +147,29 @@ static vol_t* make_vol(int sx, int sy, int d, double v) {
     return out;
 }
 
+/*
+ * Allocate a new channel-blocked array (d has to be a multiple of VOL_BLOCK).
+ */
+
+static vol_t* make_blocked_vol(int sx, int sy, int d, double v) {
+    assert(d % VOL_BLOCK == 0);
+#ifdef CNN_HALF
+    vol_t* out = (vol_t*)malloc(sizeof(struct vol));
+    out->w = NULL;
+    posix_memalign((void**)&out->b, 32, sizeof(store_t)*(sx*sy*d));
+    out->sx = sx;
+    out->sy = sy;
+    out->depth = d;
+    out->blocked = 1;
+    for (int i = 0; i < sx*sy*d; i += VOL_BLOCK)
+        st_store(out->b + i, _mm256_set1_pd(v));
+#else
+    vol_t* out = make_vol(sx, sy, d, v);
+    out->blocked = 1;
+#endif
+    return out;
+}
+
 /*
  * Copy the contents of one Volume to another (assuming same dimensions).
  */
@@ -94,6 +189,9 @@ static vol_t* copy_vol(vol_t* dest, vol_t* src) {
  * Deallocate the array.
  */
 void free_vol(vol_t* v) {
+#ifdef CNN_HALF
+    free(v->b);
+#endif
     free(v->w);
     free(v);
 }
@@ -139,8 +237,28 @@ typedef struct conv_layer {
     double bias;
     vol_t* biases;
     vol_t** filters;
+
+    // filters rearranged for the forward functions (see conv_pack), either
+    // in packed_buf or in the embedded weights (see load_cnn_embedded)
+    double* packed;
+    double* packed_buf;
+    // packed in storage precision for the dense forward functions of the
+    // layers: packed itself, or an fp16 copy of it in a CNN_HALF build
+    store_t* weights;
+
+    // sparse form of packed, only set if enough weights are zero (see
+    // conv_sparsify): entry e of filter block ob, sp_start[ob] <= e <
+    // sp_start[ob+1], multiplies the input at offset sp_off[e] of the padded
+    // input window with the VOL_BLOCK weights at sp_w + e*VOL_BLOCK.
+    int* sp_start;
+    int* sp_off;
+    double* sp_w;
 } conv_layer_t;
 
+// Minimum fraction of zero weight blocks for which a layer switches to its
+// sparse forward function.
+#define SPARSE_MIN 0.6
+
 conv_layer_t* make_conv_layer(int in_sx, int in_sy, int in_depth,
                               int sx, int filters, int stride, int pad) {
     conv_layer_t* l = (conv_layer_t*)malloc(sizeof(conv_layer_t));
@@ -169,168 +287,599 @@ conv_layer_t* make_conv_layer(int in_sx, int in_sy, int in_depth,
     
     l->bias = 0.0;
     l->biases = make_vol(1, 1, l->out_depth, l->bias);
+
+    void* packed = NULL;
+    posix_memalign(&packed, 32, sizeof(double)*filters*l->sx*l->sy*l->in_depth);
+    l->packed = l->packed_buf = (double*)packed;
+#ifdef CNN_HALF
+    posix_memalign((void**)&l->weights, 32, sizeof(store_t)*filters*l->sx*l->sy*l->in_depth);
+#else
+    l->weights = l->packed;
+#endif
+    l->sp_start = NULL;
+    l->sp_off = NULL;
+    l->sp_w = NULL;
     
     return l;
 }
 
+void free_conv_layer(conv_layer_t* l) {
+    for (int i = 0; i < l->out_depth; i++)
+        free_vol(l->filters[i]);
+    free(l->filters);
+    free_vol(l->biases);
+#ifdef CNN_HALF
+    free(l->weights);
+#endif
+    free(l->packed_buf);
+    free(l->sp_start);
+    free(l->sp_off);
+    free(l->sp_w);
+    free(l);
+}
+
+/*
+ * Build the sparse form of the packed weights if at least SPARSE_MIN of the
+ * weight blocks (the VOL_BLOCK weights of one input channel and filter tap)
+ * are zero. The input offset of each remaining block is precomputed from the
+ * strides of the padded input between rows, pixels and channel blocks.
+ */
+
+void conv_sparsify(conv_layer_t* l, int row_stride, int pixel_stride, int block_stride) {
+    free(l->sp_start);
+    free(l->sp_off);
+    free(l->sp_w);
+    l->sp_start = NULL;
+    l->sp_off = NULL;
+    l->sp_w = NULL;
+
+    int blocks = l->out_depth / VOL_BLOCK * l->sy * l->sx * l->in_depth;
+    int nonzero = 0;
+    for (int i = 0; i < blocks; i++)
+        for (int k = 0; k < VOL_BLOCK; k++)
+            if (l->packed[i * VOL_BLOCK + k] != 0.0) {
+                nonzero++;
+                break;
+            }
+    if (nonzero > (1.0 - SPARSE_MIN) * blocks)
+        return;
+
+    void* w = NULL;
+    posix_memalign(&w, 32, sizeof(double) * VOL_BLOCK * (nonzero + 1));
+    l->sp_w = (double*)w;
+    l->sp_start = (int*)malloc(sizeof(int) * (l->out_depth / VOL_BLOCK + 1));
+    l->sp_off = (int*)malloc(sizeof(int) * (nonzero + 1));
+
+    int e = 0;
+    for (int ob = 0; ob < l->out_depth / VOL_BLOCK; ob++) {
+        l->sp_start[ob] = e;
+        for (int fy = 0; fy < l->sy; fy++)
+            for (int fx = 0; fx < l->sx; fx++)
+                for (int c = 0; c < l->in_depth; c++) {
+                    double* f = l->packed + (((ob * l->sy + fy) * l->sx + fx) * l->in_depth + c) * VOL_BLOCK;
+                    int k = 0;
+                    while (k < VOL_BLOCK && f[k] == 0.0)
+                        k++;
+                    if (k == VOL_BLOCK)
+                        continue;
+                    l->sp_off[e] = fy * row_stride + fx * pixel_stride +
+                                   (c / VOL_BLOCK) * block_stride + c % VOL_BLOCK;
+                    memcpy(l->sp_w + e * VOL_BLOCK, f, sizeof(double) * VOL_BLOCK);
+                    e++;
+                }
+    }
+    l->sp_start[l->out_depth / VOL_BLOCK] = e;
+}
+
+/*
+ * Prepare the weights in storage precision and the sparse form of freshly
+ * packed weights. The sparse forward functions read from a zero-padded copy
+ * of the input: the interleaved tile of conv_input_1 for the first layer and
+ * a channel-blocked one for the others.
+ */
+
+static void conv_packed(conv_layer_t* l) {
+#ifdef CNN_HALF
+    for (int i = 0; i < l->out_depth * l->sy * l->sx * l->in_depth; i += VOL_BLOCK)
+        st_store(l->weights + i, _mm256_loadu_pd(l->packed + i));
+#else
+    l->weights = l->packed;
+#endif
+
+    int p = l->in_sx + 2 * l->pad;
+    if (l->in_depth % VOL_BLOCK == 0)
+        conv_sparsify(l, p * VOL_BLOCK, VOL_BLOCK, p * p * VOL_BLOCK);
+    else
+        conv_sparsify(l, p * l->in_depth, l->in_depth, VOL_BLOCK);
+}
+
+/*
+ * The forward functions compute VOL_BLOCK filters at once, one per vector
+ * lane, so their weights are packed into [out_depth/VOL_BLOCK][sy][sx]
+ * [in_depth][VOL_BLOCK] order: the weights for one input channel of one
+ * filter tap of a block of filters are next to each other.
+ */
+
+void conv_pack(conv_layer_t* l) {
+    l->packed = l->packed_buf;
+    for (int ob = 0; ob < l->out_depth / VOL_BLOCK; ob++)
+        for (int fy = 0; fy < l->sy; fy++)
+            for (int fx = 0; fx < l->sx; fx++)
+                for (int c = 0; c < l->in_depth; c++)
+                    for (int k = 0; k < VOL_BLOCK; k++) {
+                        int i = (((ob * l->sy + fy) * l->sx + fx) * l->in_depth + c) * VOL_BLOCK + k;
+                        l->packed[i] = get_vol(l->filters[ob * VOL_BLOCK + k], fx, fy, c);
+                    }
+
+    conv_packed(l);
+}
+
+/*
+ * The inverse of conv_pack for weights that come packed already: restore the
+ * filters from them and derive the sparse form.
+ */
+
+void conv_unpack(conv_layer_t* l) {
+    for (int ob = 0; ob < l->out_depth / VOL_BLOCK; ob++)
+        for (int fy = 0; fy < l->sy; fy++)
+            for (int fx = 0; fx < l->sx; fx++)
+                for (int c = 0; c < l->in_depth; c++)
+                    for (int k = 0; k < VOL_BLOCK; k++) {
+                        int i = (((ob * l->sy + fy) * l->sx + fx) * l->in_depth + c) * VOL_BLOCK + k;
+                        set_vol(l->filters[ob * VOL_BLOCK + k], fx, fy, c, l->packed[i]);
+                    }
+
+    conv_packed(l);
+}
+
+/*
+ * The first layer reads the image straight from its CIFAR record, which holds
+ * three 32x32 planes of bytes (red, green, blue). conv_input_1 normalizes the
+ * bytes to x/255-0.5 four pixels at a time, interleaves the planes into the
+ * layout of a volume and places the result in a tile with a zero border of
+ * two pixels, so that the convolution needs no bounds checks. decode_image
+ * does the same for a whole image into an unpadded input volume.
+ */
+
+#define IN_TILE 36
+
+static inline __m256d load_pixels_1(const uint8_t* p) {
+    int32_t bytes;
+    memcpy(&bytes, p, 4);
+    __m256d v = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+    return _mm256_sub_pd(_mm256_div_pd(v, _mm256_set1_pd(255.0)), _mm256_set1_pd(0.5));
+}
+
+// Four pixels of the red plane at p and the same pixels of the other two
+// planes as 12 interleaved (r,g,b) doubles at t.
+static inline void decode_pixels_4(double* t, const uint8_t* p) {
+    __m256d r = load_pixels_1(p);
+    __m256d g = load_pixels_1(p + 1024);
+    __m256d b = load_pixels_1(p + 2048);
+
+    // (r0 g0|r2 g2), (b0 r1|b2 r3), (g1 b1|g3 b3)
+    __m256d rg = _mm256_unpacklo_pd(r, g);
+    __m256d br = _mm256_unpacklo_pd(b, _mm256_permute_pd(r, 0x5));
+    __m256d gb = _mm256_unpackhi_pd(g, b);
+
+    _mm256_storeu_pd(t, _mm256_permute2f128_pd(rg, br, 0x20));
+    _mm256_storeu_pd(t + 4, _mm256_permute2f128_pd(gb, rg, 0x30));
+    _mm256_storeu_pd(t + 8, _mm256_permute2f128_pd(br, gb, 0x31));
+}
+
+static void conv_input_1(double* tile, const uint8_t* img) {
+    memset(tile, 0, sizeof(double)*IN_TILE*IN_TILE*3);
+    for (int y = 0; y < 32; y++) {
+        double* t = tile + ((y+2)*IN_TILE + 2)*3;
+        for (int x = 0; x < 32; x += 4, t += 12)
+            decode_pixels_4(t, img + 32*y + x);
+    }
+}
+
+void decode_image(double* w, const uint8_t* img) {
+    for (int i = 0; i < 1024; i += 4)
+        decode_pixels_4(w + 3*i, img + i);
+}
+
+/*
+ * Convolution with the sparse weights of a layer (see conv_sparsify). tile
+ * is the zero-padded input, row_stride and pixel_stride are the distances
+ * between two rows and two pixels in it.
+ */
+
+static inline void conv_sparse(conv_layer_t* l, const double* tile, store_t* A_w,
+                               int size, int row_stride, int pixel_stride, int out_depth) {
+    for(int ob = 0; ob < out_depth / VOL_BLOCK; ob++) {
+        __m256d bias = _mm256_load_pd(l->biases->w + ob * VOL_BLOCK);
+        const int* off = l->sp_off;
+        const double* f_w = l->sp_w;
+        int begin = l->sp_start[ob];
+        int end = l->sp_start[ob + 1];
+        store_t* A_b = A_w + ob * size * size * VOL_BLOCK;
+        for(int ay = 0; ay < size; ay++) {
+            for(int ax = 0; ax < size; ax++) {
+                const double* V_addr = tile + ay * row_stride + ax * pixel_stride;
+                __m256d sum = _mm256_setzero_pd();
+                for(int e = begin; e < end; e++) {
+                    sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_broadcast_sd(V_addr + off[e]),
+                                                           _mm256_load_pd(f_w + e * VOL_BLOCK)));
+                }
+                st_store(A_b + (size * ay + ax) * VOL_BLOCK, _mm256_add_pd(sum, bias));
+            }
+        }
+    }
+}
+
+/*
+ * Copy a channel-blocked size x size x depth volume into a tile of doubles
+ * with a zero border of two pixels around each channel block, for
+ * conv_sparse and conv_tiled.
+ */
+
+static inline void pad_blocked(const store_t* V_w, double* tile, int size, int depth) {
+    int p = size + 4;
+    memset(tile, 0, sizeof(double) * p * p * depth);
+    for(int cb = 0; cb < depth / VOL_BLOCK; cb++)
+        for(int y = 0; y < size; y++) {
+#ifdef CNN_HALF
+            for(int x = 0; x < size; x++)
+                _mm256_store_pd(tile + ((cb * p + y + 2) * p + x + 2) * VOL_BLOCK,
+                                st_load(V_w + ((cb * size + y) * size + x) * VOL_BLOCK));
+#else
+            memcpy(tile + ((cb * p + y + 2) * p + 2) * VOL_BLOCK,
+                   V_w + (cb * size + y) * size * VOL_BLOCK,
+                   sizeof(double) * size * VOL_BLOCK);
+#endif
+        }
+}
+
 //depth == 3
-void conv_forward_1(conv_layer_t* l, vol_t** in, vol_t** out) {
-    double* V_w = in[0]->w;
-    double* A_w = out[0]->w;
-    for(int d = 0; d < 16; d++) {
-        double l_w = l->biases->w[d];
-        vol_t* f = l->filters[d];
-        int y = -2;
-        double *f_w = f->w;
+void conv_forward_1(conv_layer_t* l, const uint8_t** in, vol_t** out) {
+    double V_w[IN_TILE*IN_TILE*3] __attribute__((aligned(32)));
+    store_t* A_w = out[0]->b;
+    conv_input_1(V_w, in[0]);
+    if (l->sp_start != NULL) {
+        conv_sparse(l, V_w, A_w, 32, IN_TILE * 3, 3, 16);
+        return;
+    }
+    for(int ob = 0; ob < 16 / VOL_BLOCK; ob++) {
+        __m256d bias = _mm256_load_pd(l->biases->w + ob * VOL_BLOCK);
+        const store_t* f_w = l->weights + ob * 5 * 5 * 3 * VOL_BLOCK;
+        store_t* A_b = A_w + ob * 32 * 32 * VOL_BLOCK;
         for(int ay = 0; ay < 32; ay++) {
-            int x = -2;
-            int a_y = ay *512;
             for(int ax=0; ax < 32; ax++) {
-                double a = 0.0;
-                for(int fx = 0; fx < 5; fx++) {
-                    int ox = x + fx;
-                    if(ox < 32 && ox > -1) {
-                        for(int fy = 0; fy < 5; fy++) {
-                            int oy = y + fy;
-                            if(oy < 32 && oy > -1){
-                                double* f_addr = f_w + (5 * fy + fx) * 3;
-                                double* V_addr = V_w + (32 * oy + ox) * 3;
-                                a += *(f_addr) * *(V_addr);
-                                a += *(f_addr+1) * *(V_addr+1);
-                                a += *(f_addr+2) * *(V_addr+2);
-                            }
-                        }
+                __m256d sum = _mm256_setzero_pd();
+                for(int fy = 0; fy < 5; fy++) {
+                    for(int fx = 0; fx < 5; fx++) {
+                        const store_t* f_addr = f_w + (5 * fy + fx) * 3 * VOL_BLOCK;
+                        double* V_addr = V_w + (IN_TILE * (ay + fy) + ax + fx) * 3;
+                        sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_broadcast_sd(V_addr), st_load(f_addr)));
+                        sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_broadcast_sd(V_addr+1), st_load(f_addr+4)));
+                        sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_broadcast_sd(V_addr+2), st_load(f_addr+8)));
                     }
                 }
-                *(A_w + (a_y) + (ax * 16) + d) = a + l_w;
-                x += 1;
+                st_store(A_b + (32 * ay + ax) * VOL_BLOCK, _mm256_add_pd(sum, bias));
             }
-            y += 1;
         }
     }
 }
 
-  
-  
-//depth == 16
+/*
+ * Cross-image variant of the first layer. Three input channels leave most
+ * of a vector idle when the lanes are filters of one image, so this one puts
+ * IMG_LANES different images into the lanes instead: the input tile is
+ * stored as [pixel][channel][image], every filter weight is broadcast once
+ * and multiplied with the same pixel of all images.
+ */
 
-void conv_forward_2(conv_layer_t* l, vol_t** in, vol_t** out) {
-    double result64_[4];
-    double* V_w = in[0]->w;
-    double* A_w = out[0]->w;
-
-    for(int d = 0; d < 20; d++) {
-        vol_t* f = l->filters[d];
-        double* f_w = f->w;
-        double l_w = l->biases->w[d];
-        int y = -2;
-        for(int ay = 0; ay < 16;y += 1, ay++) {
-            int x = -2;
-            int a_y = 16*ay;
-            for(int ax=0; ax < 16; x += 1, ax++) {
-                double a = 0.0;
-                __m256d sum = _mm256_setzero_pd();
+#define IMG_LANES 4
 
-                for(int fy = 0; fy < 5; fy++) {
-                    int oy = y + fy;
-                    if(oy > -1 && oy < 16 ){
+/*
+ * Transpose four vectors of four doubles: afterwards r[i][j] holds what was
+ * r[j][i] before.
+ */
+
+static inline void transpose_4x4(__m256d* r) {
+    __m256d t0 = _mm256_unpacklo_pd(r[0], r[1]);
+    __m256d t1 = _mm256_unpackhi_pd(r[0], r[1]);
+    __m256d t2 = _mm256_unpacklo_pd(r[2], r[3]);
+    __m256d t3 = _mm256_unpackhi_pd(r[2], r[3]);
+    r[0] = _mm256_permute2f128_pd(t0, t2, 0x20);
+    r[1] = _mm256_permute2f128_pd(t1, t3, 0x20);
+    r[2] = _mm256_permute2f128_pd(t0, t2, 0x31);
+    r[3] = _mm256_permute2f128_pd(t1, t3, 0x31);
+}
+
+static void conv_input_1_x4(double* tile, const uint8_t** img) {
+    memset(tile, 0, sizeof(double)*IN_TILE*IN_TILE*3*IMG_LANES);
+    for (int c = 0; c < 3; c++) {
+        for (int y = 0; y < 32; y++) {
+            for (int x = 0; x < 32; x += 4) {
+                __m256d p[IMG_LANES];
+                for (int i = 0; i < IMG_LANES; i++)
+                    p[i] = load_pixels_1(img[i] + 1024 * c + 32 * y + x);
+                transpose_4x4(p);
+                double* t = tile + (((y + 2) * IN_TILE + x + 2) * 3 + c) * IMG_LANES;
+                for (int j = 0; j < 4; j++)
+                    _mm256_store_pd(t + j * 3 * IMG_LANES, p[j]);
+            }
+        }
+    }
+}
+
+void conv_forward_1_x4(conv_layer_t* l, const uint8_t** in, vol_t** out) {
+    static const int stride = 3 * IMG_LANES;
+    double V_w[IN_TILE*IN_TILE*3*IMG_LANES] __attribute__((aligned(32)));
+    conv_input_1_x4(V_w, in);
+    for(int ob = 0; ob < 16 / VOL_BLOCK; ob++) {
+        __m256d bias = _mm256_load_pd(l->biases->w + ob * VOL_BLOCK);
+        double* f_w = l->packed + ob * 5 * 5 * 3 * VOL_BLOCK;
+        for(int ay = 0; ay < 32; ay++) {
+            for(int ax = 0; ax < 32; ax++) {
+                // sum[k] holds filter k of the block for all images
+                __m256d sum[VOL_BLOCK];
+                for(int k = 0; k < VOL_BLOCK; k++)
+                    sum[k] = _mm256_setzero_pd();
+                if (l->sp_start != NULL) {
+                    const double* V_addr = V_w + (IN_TILE * ay + ax) * stride;
+                    for(int e = l->sp_start[ob]; e < l->sp_start[ob + 1]; e++) {
+                        __m256d v = _mm256_load_pd(V_addr + l->sp_off[e] * IMG_LANES);
+                        for(int k = 0; k < VOL_BLOCK; k++)
+                            sum[k] = _mm256_add_pd(sum[k], _mm256_mul_pd(_mm256_broadcast_sd(l->sp_w + e * VOL_BLOCK + k), v));
+                    }
+                } else {
+                    for(int fy = 0; fy < 5; fy++) {
                         for(int fx = 0; fx < 5; fx++) {
-                            int ox = x + fx;
-                            if(ox > -1 && ox < 16) {
-                                double* f_addr = f_w + (5 * fy+fx)*16;
-                                double* V_addr = V_w + (16 * oy+ox)*16;
-                                
-                                sum = _mm256_add_pd(sum, _mm256_mul_pd( _mm256_loadu_pd (f_addr), _mm256_loadu_pd (V_addr)));
-                                sum = _mm256_add_pd(sum, _mm256_mul_pd( _mm256_loadu_pd (f_addr+4), _mm256_loadu_pd (V_addr+4)));
-                                sum = _mm256_add_pd(sum, _mm256_mul_pd( _mm256_loadu_pd (f_addr+8), _mm256_loadu_pd (V_addr+8)));
-                                sum = _mm256_add_pd(sum, _mm256_mul_pd( _mm256_loadu_pd (f_addr+12), _mm256_loadu_pd (V_addr+12)));
+                            double* f_addr = f_w + (5 * fy + fx) * 3 * VOL_BLOCK;
+                            double* V_addr = V_w + (IN_TILE * (ay + fy) + ax + fx) * stride;
+                            for(int c = 0; c < 3; c++) {
+                                __m256d v = _mm256_load_pd(V_addr + c * IMG_LANES);
+                                for(int k = 0; k < VOL_BLOCK; k++)
+                                    sum[k] = _mm256_add_pd(sum[k], _mm256_mul_pd(_mm256_broadcast_sd(f_addr + c * VOL_BLOCK + k), v));
                             }
                         }
                     }
                 }
-                _mm256_store_pd(result64_, sum);
-                *(A_w + (a_y + ax)* 20 + d) = a + result64_[0] + result64_[1] + result64_[2] + result64_[3] + l_w;
+                // now sum[i] holds the filter block of image i
+                transpose_4x4(sum);
+                for(int i = 0; i < IMG_LANES; i++)
+                    st_store(out[i]->b + ((ob * 32 + ay) * 32 + ax) * VOL_BLOCK, _mm256_add_pd(sum[i], bias));
             }
         }
     }
 }
 
+/*
+ * Convolution of a channel-blocked size x size x in_depth volume with 5x5
+ * filters (stride 1, pad 2) for the filter blocks ob0 to ob1-1. Every vector
+ * lane accumulates a different filter of a block, so the sums need no
+ * horizontal reduction. The input is the zero-padded tile of pad_blocked.
+ *
+ * The kernel is register-blocked: it computes R neighbouring output pixels
+ * of B filter blocks at a time, so each input value is broadcast once for
+ * all B blocks and each weight vector is loaded once for all R pixels. Taps
+ * that only hit the padding for all R pixels are skipped; for the others the
+ * padding adds exact zeros, which keeps the results bit for bit the same as
+ * one pixel at a time. R and B are constants at every call (see
+ * conv_forward_2/3), so the compiler unrolls the loops over them.
+ */
 
-      
-
-//depth == 20
-void conv_forward_3(conv_layer_t* l, vol_t** in, vol_t** out) {
-    double result64_[4];
-        
-    double* V_w = in[0]->w;
-    double* A_w = out[0]->w;
-    for(int d = 0; d < 20; d++) {
-        vol_t* f = l->filters[d];
-        double* f_w = f->w;
-        double l_w = l->biases->w[d];
-        int y = -2;
-        for(int ay = 0; ay < 8; y += 1, ay++) {
-            int x = -2;
-            int a_y = 8 * ay;
-            for(int ax=0; ax < 8; x += 1, ax++) {
-                double a = 0.0;
-                __m256d sum = _mm256_setzero_pd();
-                for(int fy = 0; fy < 5; fy++) {
-                    int oy = y + fy;
-                    if(oy > -1 && oy < 8 ){
-                        for(int fx = 0; fx < 5; fx++) {
-                            int ox = x + fx;
-                            if(ox > -1 && ox < 8) {
-                                double* f_addr = f_w + (5 * fy+fx)*20;
-                                double* V_addr = V_w + (8 * oy+ox)*20;
-                            
-                                sum = _mm256_add_pd(sum, _mm256_mul_pd( _mm256_loadu_pd (f_addr), _mm256_loadu_pd (V_addr)));
-                                sum = _mm256_add_pd(sum, _mm256_mul_pd( _mm256_loadu_pd (f_addr+4), _mm256_loadu_pd (V_addr+4)));
-                                sum = _mm256_add_pd(sum, _mm256_mul_pd( _mm256_loadu_pd (f_addr+8), _mm256_loadu_pd (V_addr+8)));
-                                sum = _mm256_add_pd(sum, _mm256_mul_pd( _mm256_loadu_pd (f_addr+12), _mm256_loadu_pd (V_addr+12)));
-                                sum = _mm256_add_pd(sum, _mm256_mul_pd( _mm256_loadu_pd (f_addr+16), _mm256_loadu_pd (V_addr+16)));
+static inline void conv_tiled(conv_layer_t* l, const double* tile, store_t* A_w,
+                              int size, int in_depth, int ob0, int ob1, int R, int B) {
+    int p = size + 4;
+    int f_stride = 5 * 5 * in_depth * VOL_BLOCK;
+    for(int ob = ob0; ob + B <= ob1; ob += B) {
+        for(int ay = 0; ay < size; ay++) {
+            int fy0 = ay < 2 ? 2 - ay : 0;
+            int fy1 = ay + 3 > size ? size - ay + 2 : 5;
+            for(int ax = 0; ax < size; ax += R) {
+                int last = ax + R - 1;
+                int fx0 = last < 2 ? 2 - last : 0;
+                int fx1 = ax + 3 > size ? size - ax + 2 : 5;
+                __m256d sum[R][B];
+                for(int r = 0; r < R; r++)
+                    for(int b = 0; b < B; b++)
+                        sum[r][b] = _mm256_setzero_pd();
+                for(int fy = fy0; fy < fy1; fy++) {
+                    for(int fx = fx0; fx < fx1; fx++) {
+                        const store_t* f_addr = l->weights + ob * f_stride + (5 * fy + fx) * in_depth * VOL_BLOCK;
+                        const double* V_addr = tile + ((ay + fy) * p + ax + fx) * VOL_BLOCK;
+                        for(int cb = 0; cb < in_depth / VOL_BLOCK; cb++) {
+                            for(int k = 0; k < VOL_BLOCK; k++) {
+                                __m256d w[B];
+                                for(int b = 0; b < B; b++)
+                                    w[b] = st_load(f_addr + b * f_stride + k * VOL_BLOCK);
+                                for(int r = 0; r < R; r++) {
+                                    __m256d v = _mm256_broadcast_sd(V_addr + r * VOL_BLOCK + k);
+                                    for(int b = 0; b < B; b++)
+                                        sum[r][b] = _mm256_add_pd(sum[r][b], _mm256_mul_pd(v, w[b]));
+                                }
                             }
+                            V_addr += p * p * VOL_BLOCK;
+                            f_addr += VOL_BLOCK * VOL_BLOCK;
                         }
                     }
                 }
-                _mm256_store_pd(result64_, sum);
-                
-                *(A_w + (a_y + ax) * 20 + d) = a + result64_[0] + result64_[1] + result64_[2] + result64_[3] + l_w;
+                for(int b = 0; b < B; b++) {
+                    __m256d bias = _mm256_load_pd(l->biases->w + (ob + b) * VOL_BLOCK);
+                    store_t* A_b = A_w + (ob + b) * size * size * VOL_BLOCK;
+                    for(int r = 0; r < R; r++)
+                        st_store(A_b + (size * ay + ax + r) * VOL_BLOCK, _mm256_add_pd(sum[r][b], bias));
+                }
             }
         }
     }
 }
 
+/*
+ * Tile shapes (output pixels x filter blocks) of conv_tiled per layer. Eight
+ * pixels of all five filter blocks were fastest for both layers in 'cnn
+ * perf', ahead of the shapes whose sums fit into the 16 AVX registers (4x3,
+ * 2x5): the sums that spill stay in L1, while every weight vector is loaded
+ * only once per eight pixels.
+ */
+
+#define CONV2_TILE_R 8
+#define CONV2_TILE_B 5
+#define CONV3_TILE_R 8
+#define CONV3_TILE_B 5
+
+//depth == 16
+void conv_forward_2(conv_layer_t* l, vol_t** in, vol_t** out) {
+    double tile[20*20*16] __attribute__((aligned(32)));
+    pad_blocked(in[0]->b, tile, 16, 16);
+    if (l->sp_start != NULL) {
+        conv_sparse(l, tile, out[0]->b, 16, 20 * VOL_BLOCK, VOL_BLOCK, 20);
+        return;
+    }
+    conv_tiled(l, tile, out[0]->b, 16, 16, 0, 5, CONV2_TILE_R, CONV2_TILE_B);
+    if (5 % CONV2_TILE_B != 0)
+        conv_tiled(l, tile, out[0]->b, 16, 16, 5 - 5 % CONV2_TILE_B, 5, CONV2_TILE_R, 5 % CONV2_TILE_B);
+}
+
+//depth == 20
+void conv_forward_3(conv_layer_t* l, vol_t** in, vol_t** out) {
+    double tile[12*12*20] __attribute__((aligned(32)));
+    pad_blocked(in[0]->b, tile, 8, 20);
+    if (l->sp_start != NULL) {
+        conv_sparse(l, tile, out[0]->b, 8, 12 * VOL_BLOCK, VOL_BLOCK, 20);
+        return;
+    }
+    conv_tiled(l, tile, out[0]->b, 8, 20, 0, 5, CONV3_TILE_R, CONV3_TILE_B);
+    if (5 % CONV3_TILE_B != 0)
+        conv_tiled(l, tile, out[0]->b, 8, 20, 5 - 5 % CONV3_TILE_B, 5, CONV3_TILE_R, 5 % CONV3_TILE_B);
+}
+
+/*
+ * Read the next weight of a snapshot file. Returns 0 if there is none or it
+ * is not a finite number.
+ */
 
+static int read_weight(FILE* fin, double* val) {
+    return fscanf(fin, "%lf", val) == 1 && isfinite(*val);
+}
 
+/*
+ * Load the filters and biases of a convolutional layer from a snapshot file.
+ * Returns 0 on success and -1 if the file is missing, does not match the
+ * shape of the layer or ends early.
+ */
 
-void conv_load(conv_layer_t* l, const char* fn) {
+int conv_load(conv_layer_t* l, const char* fn) {
     int sx, sy, depth, filters;
     
     FILE* fin = fopen(fn, "r");
+    if (fin == NULL)
+        return -1;
     
-    fscanf(fin, "%d %d %d %d", &sx, &sy, &depth, &filters);
-    assert(sx == l->sx);
-    assert(sy == l->sy);
-    assert(depth == l->in_depth);
-    assert(filters == l->out_depth);
+    if (fscanf(fin, "%d %d %d %d", &sx, &sy, &depth, &filters) != 4 ||
+        sx != l->sx || sy != l->sy || depth != l->in_depth ||
+        filters != l->out_depth) {
+        fclose(fin);
+        return -1;
+    }
     
     for(int d = 0; d < l->out_depth; d++)
         for (int x = 0; x < sx; x++)
             for (int y = 0; y < sy; y++)
                 for (int z = 0; z < depth; z++) {
                     double val;
-                    fscanf(fin, "%lf", &val);
+                    if (!read_weight(fin, &val)) {
+                        fclose(fin);
+                        return -1;
+                    }
                     set_vol(l->filters[d], x, y, z, val);
                 }
     
     for(int d = 0; d < l->out_depth; d++) {
         double val;
-        fscanf(fin, "%lf", &val);
+        if (!read_weight(fin, &val)) {
+            fclose(fin);
+            return -1;
+        }
         set_vol(l->biases, 0, 0, d, val);
     }
     
     fclose(fin);
+    conv_pack(l);
+    return 0;
+}
+
+/*
+ * Store the filters and biases of a convolutional layer in the format read
+ * by conv_load. Returns 0 on success and -1 if the file cannot be written.
+ */
+
+int conv_save(conv_layer_t* l, const char* fn) {
+    FILE* fout = fopen(fn, "w");
+    if (fout == NULL)
+        return -1;
+
+    fprintf(fout, "%d %d %d %d\n", l->sx, l->sy, l->in_depth, l->out_depth);
+    for(int d = 0; d < l->out_depth; d++)
+        for (int x = 0; x < l->sx; x++)
+            for (int y = 0; y < l->sy; y++)
+                for (int z = 0; z < l->in_depth; z++)
+                    fprintf(fout, "%.20lf\n", get_vol(l->filters[d], x, y, z));
+    for(int d = 0; d < l->out_depth; d++)
+        fprintf(fout, "%.20lf\n", get_vol(l->biases, 0, 0, d));
+
+    return fclose(fout) == 0 ? 0 : -1;
+}
+
+/*
+ * Magnitude pruning: sort the weight blocks (the VOL_BLOCK weights of one
+ * input channel and filter tap, which conv_sparse handles as a unit) by
+ * their L1 norm and zero the smallest fraction of them.
+ */
+
+typedef struct weight_rank {
+    double norm;
+    int index;
+} weight_rank_t;
+
+static int compare_rank(const void* a, const void* b) {
+    double na = ((const weight_rank_t*)a)->norm;
+    double nb = ((const weight_rank_t*)b)->norm;
+    return (na > nb) - (na < nb);
+}
+
+void conv_prune(conv_layer_t* l, double fraction) {
+    int taps = l->sy * l->sx * l->in_depth;
+    int blocks = l->out_depth / VOL_BLOCK * taps;
+    weight_rank_t* rank = (weight_rank_t*)malloc(sizeof(weight_rank_t) * blocks);
+    for (int i = 0; i < blocks; i++) {
+        rank[i].norm = 0.0;
+        rank[i].index = i;
+        for (int k = 0; k < VOL_BLOCK; k++)
+            rank[i].norm += fabs(l->packed[i * VOL_BLOCK + k]);
+    }
+    qsort(rank, blocks, sizeof(weight_rank_t), compare_rank);
+
+    for (int r = 0; r < (int)(fraction * blocks); r++) {
+        int ob = rank[r].index / taps;
+        int t = rank[r].index % taps;
+        int c = t % l->in_depth;
+        int fx = (t / l->in_depth) % l->sx;
+        int fy = t / l->in_depth / l->sx;
+        for (int k = 0; k < VOL_BLOCK; k++)
+            set_vol(l->filters[ob * VOL_BLOCK + k], fx, fy, c, 0.0);
+    }
+    free(rank);
+
+    conv_pack(l);
+}
+
+/*
+ * Number of multiply-adds the forward function of a layer performs per image
+ * (ignoring that taps outside the input are skipped at the border).
+ */
+
+long conv_macs(conv_layer_t* l) {
+    long taps = (long)l->out_depth * l->sy * l->sx * l->in_depth;
+    if (l->sp_start != NULL)
+        taps = (long)l->sp_start[l->out_depth / VOL_BLOCK] * VOL_BLOCK;
+    return taps * l->out_sx * l->out_sy;
 }
 
 // Relu Layer -----------------------------------------------------------------
@@ -363,29 +912,28 @@ relu_layer_t* make_relu_layer(int in_sx, int in_sy, int in_depth) {
     return l;
 }
 
-void relu_forward_1(relu_layer_t* l, vol_t** in, vol_t** out) {
-    //for (int j = start; j <= end; j++) {
-        for (int i = 0; i < 16384; i++) {
-            out[0]->w[i] = (in[0]->w[i] < 0.0) ? 0.0 : in[0]->w[i];
-        }
-    //}
+/*
+ * The activations are stored contiguously no matter how they are blocked,
+ * so ReLU is a plain vector max over n values.
+ */
+
+static inline void relu_blocked(const store_t* V_w, store_t* A_w, int n) {
+    const __m256d zero = _mm256_setzero_pd();
+    for (int i = 0; i < n; i += VOL_BLOCK) {
+        st_store(A_w + i, _mm256_max_pd(zero, st_load(V_w + i)));
+    }
 }
 
+void relu_forward_1(relu_layer_t* l, vol_t** in, vol_t** out) {
+    relu_blocked(in[0]->b, out[0]->b, 16384);
+}
 
 void relu_forward_2(relu_layer_t* l, vol_t** in, vol_t** out) {
-    //for (int j = start; j <= end; j++) {
-        for (int i = 0; i < 5120; i++) {
-            out[0]->w[i] = (in[0]->w[i] < 0.0) ? 0.0 : in[0]->w[i];
-        }
-    //}
+    relu_blocked(in[0]->b, out[0]->b, 5120);
 }
 
 void relu_forward_3(relu_layer_t* l, vol_t** in, vol_t** out) {
-    //for (int j = start; j <= end; j++) {
-        for (int i = 0; i < 1280; i++) {
-            out[0]->w[i] = (in[0]->w[i] < 0.0) ? 0.0 : in[0]->w[i];
-        }
-    //}
+    relu_blocked(in[0]->b, out[0]->b, 1280);
 }
 
 // Pool Layer -----------------------------------------------------------------
@@ -431,106 +979,40 @@ pool_layer_t* make_pool_layer(int in_sx, int in_sy, int in_depth,
     return l;
 }
 
-void pool_forward_1(pool_layer_t* l, vol_t** in, vol_t** out) {
-    //for (int i = start; i <= end; i++) {
-        vol_t* V = in[0];
-        vol_t* A = out[0];
-        double* V_w = V->w;
-        
-        int n=0;
-        for(int d=0;d<16;d++) {
-            int x = 0;
-            for(int ax=0; ax<16; x+=2,ax++) {
-                int y = 0;
-                for(int ay=0; ay<16; y+=2,ay++) {
-                    double a = -99999;
-                    for(int fx=0;fx<2;fx++) {
-                        int ox = x+fx;
-                        if(ox>=0 && ox<32){
-                            for(int fy=0;fy<2;fy++) {
-                                int oy = y+fy;
-                                if(oy>=0 && oy<32) {
-                                    double v = *(V_w + ((V->sx * oy)+ox)*16+d);
-                                    if(v > a) { a = v; }
-                                }
-                            }
-                        }
-                    }
-                    n++;
-                    set_vol(A, ax, ay, d, a);
-                }
+/*
+ * 2x2 max pooling with stride 2 of a channel-blocked size x size x depth
+ * volume. Every vector covers VOL_BLOCK channels of one pixel.
+ */
+
+static inline void pool_blocked(const store_t* V_w, store_t* A_w, int size, int depth) {
+    int out_size = size / 2;
+    for(int cb = 0; cb < depth / VOL_BLOCK; cb++) {
+        const store_t* V_b = V_w + cb * size * size * VOL_BLOCK;
+        store_t* A_b = A_w + cb * out_size * out_size * VOL_BLOCK;
+        for(int ay = 0; ay < out_size; ay++) {
+            const store_t* r0 = V_b + 2 * ay * size * VOL_BLOCK;
+            const store_t* r1 = r0 + size * VOL_BLOCK;
+            for(int ax = 0; ax < out_size; ax++) {
+                __m256d a = _mm256_max_pd(st_load(r0 + 2 * ax * VOL_BLOCK),
+                                          st_load(r0 + (2 * ax + 1) * VOL_BLOCK));
+                __m256d b = _mm256_max_pd(st_load(r1 + 2 * ax * VOL_BLOCK),
+                                          st_load(r1 + (2 * ax + 1) * VOL_BLOCK));
+                st_store(A_b + (out_size * ay + ax) * VOL_BLOCK, _mm256_max_pd(a, b));
             }
         }
-    //}
+    }
 }
 
+void pool_forward_1(pool_layer_t* l, vol_t** in, vol_t** out) {
+    pool_blocked(in[0]->b, out[0]->b, 32, 16);
+}
 
 void pool_forward_2(pool_layer_t* l, vol_t** in, vol_t** out) {
-    //for (int i = start; i <= end; i++) {
-        vol_t* V = in[0];
-        vol_t* A = out[0];
-        double* V_w = V->w;
-
-        int n=0;
-        for(int d=0;d<20;d++) {
-            int x = 0;
-            for(int ax=0; ax<8; x+=2,ax++) {
-                int y = 0;
-                for(int ay=0; ay<8; y+=2,ay++) {
-                    double a = -99999;
-                    for(int fx=0;fx<2;fx++) {
-                        int ox = x+fx;
-                        if(ox>=0 && ox<16){
-                            for(int fy=0;fy<2;fy++) {
-                                int oy = y+fy;
-                                if(oy>=0 && oy<16) {
-                                    
-                                    double v = *(V_w + ((V->sx * oy)+ox)*20+d);
-                                    if(v > a) { a = v; }
-                                }
-                            }
-                        }
-                    }
-                    n++;
-                    set_vol(A, ax, ay, d, a);
-                }
-            }
-        }
-    //}
+    pool_blocked(in[0]->b, out[0]->b, 16, 20);
 }
 
-
 void pool_forward_3(pool_layer_t* l, vol_t** in, vol_t** out) {
-    //for (int i = start; i <= end; i++) {
-        vol_t* V = in[0];
-        vol_t* A = out[0];
-        double* V_w = V->w;
-        
-        int n=0;
-        for(int d=0;d<20;d++) {
-            int x = 0;
-            for(int ax=0; ax<4; x+=2,ax++) {
-                int y = 0;
-                for(int ay=0; ay<4; y+=2,ay++) {
-                    double a = -99999;
-                    for(int fx=0;fx<2;fx++) {
-                        int ox = x+fx;
-                        if(ox>=0 && ox<8){
-                            for(int fy=0;fy<2;fy++) {
-                                int oy = y+fy;
-                                if(oy>=0 && oy<8) {
-                                    double v = *(V_w + ((V->sx * oy)+ox)*20+d);
-                                    if(v > a) { a = v; }
-                                }
-                            }
-                        }
-                    }
-                    n++;
-                    set_vol(A, ax, ay, d, a);
-                }
-            }
-        }
-    //}
+    pool_blocked(in[0]->b, out[0]->b, 8, 20);
 }
 
 
@@ -554,6 +1036,18 @@ typedef struct fc_layer {
     double bias;
     vol_t* biases;
     vol_t** filters;
+
+    // weights of all neurons in the order of the channel-blocked input,
+    // either in packed_buf or in the embedded weights
+    double* packed;
+    double* packed_buf;
+
+    // sparse form of packed, only set if at least SPARSE_MIN of the weights
+    // are zero: neuron i multiplies the inputs sp_idx[e] with the weights
+    // sp_w[e] for sp_start[i] <= e < sp_start[i+1]
+    int* sp_start;
+    int* sp_idx;
+    double* sp_w;
 } fc_layer_t;
 
 fc_layer_t* make_fc_layer(int in_sx, int in_sy, int in_depth,
@@ -582,20 +1076,122 @@ fc_layer_t* make_fc_layer(int in_sx, int in_sy, int in_depth,
     
     l->bias = 0.0;
     l->biases = make_vol(1, 1, l->out_depth, l->bias);
+
+    l->packed = l->packed_buf = (double*)malloc(sizeof(double)*l->out_depth*l->num_inputs);
+    l->sp_start = NULL;
+    l->sp_idx = NULL;
+    l->sp_w = NULL;
     
     return l;
 }
 
+void free_fc_layer(fc_layer_t* l) {
+    for (int i = 0; i < l->out_depth; i++)
+        free_vol(l->filters[i]);
+    free(l->filters);
+    free_vol(l->biases);
+    free(l->packed_buf);
+    free(l->sp_start);
+    free(l->sp_idx);
+    free(l->sp_w);
+    free(l);
+}
+
+/*
+ * Build the sparse form of the packed weights if at least SPARSE_MIN of them
+ * are zero.
+ */
+
+static void fc_packed(fc_layer_t* l) {
+    free(l->sp_start);
+    free(l->sp_idx);
+    free(l->sp_w);
+    l->sp_start = NULL;
+    l->sp_idx = NULL;
+    l->sp_w = NULL;
+
+    int total = l->out_depth * l->num_inputs;
+    int nonzero = 0;
+    for (int i = 0; i < total; i++)
+        if (l->packed[i] != 0.0)
+            nonzero++;
+    if (nonzero > (1.0 - SPARSE_MIN) * total)
+        return;
+
+    l->sp_start = (int*)malloc(sizeof(int) * (l->out_depth + 1));
+    l->sp_idx = (int*)malloc(sizeof(int) * (nonzero + 1));
+    l->sp_w = (double*)malloc(sizeof(double) * (nonzero + 1));
+    int e = 0;
+    for (int i = 0; i < l->out_depth; i++) {
+        l->sp_start[i] = e;
+        for (int d = 0; d < l->num_inputs; d++) {
+            double w = l->packed[i * l->num_inputs + d];
+            if (w != 0.0) {
+                l->sp_idx[e] = d;
+                l->sp_w[e] = w;
+                e++;
+            }
+        }
+    }
+    l->sp_start[l->out_depth] = e;
+}
+
+/*
+ * The weights in the snapshot are ordered like an interleaved input volume.
+ * Rearrange them to match the channel-blocked volume the FC layer gets.
+ */
+
+void fc_pack(fc_layer_t* l) {
+    l->packed = l->packed_buf;
+    for (int i = 0; i < l->out_depth; i++) {
+        double* w = l->packed + i * l->num_inputs;
+        for (int cb = 0; cb < l->in_depth / VOL_BLOCK; cb++)
+            for (int y = 0; y < l->in_sy; y++)
+                for (int x = 0; x < l->in_sx; x++)
+                    for (int k = 0; k < VOL_BLOCK; k++)
+                        *(w++) = l->filters[i]->w[(l->in_sx * y + x) * l->in_depth + cb * VOL_BLOCK + k];
+    }
+
+    fc_packed(l);
+}
+
+/*
+ * The inverse of fc_pack for weights that come packed already.
+ */
+
+void fc_unpack(fc_layer_t* l) {
+    for (int i = 0; i < l->out_depth; i++) {
+        const double* w = l->packed + i * l->num_inputs;
+        for (int cb = 0; cb < l->in_depth / VOL_BLOCK; cb++)
+            for (int y = 0; y < l->in_sy; y++)
+                for (int x = 0; x < l->in_sx; x++)
+                    for (int k = 0; k < VOL_BLOCK; k++)
+                        l->filters[i]->w[(l->in_sx * y + x) * l->in_depth + cb * VOL_BLOCK + k] = *(w++);
+    }
+
+    fc_packed(l);
+}
+
 void fc_forward(fc_layer_t* l, vol_t** in, vol_t** out) {
     //for (int j = start; j <= end; j++) {
         vol_t* V = in[0];
         vol_t* A = out[0];
-        double* V_w = V->w;
+        double V_w[320] __attribute__((aligned(32)));
+        for(int d=0;d<320;d+=VOL_BLOCK) {
+            _mm256_store_pd(V_w + d, st_load(V->b + d));
+        }
 
         for(int i=0;i<10;i++) {
             double a = 0.0;
-            for(int d=0;d<320;d++) {
-                a += *(V_w + d) * l->filters[i]->w[d];
+            if (l->sp_start != NULL) {
+                for(int e=l->sp_start[i];e<l->sp_start[i+1];e++) {
+                    a += *(V_w + l->sp_idx[e]) * l->sp_w[e];
+                }
+            } else {
+                double* f_w = l->packed + i * 320;
+                for(int d=0;d<320;d++) {
+                    a += *(V_w + d) * *(f_w + d);
+                }
             }
             a += l->biases->w[i];
             A->w[i] = a;
@@ -603,28 +1199,136 @@ void fc_forward(fc_layer_t* l, vol_t** in, vol_t** out) {
     //}
 }
 
-void fc_load(fc_layer_t* l, const char* fn) {
+/*
+ * Cross-image variant of the FC layer: the inputs of IMG_LANES images are
+ * transposed to [input][image], so each weight is broadcast once for all of
+ * them, and the results are transposed back.
+ */
+
+void fc_forward_x4(fc_layer_t* l, vol_t** in, vol_t** out) {
+    double x[320 * IMG_LANES] __attribute__((aligned(32)));
+    double a[10 * IMG_LANES] __attribute__((aligned(32)));
+
+    for(int d = 0; d < 320; d += 4) {
+        __m256d r[IMG_LANES];
+        for(int i = 0; i < IMG_LANES; i++)
+            r[i] = st_load(in[i]->b + d);
+        transpose_4x4(r);
+        for(int j = 0; j < 4; j++)
+            _mm256_store_pd(x + (d + j) * IMG_LANES, r[j]);
+    }
+
+    for(int i = 0; i < 10; i++) {
+        __m256d sum = _mm256_setzero_pd();
+        if (l->sp_start != NULL) {
+            for(int e = l->sp_start[i]; e < l->sp_start[i + 1]; e++)
+                sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_load_pd(x + l->sp_idx[e] * IMG_LANES),
+                                                       _mm256_broadcast_sd(l->sp_w + e)));
+        } else {
+            double* f_w = l->packed + i * 320;
+            for(int d = 0; d < 320; d++)
+                sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_load_pd(x + d * IMG_LANES),
+                                                       _mm256_broadcast_sd(f_w + d)));
+        }
+        _mm256_store_pd(a + i * IMG_LANES, _mm256_add_pd(sum, _mm256_broadcast_sd(l->biases->w + i)));
+    }
+
+    for(int j = 0; j < IMG_LANES; j++)
+        for(int i = 0; i < 10; i++)
+            out[j]->w[i] = a[i * IMG_LANES + j];
+}
+
+/*
+ * Load the weights and biases of a fully connected layer from a snapshot
+ * file. Returns 0 on success and -1 on a missing, mismatching or truncated
+ * file.
+ */
+
+int fc_load(fc_layer_t* l, const char* fn) {
     FILE* fin = fopen(fn, "r");
+    if (fin == NULL)
+        return -1;
     int num_inputs;
     int out_depth;
-    fscanf(fin, "%d %d", &num_inputs, &out_depth);
-    assert(out_depth == l->out_depth);
-    assert(num_inputs == l->num_inputs);
+    if (fscanf(fin, "%d %d", &num_inputs, &out_depth) != 2 ||
+        out_depth != l->out_depth || num_inputs != l->num_inputs) {
+        fclose(fin);
+        return -1;
+    }
     
     for(int i = 0; i < l->out_depth; i++)
         for(int d = 0; d < l->num_inputs; d++) {
             double val;
-            fscanf(fin, "%lf", &val);
+            if (!read_weight(fin, &val)) {
+                fclose(fin);
+                return -1;
+            }
             l->filters[i]->w[d] = val;
         }
     
     for(int i = 0; i < l->out_depth; i++) {
         double val;
-        fscanf(fin, "%lf", &val);
+        if (!read_weight(fin, &val)) {
+            fclose(fin);
+            return -1;
+        }
         l->biases->w[i] = val;
     }
     
     fclose(fin);
+    fc_pack(l);
+    return 0;
+}
+
+/*
+ * Store the weights and biases of a fully connected layer in the format read
+ * by fc_load. Returns 0 on success and -1 if the file cannot be written.
+ */
+
+int fc_save(fc_layer_t* l, const char* fn) {
+    FILE* fout = fopen(fn, "w");
+    if (fout == NULL)
+        return -1;
+
+    fprintf(fout, "%d %d\n", l->num_inputs, l->out_depth);
+    for(int i = 0; i < l->out_depth; i++)
+        for(int d = 0; d < l->num_inputs; d++)
+            fprintf(fout, "%.20lf\n", l->filters[i]->w[d]);
+    for(int i = 0; i < l->out_depth; i++)
+        fprintf(fout, "%.20lf\n", l->biases->w[i]);
+
+    return fclose(fout) == 0 ? 0 : -1;
+}
+
+/*
+ * Magnitude pruning: zero the given fraction of the weights with the smallest
+ * absolute value.
+ */
+
+void fc_prune(fc_layer_t* l, double fraction) {
+    int total = l->out_depth * l->num_inputs;
+    weight_rank_t* rank = (weight_rank_t*)malloc(sizeof(weight_rank_t) * total);
+    for (int i = 0; i < total; i++) {
+        rank[i].norm = fabs(l->filters[i / l->num_inputs]->w[i % l->num_inputs]);
+        rank[i].index = i;
+    }
+    qsort(rank, total, sizeof(weight_rank_t), compare_rank);
+
+    for (int r = 0; r < (int)(fraction * total); r++)
+        l->filters[rank[r].index / l->num_inputs]->w[rank[r].index % l->num_inputs] = 0.0;
+    free(rank);
+
+    fc_pack(l);
+}
+
+/*
+ * Number of multiply-adds of the forward function per image.
+ */
+
+long fc_macs(fc_layer_t* l) {
+    if (l->sp_start != NULL)
+        return l->sp_start[l->out_depth];
+    return (long)l->out_depth * l->num_inputs;
 }
 
 // Softmax Layer --------------------------------------------------------------
@@ -663,6 +1367,11 @@ softmax_layer_t* make_softmax_layer(int in_sx, int in_sy, int in_depth) {
     return l;
 }
 
+void free_softmax_layer(softmax_layer_t* l) {
+    free(l->es);
+    free(l);
+}
+
 void softmax_forward(softmax_layer_t* l, vol_t** in, vol_t** out) {
     double es[MAX_ES];
     
@@ -689,6 +1398,220 @@ void softmax_forward(softmax_layer_t* l, vol_t** in, vol_t** out) {
     //}
 }
 
+/*
+ * Vectorized exp for the softmax. x is reduced to r = x - n*ln(2) with |r| <=
+ * ln(2)/2, e^r comes from its Taylor polynomial of degree 13 and 2^n is put
+ * directly into the exponent bits. Accurate to a few ulp for |x| < 700;
+ * smaller inputs are clamped, their exponentials vanish next to e^0 anyway.
+ */
+
+static inline __m256d exp_pd(__m256d x) {
+    static const double inv_fact[14] = {
+        1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040,
+        1.0 / 40320, 1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800,
+        1.0 / 479001600, 1.0 / 6227020800.0
+    };
+
+    x = _mm256_max_pd(x, _mm256_set1_pd(-700.0));
+    __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.44269504088896340736)),
+                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_sub_pd(x, _mm256_mul_pd(n, _mm256_set1_pd(6.93147180369123816490e-01)));
+    r = _mm256_sub_pd(r, _mm256_mul_pd(n, _mm256_set1_pd(1.90821492927058770002e-10)));
+
+    __m256d p = _mm256_set1_pd(inv_fact[13]);
+    for (int k = 12; k >= 0; k--)
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(inv_fact[k]));
+
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm256_cvtpd_epi32(n), _mm_set1_epi32(1023)), 20);
+    __m128i lo = _mm_unpacklo_epi32(_mm_setzero_si128(), e);
+    __m128i hi = _mm_unpackhi_epi32(_mm_setzero_si128(), e);
+    __m256d scale = _mm256_castsi256_pd(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+    return _mm256_mul_pd(p, scale);
+}
+
+/*
+ * Cross-image variant of softmax: computes the maximum, the exponentials and
+ * the normalization of IMG_LANES images in the lanes of one vector each.
+ */
+
+void softmax_forward_x4(softmax_layer_t* l, vol_t** in, vol_t** out) {
+    double es[MAX_ES * IMG_LANES] __attribute__((aligned(32)));
+
+    for(int i = 0; i < 10; i++)
+        for(int j = 0; j < IMG_LANES; j++)
+            es[i * IMG_LANES + j] = in[j]->w[i];
+
+    // compute max activation
+    __m256d amax = _mm256_load_pd(es);
+    for(int i = 1; i < 10; i++)
+        amax = _mm256_max_pd(amax, _mm256_load_pd(es + i * IMG_LANES));
+
+    // compute exponentials (carefully to not blow up)
+    __m256d esum = _mm256_setzero_pd();
+    for(int i = 0; i < 10; i++) {
+        double* e = es + i * IMG_LANES;
+        __m256d x = exp_pd(_mm256_sub_pd(_mm256_load_pd(e), amax));
+        _mm256_store_pd(e, x);
+        esum = _mm256_add_pd(esum, x);
+    }
+
+    // normalize and output to sum to one
+    for(int i = 0; i < 10; i++) {
+        _mm256_store_pd(es + i * IMG_LANES, _mm256_div_pd(_mm256_load_pd(es + i * IMG_LANES), esum));
+        for(int j = 0; j < IMG_LANES; j++)
+            out[j]->w[i] = es[i * IMG_LANES + j];
+    }
+}
+
+// Classifier Head ------------------------------------------------------------
+
+/*
+ * The FC and softmax layers are tiny per image, so for classification they
+ * run once per mini-batch of up to MAX_HEAD_BATCH images instead (see
+ * network_t::head_batch, HEAD_BATCH by default): the outputs of
+ * the last pool layer are transposed into a 320 x N block with one image per
+ * vector lane, multiplied with the packed 10 x 320 weight panel of the FC
+ * layer, and softmax is applied to each column with vector operations.
+ */
+
+#define HEAD_BATCH 32
+#define MAX_HEAD_BATCH 64
+
+// Label that asks head_forward and net_classify for all classes.
+#define ALL_CLASSES (-1)
+
+/*
+ * Run FC and softmax for the n images whose pool outputs are in[0..n-1] and
+ * write the probability of class label of image j to out[j]. The others are
+ * never stored, unless label is ALL_CLASSES: then out[10*j...10*j+9] receives
+ * all probabilities of image j.
+ */
+
+void head_forward(fc_layer_t* l, vol_t** in, int n, int label, double* out) {
+    int cols = (n + IMG_LANES - 1) / IMG_LANES * IMG_LANES;
+    double x[320 * MAX_HEAD_BATCH] __attribute__((aligned(32)));
+    assert(n <= MAX_HEAD_BATCH);
+
+    // transpose to x[d][image]
+    for(int g = 0; g < cols; g += IMG_LANES) {
+        for(int d = 0; d < 320; d += 4) {
+            __m256d r[IMG_LANES];
+            for(int i = 0; i < IMG_LANES; i++)
+                r[i] = (g + i < n) ? st_load(in[g + i]->b + d) : _mm256_setzero_pd();
+            transpose_4x4(r);
+            for(int j = 0; j < 4; j++)
+                _mm256_store_pd(x + (d + j) * cols + g, r[j]);
+        }
+    }
+
+    for(int g = 0; g < cols; g += IMG_LANES) {
+        // a[i] holds neuron i of IMG_LANES images
+        __m256d a[10];
+        for(int i = 0; i < 10; i++)
+            a[i] = _mm256_setzero_pd();
+        if (l->sp_start != NULL) {
+            for(int i = 0; i < 10; i++)
+                for(int e = l->sp_start[i]; e < l->sp_start[i + 1]; e++)
+                    a[i] = _mm256_add_pd(a[i], _mm256_mul_pd(_mm256_load_pd(x + l->sp_idx[e] * cols + g),
+                                                             _mm256_broadcast_sd(l->sp_w + e)));
+        } else {
+            for(int d = 0; d < 320; d++) {
+                __m256d v = _mm256_load_pd(x + d * cols + g);
+                for(int i = 0; i < 10; i++)
+                    a[i] = _mm256_add_pd(a[i], _mm256_mul_pd(v, _mm256_broadcast_sd(l->packed + i * 320 + d)));
+            }
+        }
+
+        // softmax of every lane
+        __m256d amax = a[0] = _mm256_add_pd(a[0], _mm256_broadcast_sd(l->biases->w));
+        for(int i = 1; i < 10; i++) {
+            a[i] = _mm256_add_pd(a[i], _mm256_broadcast_sd(l->biases->w + i));
+            amax = _mm256_max_pd(amax, a[i]);
+        }
+        __m256d esum = _mm256_setzero_pd();
+        for(int i = 0; i < 10; i++) {
+            a[i] = exp_pd(_mm256_sub_pd(a[i], amax));
+            esum = _mm256_add_pd(esum, a[i]);
+        }
+
+        double p[IMG_LANES] __attribute__((aligned(32)));
+        if (label == ALL_CLASSES) {
+            for(int i = 0; i < 10; i++) {
+                _mm256_store_pd(p, _mm256_div_pd(a[i], esum));
+                for(int j = 0; j < IMG_LANES && g + j < n; j++)
+                    out[(g + j) * 10 + i] = p[j];
+            }
+        } else {
+            _mm256_store_pd(p, _mm256_div_pd(a[label], esum));
+            for(int j = 0; j < IMG_LANES && g + j < n; j++)
+                out[g + j] = p[j];
+        }
+    }
+}
+
+// Cascade --------------------------------------------------------------------
+
+/*
+ * An optional cheap first stage in front of the rest of the network. The
+ * output of the first pool layer (16x16x16) is averaged over 4x4 cells into
+ * CASCADE_FEATURES values, and a logistic unit on them estimates the cat
+ * probability that the full network would give. Images with an estimate
+ * below network_t::cascade_threshold stop there and get the estimate as their
+ * output, all others go on through the remaining layers. The weights are
+ * fitted to the outputs of the full network by 'cnn cascade train'.
+ */
+
+#define CASCADE_CELL 4
+#define CASCADE_FEATURES ((16 / CASCADE_CELL) * (16 / CASCADE_CELL) * 16)
+
+typedef struct cascade {
+    double w[CASCADE_FEATURES] __attribute__((aligned(32)));
+    double bias;
+} cascade_t;
+
+/*
+ * Average the channel-blocked 16x16x16 volume v over 4x4 cells. f receives
+ * the averages in the same blocked order: (channel block, cell, channel).
+ */
+
+void cascade_features(vol_t* v, double* f) {
+    const __m256d scale = _mm256_set1_pd(1.0 / (CASCADE_CELL * CASCADE_CELL));
+    for (int cb = 0; cb < 16 / VOL_BLOCK; cb++) {
+        __m256d acc[(16 / CASCADE_CELL) * (16 / CASCADE_CELL)];
+        for (int c = 0; c < (16 / CASCADE_CELL) * (16 / CASCADE_CELL); c++)
+            acc[c] = _mm256_setzero_pd();
+        const store_t* V_b = v->b + cb * 16 * 16 * VOL_BLOCK;
+        for (int y = 0; y < 16; y++)
+            for (int x = 0; x < 16; x++) {
+                int c = (y / CASCADE_CELL) * (16 / CASCADE_CELL) + x / CASCADE_CELL;
+                acc[c] = _mm256_add_pd(acc[c], st_load(V_b + (y * 16 + x) * VOL_BLOCK));
+            }
+        for (int c = 0; c < (16 / CASCADE_CELL) * (16 / CASCADE_CELL); c++)
+            _mm256_storeu_pd(f + (cb * (16 / CASCADE_CELL) * (16 / CASCADE_CELL) + c) * VOL_BLOCK,
+                             _mm256_mul_pd(acc[c], scale));
+    }
+}
+
+/*
+ * Estimated cat probability of an image, from its features f (aligned) or
+ * from its first pool output v.
+ */
+
+double cascade_score(cascade_t* c, const double* f) {
+    __m256d acc = _mm256_setzero_pd();
+    for (int i = 0; i < CASCADE_FEATURES; i += 4)
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_load_pd(f + i), _mm256_load_pd(c->w + i)));
+    double a[4] __attribute__((aligned(32)));
+    _mm256_store_pd(a, acc);
+    return 1.0 / (1.0 + exp(-(a[0] + a[1] + a[2] + a[3] + c->bias)));
+}
+
+double cascade_forward(cascade_t* c, vol_t* v) {
+    double f[CASCADE_FEATURES] __attribute__((aligned(32)));
+    cascade_features(v, f);
+    return cascade_score(c, f);
+}
+
 // Neural Network -------------------------------------------------------------
 
 /*
@@ -699,6 +1622,10 @@ void softmax_forward(softmax_layer_t* l, vol_t** in, vol_t** out) {
 
 #define LAYERS 11
 
+// Defaults for network_t::cross_image and network_t::batched_head.
+#define CROSS_IMAGE 1
+#define BATCHED_HEAD 1
+
 typedef struct network {
     vol_t* v[LAYERS+1];
     conv_layer_t* l0;
@@ -712,8 +1639,121 @@ typedef struct network {
     pool_layer_t* l8;
     fc_layer_t* l9;
     softmax_layer_t* l10;
+
+    // use the cross-image variants of the first, FC and softmax layers
+    int cross_image;
+    // classify with head_forward instead of the FC and softmax layers
+    int batched_head;
+    // number of images per head_forward call (at most MAX_HEAD_BATCH)
+    int head_batch;
+    // with the batched head, run the conv/ReLU/pool stage groups one after
+    // the other over tiles of this many images (see net_forward_tiled), 0
+    // to run all layers on IMG_LANES images at a time
+    int stage_tile;
+
+    // first stage for cat classification, NULL if off (see cascade_t)
+    cascade_t* cascade;
+    double cascade_threshold;
+    // images that passed the first stage so far
+    long cascade_passed;
+
+    // scratch volumes that net_classify keeps between calls, one set per
+    // thread that is running it (see scratch_get)
+    struct scratch* scratch;
+    pthread_mutex_t scratch_lock;
 } network_t;
 
+/*
+ * Stage group tiling: net_forward_tiled (further below) runs the first
+ * conv/ReLU/pool stage group over a whole tile of images, then the second
+ * one, then the third, instead of taking IMG_LANES images through all
+ * layers at a time. Each conv layer's weights are then loaded once per
+ * tile, and the outputs of a group are still in L2 when the next group
+ * reads them.
+ *
+ * pick_stage_tile chooses the largest tile, in steps of IMG_LANES, for which
+ * what every group touches (stage_bytes) stays within STAGE_CACHE_SHARE of
+ * the L2 cache, leaving the rest to the code, the stack and the head.
+ * Tiling is off by default (STAGE_TILE), since it has not shown a measured
+ * win on its own; 'cnn tune' turns it on where it is faster.
+ */
+
+#define STAGE_GROUPS 3
+#define STAGE_CACHE_SHARE 0.75
+#define DEFAULT_L2 (1 << 20)
+
+// Default for network_t::stage_tile.
+#define STAGE_TILE 0
+
+long stage_vol_bytes(vol_t* v) {
+    return (long)sizeof(store_t) * v->sx * v->sy * v->depth;
+}
+
+long stage_weight_bytes(conv_layer_t* l) {
+    long taps = conv_macs(l) / (l->out_sx * l->out_sy);
+    return taps * (l->sp_start != NULL ? sizeof(double) : sizeof(store_t)) +
+           sizeof(double) * l->out_depth;
+}
+
+/*
+ * Bytes stage group g (0 to 2) of net_forward_tiled touches for a tile of n
+ * images: the conv weights, the inputs and outputs of the tile and the
+ * scratch volumes.
+ */
+
+long stage_bytes(network_t* net, int g, int n) {
+    conv_layer_t* conv[STAGE_GROUPS] = { net->l0, net->l3, net->l6 };
+    long in = (g == 0) ? 32 * 32 * 3 : stage_vol_bytes(net->v[3*g]);
+    long scratch = ((g == 0) ? IMG_LANES : 1) * stage_vol_bytes(net->v[3*g + 1]);
+    return stage_weight_bytes(conv[g]) + n * (in + stage_vol_bytes(net->v[3*g + 3])) + scratch;
+}
+
+/*
+ * Bytes IMG_LANES images touch on their way through all conv/ReLU/pool
+ * layers without tiling: all conv weights and a volume per image and layer.
+ */
+
+long stage_interleaved_bytes(network_t* net) {
+    long bytes = stage_weight_bytes(net->l0) + stage_weight_bytes(net->l3) +
+                 stage_weight_bytes(net->l6) + IMG_LANES * 32 * 32 * 3;
+    for (int l = 1; l <= 3 * STAGE_GROUPS; l++)
+        bytes += IMG_LANES * stage_vol_bytes(net->v[l]);
+    return bytes;
+}
+
+/*
+ * Size of the L2 cache of this machine, DEFAULT_L2 if it cannot be found.
+ */
+
+long l2_cache_size() {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (size > 0)
+        return size;
+#endif
+    long kb = 0;
+    FILE* fin = fopen("/sys/devices/system/cpu/cpu0/cache/index2/size", "r");
+    if (fin != NULL) {
+        if (fscanf(fin, "%ldK", &kb) != 1)
+            kb = 0;
+        fclose(fin);
+    }
+    return (kb > 0) ? kb << 10 : DEFAULT_L2;
+}
+
+int pick_stage_tile(network_t* net, long cache) {
+    long budget = (long)(cache * STAGE_CACHE_SHARE);
+    int tile = IMG_LANES;
+    for (int n = 2 * IMG_LANES; n <= MAX_HEAD_BATCH; n += IMG_LANES) {
+        for (int g = 0; g < STAGE_GROUPS; g++) {
+            if (stage_bytes(net, g, n) > budget)
+                return tile;
+        }
+        tile = n;
+    }
+    return tile;
+}
+
 /*
  * Instantiate our specific CNN.
  */
@@ -722,30 +1762,41 @@ network_t* make_network() {
     network_t* net = (network_t*)malloc(sizeof(network_t));
     net->v[0] = make_vol(32, 32, 3, 0.0);
     net->l0 = make_conv_layer(32, 32, 3, 5, 16, 1, 2);
-    net->v[1] = make_vol(net->l0->out_sx, net->l0->out_sy, net->l0->out_depth, 0.0);
+    net->v[1] = make_blocked_vol(net->l0->out_sx, net->l0->out_sy, net->l0->out_depth, 0.0);
     net->l1 = make_relu_layer(net->v[1]->sx, net->v[1]->sy, net->v[1]->depth);
-    net->v[2] = make_vol(net->l1->out_sx, net->l1->out_sy, net->l1->out_depth, 0.0);
+    net->v[2] = make_blocked_vol(net->l1->out_sx, net->l1->out_sy, net->l1->out_depth, 0.0);
     net->l2 = make_pool_layer(net->v[2]->sx, net->v[2]->sy, net->v[2]->depth, 2, 2);
-    net->v[3] = make_vol(net->l2->out_sx, net->l2->out_sy, net->l2->out_depth, 0.0);
+    net->v[3] = make_blocked_vol(net->l2->out_sx, net->l2->out_sy, net->l2->out_depth, 0.0);
     net->l3 = make_conv_layer(net->v[3]->sx, net->v[3]->sy, net->v[3]->depth, 5, 20, 1, 2);
-    net->v[4] = make_vol(net->l3->out_sx, net->l3->out_sy, net->l3->out_depth, 0.0);
+    net->v[4] = make_blocked_vol(net->l3->out_sx, net->l3->out_sy, net->l3->out_depth, 0.0);
     net->l4 = make_relu_layer(net->v[4]->sx, net->v[4]->sy, net->v[4]->depth);
-    net->v[5] = make_vol(net->l4->out_sx, net->l4->out_sy, net->l4->out_depth, 0.0);
+    net->v[5] = make_blocked_vol(net->l4->out_sx, net->l4->out_sy, net->l4->out_depth, 0.0);
     net->l5 = make_pool_layer(net->v[5]->sx, net->v[5]->sy, net->v[5]->depth, 2, 2);
-    net->v[6] = make_vol(net->l5->out_sx, net->l5->out_sy, net->l5->out_depth, 0.0);
+    net->v[6] = make_blocked_vol(net->l5->out_sx, net->l5->out_sy, net->l5->out_depth, 0.0);
     net->l6 = make_conv_layer(net->v[6]->sx, net->v[6]->sy, net->v[6]->depth, 5, 20, 1, 2);
-    net->v[7] = make_vol(net->l6->out_sx, net->l6->out_sy, net->l6->out_depth, 0.0);
+    net->v[7] = make_blocked_vol(net->l6->out_sx, net->l6->out_sy, net->l6->out_depth, 0.0);
     net->l7 = make_relu_layer(net->v[7]->sx, net->v[7]->sy, net->v[7]->depth);
-    net->v[8] = make_vol(net->l7->out_sx, net->l7->out_sy, net->l7->out_depth, 0.0);
+    net->v[8] = make_blocked_vol(net->l7->out_sx, net->l7->out_sy, net->l7->out_depth, 0.0);
     net->l8 = make_pool_layer(net->v[8]->sx, net->v[8]->sy, net->v[8]->depth, 2, 2);
-    net->v[9] = make_vol(net->l8->out_sx, net->l8->out_sy, net->l8->out_depth, 0.0);
+    net->v[9] = make_blocked_vol(net->l8->out_sx, net->l8->out_sy, net->l8->out_depth, 0.0);
     net->l9 = make_fc_layer(net->v[9]->sx, net->v[9]->sy, net->v[9]->depth, 10);
     net->v[10] = make_vol(net->l9->out_sx, net->l9->out_sy, net->l9->out_depth, 0.0);
     net->l10 = make_softmax_layer(net->v[10]->sx, net->v[10]->sy, net->v[10]->depth);
     net->v[11] = make_vol(net->l10->out_sx, net->l10->out_sy, net->l10->out_depth, 0.0);
+    net->cross_image = CROSS_IMAGE;
+    net->batched_head = BATCHED_HEAD;
+    net->head_batch = HEAD_BATCH;
+    net->stage_tile = STAGE_TILE;
+    net->cascade = NULL;
+    net->cascade_threshold = 0.0;
+    net->cascade_passed = 0;
+    net->scratch = NULL;
+    pthread_mutex_init(&net->scratch_lock, NULL);
     return net;
 }
 
+void free_scratch(struct scratch* s);
+
 /*
  * Free our specific CNN.
  */
@@ -754,17 +1805,20 @@ void free_network(network_t* net) {
     for (int i = 0; i < LAYERS+1; i++)
         free_vol(net->v[i]);
     
-    free(net->l0);
+    free_conv_layer(net->l0);
     free(net->l1);
     free(net->l2);
-    free(net->l3);
+    free_conv_layer(net->l3);
     free(net->l4);
     free(net->l5);
-    free(net->l6);
+    free_conv_layer(net->l6);
     free(net->l7);
     free(net->l8);
-    free(net->l9);
-    free(net->l10);
+    free_fc_layer(net->l9);
+    free_softmax_layer(net->l10);
+    free(net->cascade);
+    free_scratch(net->scratch);
+    pthread_mutex_destroy(&net->scratch_lock);
     
     free(net);
 }
@@ -790,7 +1844,9 @@ batch_t* make_batch(network_t* old_net, int size) {
     for (int i = 0; i < LAYERS+1; i++) {
         out[i] = (vol_t**)malloc(sizeof(vol_t*)*size);
         for (int j = 0; j < size; j++) {
-            out[i][j] = make_vol(old_net->v[i]->sx, old_net->v[i]->sy, old_net->v[i]->depth, 0.0);
+            vol_t* v = old_net->v[i];
+            out[i][j] = v->blocked ? make_blocked_vol(v->sx, v->sy, v->depth, 0.0)
+                                   : make_vol(v->sx, v->sy, v->depth, 0.0);
         }
     }
     
@@ -812,123 +1868,271 @@ void free_batch(batch_t* v, int size) {
 }
 
 /*
- * Apply our network to a specific batch of inputs. The batch has to be given
- * as input to v and start/end are the first and the last image in that batch
- * to process (start and end are inclusive).
+ * Scratch volumes of one thread in net_classify: a batch for IMG_LANES
+ * images, the outputs of the last pool layer for up to MAX_HEAD_BATCH
+ * images (feats) and, once stage tiling is used, the v3/v6 volumes of a
+ * tile. net_classify takes a set from network_t::scratch, or makes a new
+ * one if there is none left, and puts it back when it is done, so the
+ * volumes are allocated once per thread and network instead of on every
+ * call. Concurrent calls each get their own set.
  */
 
+typedef struct scratch {
+    batch_t* batch;
+    vol_t** feats;
+    vol_t** v3;
+    vol_t** v6;
+    struct scratch* next;
+} scratch_t;
+
+static vol_t** make_scratch_vols(vol_t* like) {
+    vol_t** out = (vol_t**)malloc(sizeof(vol_t*)*MAX_HEAD_BATCH);
+    for (int j = 0; j < MAX_HEAD_BATCH; j++)
+        out[j] = make_blocked_vol(like->sx, like->sy, like->depth, 0.0);
+    return out;
+}
 
-uint64_t CONV_L1 = 0;
-uint64_t RELU_L1 = 0;
-uint64_t POOL_L1 = 0;
-uint64_t CONV_L2 = 0;
-uint64_t RELU_L2 = 0;
-uint64_t POOL_L2 = 0;
-uint64_t CONV_L3 = 0;
-uint64_t RELU_L3 = 0;
-uint64_t POOL_L3 = 0;
-uint64_t FC_L1 = 0;
-uint64_t SOFTMAX_L1 = 0;
-uint64_t TOTAL_TIME = 0;
+static void free_scratch_vols(vol_t** v) {
+    if (v == NULL)
+        return;
+    for (int j = 0; j < MAX_HEAD_BATCH; j++)
+        free_vol(v[j]);
+    free(v);
+}
 
-void net_forward(network_t* net, batch_t* v, int start, int end) {
-    //uint64_t time_start = 0, time_end = 0;
+static scratch_t* scratch_get(network_t* net, int tiled) {
+    pthread_mutex_lock(&net->scratch_lock);
+    scratch_t* s = net->scratch;
+    if (s != NULL)
+        net->scratch = s->next;
+    pthread_mutex_unlock(&net->scratch_lock);
+
+    if (s == NULL) {
+        s = (scratch_t*)calloc(1, sizeof(scratch_t));
+        s->batch = make_batch(net, IMG_LANES);
+        s->feats = make_scratch_vols(net->v[9]);
+    }
+    if (tiled && s->v3 == NULL) {
+        s->v3 = make_scratch_vols(net->v[3]);
+        s->v6 = make_scratch_vols(net->v[6]);
+    }
+    return s;
+}
 
-    //time_start = timestamp_us();
-    conv_forward_1(net->l0, v[0], v[1]);
-    // time_end = timestamp_us();
-    // CONV_L1 += (time_end - time_start);
+static void scratch_put(network_t* net, scratch_t* s) {
+    pthread_mutex_lock(&net->scratch_lock);
+    s->next = net->scratch;
+    net->scratch = s;
+    pthread_mutex_unlock(&net->scratch_lock);
+}
 
-    // time_start = timestamp_us();
-    relu_forward_1(net->l1, v[1], v[2] );
-    // time_end = timestamp_us();
-    // RELU_L1 += (time_end - time_start);
-    
-    // time_start = timestamp_us();
-    pool_forward_1(net->l2, v[2], v[3] );
-    // time_end = timestamp_us();
-    // POOL_L1 += (time_end - time_start);
+/*
+ * Free a list of scratch sets.
+ */
 
-    // time_start = timestamp_us(); 
-    conv_forward_2(net->l3, v[3], v[4]);
-    // time_end = timestamp_us();
-    // CONV_L2 += (time_end - time_start);
+void free_scratch(scratch_t* s) {
+    while (s != NULL) {
+        scratch_t* next = s->next;
+        free_batch(s->batch, IMG_LANES);
+        free_scratch_vols(s->feats);
+        free_scratch_vols(s->v3);
+        free_scratch_vols(s->v6);
+        free(s);
+        s = next;
+    }
+}
 
-    // time_start = timestamp_us();
-    relu_forward_2(net->l4, v[4], v[5] );
-    // time_end = timestamp_us();
-    // RELU_L2 += (time_end - time_start);
-    
-    // time_start = timestamp_us();
-    pool_forward_2(net->l5, v[5], v[6] );
-    // time_end = timestamp_us();
-    // POOL_L2 += (time_end - time_start);
-    
-    // time_start = timestamp_us();
-    conv_forward_3(net->l6, v[6], v[7]);
-    // time_end = timestamp_us();
-    // CONV_L3 += (time_end - time_start);
-    
-    // time_start = timestamp_us();
-    relu_forward_3(net->l7, v[7], v[8] );
-    // time_end = timestamp_us();
-    // RELU_L3 += (time_end - time_start);
-    
-    // time_start = timestamp_us();
-    pool_forward_3(net->l8, v[8], v[9] );
-    // time_end = timestamp_us();
-    // POOL_L3 += (time_end - time_start);
-    
-    // time_start = timestamp_us();
-    fc_forward(net->l9, v[9], v[10] );
-    // time_end = timestamp_us();
-    // FC_L1 += (time_end - time_start);
-    
-    // time_start = timestamp_us();
-    softmax_forward(net->l10, v[10], v[11]);
-    // time_end = timestamp_us();
-    // SOFTMAX_L1 += (time_end - time_start);
+/*
+ * Apply the layers up to the last pool layer to a specific batch of inputs.
+ * The input images are given as CIFAR records (without the label byte) in
+ * images, v receives the volumes of these layers, and start/end are the
+ * first and the last image in that batch to process (start and end are
+ * inclusive). A group of exactly IMG_LANES images goes through the
+ * cross-image variant of the first layer if it is enabled, the layers after
+ * it always work on one image at a time.
+ *
+ * net_forward_first only runs the first conv/ReLU/pool stage (up to v[3]),
+ * net_forward_rest the layers after it for image j, writing the output of
+ * the last pool layer to out[0].
+ */
+
+void net_forward_first(network_t* net, batch_t* v, const uint8_t** images, int start, int end) {
+    if (net->cross_image && end - start + 1 == IMG_LANES) {
+        conv_forward_1_x4(net->l0, images + start, v[1] + start);
+    } else {
+        for (int j = start; j <= end; j++)
+            conv_forward_1(net->l0, images + j, v[1] + j);
+    }
+
+    for (int j = start; j <= end; j++) {
+        relu_forward_1(net->l1, v[1] + j, v[2] + j);
+        pool_forward_1(net->l2, v[2] + j, v[3] + j);
+    }
+}
+
+static inline void net_forward_rest(network_t* net, batch_t* v, int j, vol_t** out) {
+    conv_forward_2(net->l3, v[3] + j, v[4] + j);
+    relu_forward_2(net->l4, v[4] + j, v[5] + j);
+    pool_forward_2(net->l5, v[5] + j, v[6] + j);
+    conv_forward_3(net->l6, v[6] + j, v[7] + j);
+    relu_forward_3(net->l7, v[7] + j, v[8] + j);
+    pool_forward_3(net->l8, v[8] + j, out);
+}
+
+void net_forward_body(network_t* net, batch_t* v, const uint8_t** images, int start, int end) {
+    net_forward_first(net, v, images, start, end);
+    for (int j = start; j <= end; j++)
+        net_forward_rest(net, v, j, v[9] + j);
 }
 
 /*
- * Putting everything together: Take a set of n input images as 3-dimensional
- * Volumes and process them using the CNN in batches of 1. Then look at the
+ * Apply the whole network to a specific batch of inputs, like
+ * net_forward_body, and fill the volumes of all layers.
+ */
+
+void net_forward(network_t* net, batch_t* v, const uint8_t** images, int start, int end) {
+    net_forward_body(net, v, images, start, end);
+
+    if (net->cross_image && end - start + 1 == IMG_LANES) {
+        fc_forward_x4(net->l9, v[9] + start, v[10] + start);
+        softmax_forward_x4(net->l10, v[10] + start, v[11] + start);
+    } else {
+        for (int j = start; j <= end; j++) {
+            fc_forward(net->l9, v[9] + j, v[10] + j);
+            softmax_forward(net->l10, v[10] + j, v[11] + j);
+        }
+    }
+}
+
+/*
+ * Apply the layers up to the last pool layer to a tile of n images, one
+ * stage group after the other (see pick_stage_tile). ReLU works in place,
+ * so only the conv output of the images in flight needs scratch space: v
+ * provides it (a batch of IMG_LANES), v3 and v6 hold the outputs of the
+ * first two groups for the n <= MAX_HEAD_BATCH images of the tile, and out
+ * receives those of the last pool layer.
+ */
+
+void net_forward_tiled(network_t* net, batch_t* v, vol_t** v3, vol_t** v6,
+                       const uint8_t** images, int n, vol_t** out) {
+    for (int g = 0; g < n; g += IMG_LANES) {
+        int m = (n - g < IMG_LANES) ? n - g : IMG_LANES;
+        if (net->cross_image && m == IMG_LANES) {
+            conv_forward_1_x4(net->l0, images + g, v[1]);
+        } else {
+            for (int j = 0; j < m; j++)
+                conv_forward_1(net->l0, images + g + j, v[1] + j);
+        }
+        for (int j = 0; j < m; j++) {
+            relu_forward_1(net->l1, v[1] + j, v[1] + j);
+            pool_forward_1(net->l2, v[1] + j, v3 + g + j);
+        }
+    }
+
+    for (int j = 0; j < n; j++) {
+        conv_forward_2(net->l3, v3 + j, v[4]);
+        relu_forward_2(net->l4, v[4], v[4]);
+        pool_forward_2(net->l5, v[4], v6 + j);
+    }
+
+    for (int j = 0; j < n; j++) {
+        conv_forward_3(net->l6, v6 + j, v[7]);
+        relu_forward_3(net->l7, v[7], v[7]);
+        pool_forward_3(net->l8, v[7], out + j);
+    }
+}
+
+/*
+ * Putting everything together: Take a set of n input images as CIFAR records
+ * and process them using the CNN in batches of IMG_LANES. Then look at the
  * output (which is a set of 10 labels, each of which tells us the likelihood
  * of a specific category) and classify the image as a cat iff the likelihood
  * of "cat" is larger than 50%. Writes the cat likelihood for all images into
  * an output array (0 = definitely no cat, 1 = definitely cat).
+ *
+ * With the batched head, the outputs of the last pool layer of head_batch
+ * images are collected in feats and classified together. They come from
+ * net_forward_tiled, tile by tile, if net->stage_tile is set.
+ *
+ * net_classify is the same for any label, or for all 10 classes with
+ * ALL_CLASSES, in which case output[10*i...10*i+9] are the probabilities of
+ * image i.
+ *
+ * With a cascade, the cat probability of the images it rejects is its
+ * estimate instead; the others take the batched head in any case.
  */
 
 #define CAT_LABEL 3
-void net_classify_cats(network_t* net, vol_t** input, double* output, int n) {
+void net_classify(network_t* net, const uint8_t** input, double* output, int n, int label) {
+    int width = (label == ALL_CLASSES) ? 10 : 1;
+    int cascade = net->cascade != NULL && label == CAT_LABEL;
+    int chunk = (net->batched_head || cascade) ? net->head_batch : IMG_LANES;
+
     #pragma omp parallel
     {
-        batch_t* batch = make_batch(net, 1);
-        #pragma omp for simd
-        for (int i = 0; i < n; i++) {
-            copy_vol(batch[0][0], input[i]);
-            net_forward(net, batch, 0 ,0 );
-            output[i] = batch[11][0]->w[3];
+        int tile = (net->batched_head && !cascade) ? net->stage_tile : 0;
+        scratch_t* s = scratch_get(net, tile > 0);
+        batch_t* batch = s->batch;
+        vol_t** pooled = batch[9];
+        vol_t** feats = s->feats;
+        vol_t** v3 = s->v3;
+        vol_t** v6 = s->v6;
+
+        #pragma omp for
+        for (int i = 0; i < n; i += chunk) {
+            int m = (n - i < chunk) ? n - i : chunk;
+            if (cascade) {
+                int kept[MAX_HEAD_BATCH];
+                double prob[MAX_HEAD_BATCH];
+                int k = 0;
+                for (int g = 0; g < m; g += IMG_LANES) {
+                    int e = (m - g < IMG_LANES) ? m - g - 1 : IMG_LANES - 1;
+                    net_forward_first(net, batch, input + i + g, 0, e);
+                    for (int j = 0; j <= e; j++) {
+                        double p = cascade_forward(net->cascade, batch[3][j]);
+                        if (p < net->cascade_threshold) {
+                            output[i + g + j] = p;
+                        } else {
+                            net_forward_rest(net, batch, j, feats + k);
+                            kept[k++] = i + g + j;
+                        }
+                    }
+                }
+                head_forward(net->l9, feats, k, label, prob);
+                for (int j = 0; j < k; j++)
+                    output[kept[j]] = prob[j];
+                #pragma omp atomic
+                net->cascade_passed += k;
+            } else if (tile > 0) {
+                for (int t = 0; t < m; t += tile)
+                    net_forward_tiled(net, batch, v3, v6, input + i + t,
+                                      (m - t < tile) ? m - t : tile, feats + t);
+                head_forward(net->l9, feats, m, label, output + i * width);
+            } else if (net->batched_head) {
+                for (int g = 0; g < m; g += IMG_LANES) {
+                    batch[9] = feats + g;
+                    net_forward_body(net, batch, input + i + g, 0,
+                                     (m - g < IMG_LANES) ? m - g - 1 : IMG_LANES - 1);
+                }
+                head_forward(net->l9, feats, m, label, output + i * width);
+            } else {
+                net_forward(net, batch, input + i, 0, m - 1);
+                for (int j = 0; j < m; j++) {
+                    if (label == ALL_CLASSES)
+                        memcpy(output + (i + j) * 10, batch[11][j]->w, sizeof(double) * 10);
+                    else
+                        output[i + j] = batch[11][j]->w[label];
+                }
+            }
         }
-        
-        free_batch(batch, 1);
-    }
-    // TOTAL_TIME = CONV_L1+CONV_L2+CONV_L3+
-    // RELU_L1+RELU_L2+RELU_L3+
-    // POOL_L1+POOL_L2+POOL_L3+
-    // FC_L1+SOFTMAX_L1;
-    // printf("CONV_L1 = %lu\n", CONV_L1);
-    // printf("RELU_L1 = %lu\n", RELU_L1);
-    // printf("POOL_L1 = %lu\n", POOL_L1);
-    // printf("CONV_L2 = %lu\n", CONV_L2);
-    // printf("RELU_L2 = %lu\n", RELU_L2);
-    // printf("POOL_L2 = %lu\n", POOL_L2);
-    // printf("CONV_L3 = %lu\n", CONV_L3);
-    // printf("RELU_L3 = %lu\n", RELU_L3);
-    // printf("POOL_L3 = %lu\n", POOL_L3);
-    // printf("FC_L1 = %lu\n", FC_L1);
-    // printf("SOFTMAX_L1 = %lu\n", SOFTMAX_L1);
-    // printf("TOTAL_TIME = %lu\n", TOTAL_TIME);
+
+        batch[9] = pooled;
+        scratch_put(net, s);
+    }
+}
+
+void net_classify_cats(network_t* net, const uint8_t** input, double* output, int n) {
+    net_classify(net, input, output, n, CAT_LABEL);
 }
 
 // IGNORE EVERYTHING BELOW THIS POINT -----------------------------------------
@@ -939,4 +2143,19 @@ void net_classify_cats(network_t* net, vol_t** input, double* output, int n) {
 // the different components of the system.
 
 #include "util.c"
+#include "libcnn.c"
+
+// The library builds (libcnn.so, cnnModule.so) define CNN_LIBRARY and only
+// get the context API, not the command line driver.
+
+#ifndef CNN_LIBRARY
+#include "shard.c"
+#include "stream.c"
+#include "perf.c"
+#include "sched.c"
+#include "cascade.c"
+#include "sweep.c"
+#include "gen.c"
+#include "apitest.c"
 #include "main.c"
+#endif
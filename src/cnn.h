@@ -0,0 +1,236 @@
+#ifndef CNN_H
+#define CNN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Public interface of libcnn. A context bundles everything a classification
+ * needs (the network weights, the lazily loaded input data set and a pool of
+ * worker threads), so any number of contexts can live in one process and all
+ * calls on the same context may be made concurrently from different threads.
+ * None of these functions write to stdout.
+ */
+
+typedef struct cnn_ctx cnn_ctx_t;
+
+/*
+ * Error codes. Every function that returns an int returns CNN_OK or one of
+ * the (negative) codes below.
+ */
+
+#define CNN_OK          0
+#define CNN_ERR_ARG    -1   // invalid argument or sample index
+#define CNN_ERR_IO     -2   // snapshot or data set file missing or malformed
+#define CNN_ERR_NOMEM  -3   // out of memory
+#define CNN_ERR_EMPTY  -4   // cnn_wait/cnn_poll: no request to complete
+
+/*
+ * Options for cnn_open. Zero/NULL fields select the defaults.
+ */
+
+typedef struct cnn_options {
+  const char* snapshot_dir;  // directory with layer*.txt (../data/snapshot)
+  const char* data_dir;      // directory with data_batch_*.bin
+  int workers;               // threads serving cnn_submit (1)
+  int threads;               // OpenMP threads per request (tuning file or
+                             // runtime default)
+  const char* tuning_file;   // written by 'cnn tune' (../data/tuning.txt),
+                             // "" to use the built-in defaults
+  size_t max_resident;       // bytes of the data set kept mapped (no limit)
+  double cascade;            // let cnn_classify skip the rest of the network
+                             // for images the first stage gives a cat
+                             // probability below this (0 = off)
+  const char* cascade_file;  // weights of the first stage, written by
+                             // 'cnn cascade train' (../data/cascade.txt)
+  const char* image_cache;   // the data set preconverted by 'cnn precache'
+                             // (data_dir/images.cache if it is there and up
+                             // to date), "" to read the batch files
+} cnn_options_t;
+
+/*
+ * Priority classes of cnn_submit_ex. Interactive requests are always served
+ * before bulk ones.
+ */
+
+#define CNN_PRIO_INTERACTIVE 0
+#define CNN_PRIO_BULK        1
+#define CNN_PRIOS            2
+
+/*
+ * Counters of the data set cache of a context, see cnn_get_stats. Every
+ * sample looked up counts as a hit if its batch (30 MB) is mapped already
+ * and as a miss otherwise. Batches are evicted in LRU order once more than
+ * max_resident bytes are mapped, but never while a request reads them.
+ * With an image cache, the whole data set is a single mapping the kernel
+ * pages in and out, and every lookup is a hit.
+ */
+
+typedef struct cnn_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t resident;      // bytes currently mapped
+  size_t max_resident;  // budget, 0 = no limit
+  size_t cache_bytes;   // size of the image cache, 0 if there is none
+
+  // Per priority class: completed requests, total and worst time they spent
+  // queued before the first sample was classified, and missed deadlines.
+  uint64_t requests[CNN_PRIOS];
+  double queue_ms[CNN_PRIOS];
+  double max_queue_ms[CNN_PRIOS];
+  uint64_t deadline_misses[CNN_PRIOS];
+  // Version of the network in use (1 for the one cnn_open loaded, one more
+  // with every cnn_reload) and the reloads that succeeded or failed.
+  uint64_t model_version;
+  uint64_t reloads;
+  uint64_t reload_failures;
+} cnn_stats_t;
+
+/*
+ * Result of an asynchronous request, as returned by cnn_wait/cnn_poll.
+ */
+
+typedef struct cnn_completion {
+  int64_t id;       // value returned by cnn_submit
+  void* user;       // user pointer passed to cnn_submit
+  int status;       // CNN_OK or an error code
+  double ms;        // time from the first classified sample to the last
+  double queue_ms;  // time spent queued before that
+  int deadline_missed;
+} cnn_completion_t;
+
+/*
+ * Create a context. On failure NULL is returned and *err (if not NULL) is
+ * set to the reason.
+ */
+
+cnn_ctx_t* cnn_open(const cnn_options_t* opts, int* err);
+
+/*
+ * Finish all outstanding requests and destroy the context.
+ */
+
+void cnn_close(cnn_ctx_t* ctx);
+
+/*
+ * Load the snapshot in snapshot_dir (NULL for the one the context was opened
+ * with or last successfully reloaded from) and switch to it without
+ * stopping: the new network is loaded, packed and run once on a few
+ * synthetic images by the calling thread, then swapped in atomically.
+ * Classifications that started before finish on the old network, which is
+ * freed after the last of them. The tuning and the cascade threshold stay
+ * as they were; the cascade weights are read again. If anything fails,
+ * nothing changes and the error is returned.
+ */
+
+int cnn_reload(cnn_ctx_t* ctx, const char* snapshot_dir);
+
+/*
+ * Make sure the data for the given samples is resident, so a following
+ * classification does not pay for loading it.
+ */
+
+int cnn_prefetch(cnn_ctx_t* ctx, const int* samples, int n);
+
+/*
+ * Classify n samples synchronously. cat_prob[i] receives the likelihood
+ * that sample samples[i] shows a cat.
+ */
+
+int cnn_classify(cnn_ctx_t* ctx, const int* samples, int n, double* cat_prob);
+
+/*
+ * Same as cnn_classify, but with all CNN_CLASSES probabilities of sample
+ * samples[i] in probs[CNN_CLASSES*i ... CNN_CLASSES*i+9], or with the k most
+ * likely labels of sample samples[i] and their probabilities in
+ * labels/scores[k*i ... k*i+k-1], most likely first. Both come out of the
+ * same single pass through the network as the cat probability.
+ */
+
+#define CNN_CLASSES 10
+#define CNN_CAT 3
+
+int cnn_classify_probs(cnn_ctx_t* ctx, const int* samples, int n, double* probs);
+int cnn_classify_topk(cnn_ctx_t* ctx, const int* samples, int n, int k,
+                      int* labels, double* scores);
+
+/*
+ * Classify n images that are not in the data set, like cnn_classify and
+ * cnn_classify_probs. images holds them one after the other, CNN_IMAGE_BYTES
+ * each: 32x32 pixels as three planes of 1024 bytes (red, green, blue), row
+ * by row, the layout of a CIFAR-10 record without its label byte. The
+ * network reads them right from there, without a copy.
+ */
+
+#define CNN_IMAGE_BYTES 3072
+
+int cnn_classify_images(cnn_ctx_t* ctx, const uint8_t* images, int n, double* cat_prob);
+int cnn_classify_images_probs(cnn_ctx_t* ctx, const uint8_t* images, int n, double* probs);
+
+/*
+ * The k most likely labels among the CNN_CLASSES probabilities in probs.
+ */
+
+void cnn_topk(const double* probs, int k, int* labels, double* scores);
+
+/*
+ * Name of a class label ("airplane", ..., "cat", ..., "truck").
+ */
+
+const char* cnn_class_name(int label);
+
+/*
+ * Queue n samples for classification on the worker pool. samples is copied,
+ * cat_prob has to stay valid until the request is returned by cnn_wait or
+ * cnn_poll. Returns the request id (>= 0) or an error code.
+ */
+
+int64_t cnn_submit(cnn_ctx_t* ctx, const int* samples, int n,
+                   double* cat_prob, void* user);
+
+/*
+ * Same as cnn_submit, with a priority class and a deadline (milliseconds
+ * from now, 0 for none). Within a class, requests are served earliest
+ * deadline first and in submission order otherwise. The workers take
+ * requests apart into micro-batches of 64 samples, so a large bulk request
+ * gives way to interactive ones after its current micro-batch. A request
+ * that finishes late still completes, with deadline_missed set.
+ * cnn_submit(...) is cnn_submit_ex(..., CNN_PRIO_INTERACTIVE, 0).
+ */
+
+int64_t cnn_submit_ex(cnn_ctx_t* ctx, const int* samples, int n, double* cat_prob,
+                      void* user, int priority, double deadline_ms);
+
+/*
+ * Retrieve the next finished request. cnn_wait blocks until one is done,
+ * cnn_poll returns CNN_ERR_EMPTY immediately if none is. Both return
+ * CNN_ERR_EMPTY if there is no outstanding request at all.
+ */
+
+int cnn_wait(cnn_ctx_t* ctx, cnn_completion_t* c);
+int cnn_poll(cnn_ctx_t* ctx, cnn_completion_t* c);
+
+/*
+ * Wait for the request with the given id only, leaving other completions
+ * queued for cnn_wait/cnn_poll. Returns CNN_ERR_EMPTY right away if the
+ * request was already returned, or as soon as another thread takes it.
+ */
+
+int cnn_wait_for(cnn_ctx_t* ctx, int64_t id, cnn_completion_t* c);
+
+/*
+ * Change the budget for the data set of a context, evicting right away if
+ * needed, and read its counters.
+ */
+
+int cnn_set_max_resident(cnn_ctx_t* ctx, size_t bytes);
+int cnn_get_stats(cnn_ctx_t* ctx, cnn_stats_t* stats);
+
+/*
+ * Human-readable description of an error code.
+ */
+
+const char* cnn_strerror(int err);
+
+#endif
@@ -0,0 +1,102 @@
+// Synthetic data set ----------------------------------------------------------
+
+// 'cnn gen' writes a data set in the cifar10 binary format (batches of 10,000
+// records, each a label byte and a 32x32 image as three planes of 1024
+// bytes), so the other commands can run without the real data and on far
+// more images than it has. Point them at it with CNN_DATA (or make data=...).
+// Every record only depends on the seed and its index: a colour gradient
+// with a disc of a second colour on it and some noise, with a random label.
+// The network's answers on these images mean nothing, but they take exactly
+// as long to classify as real ones.
+
+#define GEN_SEED 61
+#define GEN_BATCH 10000
+
+static uint64_t gen_mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static uint64_t gen_next(uint64_t* s) {
+  *s ^= *s << 13;
+  *s ^= *s >> 7;
+  *s ^= *s << 17;
+  return *s;
+}
+
+// Fill rec (CIFAR_RECORD bytes) with record index of the data set for seed.
+static void gen_record(uint8_t* rec, uint64_t seed, uint64_t index) {
+  uint64_t s = gen_mix(gen_mix(seed) ^ index) | 1;
+  rec[0] = gen_next(&s) % 10;
+
+  int cx = gen_next(&s) % 32;
+  int cy = gen_next(&s) % 32;
+  int r = 3 + gen_next(&s) % 10;
+  for (int c = 0; c < 3; c++) {
+    int base = gen_next(&s) % 256;
+    int dx = (int)(gen_next(&s) % 9) - 4;
+    int dy = (int)(gen_next(&s) % 9) - 4;
+    int disc = (int)(gen_next(&s) % 256) - base;
+    uint8_t* plane = rec + 1 + c * 1024;
+    for (int y = 0; y < 32; y++) {
+      uint64_t noise = gen_next(&s);
+      for (int x = 0; x < 32; x++) {
+        int v = base + dx * (x - 16) + dy * (y - 16);
+        if ((x - cx) * (x - cx) + (y - cy) * (y - cy) <= r * r)
+          v += disc;
+        // Two bits of noise per pixel, +-12.
+        v += 8 * (int)((noise >> (2 * x)) & 3) - 12;
+        plane[y * 32 + x] = (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+      }
+    }
+  }
+}
+
+/*
+ * Usage: cnn gen <dir> [batches] [seed]
+ *
+ * Writes dir/data_batch_1.bin to dir/data_batch_<batches>.bin, 5 batches
+ * (as many images as cifar10) by default.
+ */
+
+int do_gen(int argc, char** argv) {
+  if (argc < 1) {
+    printf("Usage: ./cnn gen <dir> [batches] [seed]\n");
+    return 2;
+  }
+  const char* dir = argv[0];
+  int batches = (argc > 1) ? atoi(argv[1]) : 5;
+  uint64_t seed = (argc > 2) ? strtoull(argv[2], NULL, 10) : GEN_SEED;
+  assert(batches > 0);
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    printf("ERROR: Cannot create %s\n", dir);
+    return 1;
+  }
+
+  printf("Writing %d pictures to %s...\n", batches * GEN_BATCH, dir);
+  uint8_t* data = (uint8_t*)malloc((size_t)CIFAR_RECORD * GEN_BATCH);
+  uint64_t start_time = timestamp_us();
+  for (int b = 0; b < batches; b++) {
+    #pragma omp parallel for
+    for (int i = 0; i < GEN_BATCH; i++)
+      gen_record(data + (size_t)i * CIFAR_RECORD, seed, (uint64_t)b * GEN_BATCH + i);
+
+    char fn[1024];
+    snprintf(fn, sizeof(fn), "%s/data_batch_%d.bin", dir, b + 1);
+    FILE* fout = fopen(fn, "wb");
+    if (fout == NULL || fwrite(data, CIFAR_RECORD, GEN_BATCH, fout) != GEN_BATCH ||
+        fclose(fout) != 0) {
+      printf("ERROR: Cannot write %s\n", fn);
+      free(data);
+      return 1;
+    }
+  }
+  uint64_t end_time = timestamp_us();
+  printf("Wrote %d batches in %.2lf s\n", batches, (end_time - start_time) / 1e6);
+
+  free(data);
+  return 0;
+}
@@ -0,0 +1,863 @@
+// libcnn ---------------------------------------------------------------------
+
+// Implementation of the context API declared in cnn.h. A context owns its
+// network, its input data set and its worker pool, so nothing in here touches
+// global state. The network is only read during classification, which is
+// what makes concurrent calls on the same context safe.
+
+// Upper bound for the number of input batch files (of 10,000 images each),
+// 10 million images.
+#define MAX_SHARDS 1000
+#define SHARD_SIZE 10000
+#define SHARD_BYTES ((size_t)SHARD_SIZE * CIFAR_RECORD)
+
+// Number of samples the workers take from a request at a time. Requests are
+// only preempted between micro-batches, so this bounds the time an
+// interactive request waits for a worker busy with bulk work.
+#define SCHED_CHUNK 64
+
+/*
+ * A request queued by cnn_submit. It stays in the submission queue of its
+ * priority class until the workers have taken all of its micro-batches, and
+ * moves to the completion queue once the last of them is done.
+ */
+
+typedef struct cnn_request {
+  int64_t id;
+  void* user;
+  int* samples;
+  int n;
+  double* output;
+  int priority;
+  uint64_t deadline;     // timestamp_us() by which it should be done, or 0
+  uint64_t submitted;    // timestamp_us() of cnn_submit
+  uint64_t started;      // timestamp_us() of its first micro-batch, or 0
+  int taken;             // samples handed out to workers
+  int finished;          // samples classified
+  int status;
+  double ms;
+  double queue_ms;
+  int missed;
+  struct cnn_request* next;
+  struct cnn_request* pending_prev;  // all requests that are not reaped yet
+  struct cnn_request* pending_next;
+} cnn_request_t;
+
+/*
+ * A loaded network. The context holds a reference to its current model and
+ * every classification holds one to the model it started with, so
+ * cnn_reload can swap in a new model at any time: classifications that are
+ * running finish on the old one, which is freed with the last reference.
+ */
+
+typedef struct cnn_model {
+  network_t* net;
+  int refs;
+  uint64_t version;
+} cnn_model_t;
+
+struct cnn_ctx {
+  // Current model, guarded by model_lock. reload_lock serializes cnn_reload.
+  pthread_mutex_t model_lock;
+  pthread_mutex_t reload_lock;
+  cnn_model_t* model;
+  uint64_t reloads;
+  uint64_t reload_failures;
+  char snapshot_dir[1024];   // empty for the embedded weights
+  char cascade_file[1024];
+
+  char data_dir[1024];
+  int threads;
+
+  // Raw input batches, mapped on first use and guarded by shard_lock. A
+  // batch with refs > 0 is read by a classification right now; the others
+  // are unmapped in LRU order (by last_use) as soon as more than
+  // max_resident bytes are mapped.
+  pthread_mutex_t shard_lock;
+  uint8_t* shards[MAX_SHARDS];
+  int refs[MAX_SHARDS];
+  uint64_t last_use[MAX_SHARDS];
+  uint64_t clock;
+  size_t resident;
+  size_t max_resident;
+  // The image cache (see map_image_cache) if there is one, which then
+  // serves all samples instead of the batches. It stays mapped until
+  // cnn_close.
+  uint8_t* cache;
+  int cache_images;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+
+  // Worker pool and request queues, guarded by lock. The workers are only
+  // started by the first cnn_submit. There is one submission queue per
+  // priority class, ordered by deadline (requests without one last) and
+  // then by id, and the workers always serve the first non-empty queue.
+  pthread_mutex_t lock;
+  pthread_cond_t work_cv;
+  pthread_cond_t done_cv;
+  pthread_t* workers;
+  int num_workers;
+  int started;
+  int closing;
+  int64_t next_id;
+  int outstanding;
+  cnn_request_t* sub_head[CNN_PRIOS];
+  cnn_request_t* done_head;
+  cnn_request_t* done_tail;
+  cnn_request_t* pending;
+
+  // Scheduler counters per priority class, guarded by lock.
+  uint64_t requests[CNN_PRIOS];
+  double queue_ms[CNN_PRIOS];
+  double max_queue_ms[CNN_PRIOS];
+  uint64_t deadline_misses[CNN_PRIOS];
+};
+
+const char* cnn_strerror(int err) {
+  switch (err) {
+    case CNN_OK:        return "success";
+    case CNN_ERR_ARG:   return "invalid argument";
+    case CNN_ERR_IO:    return "cannot read snapshot or data set";
+    case CNN_ERR_NOMEM: return "out of memory";
+    case CNN_ERR_EMPTY: return "no outstanding request";
+  }
+  return "unknown error";
+}
+
+// The snapshot directory to load from, NULL for the embedded weights.
+static const char* cnn_snapshot_dir(const cnn_ctx_t* ctx) {
+  return ctx->snapshot_dir[0] ? ctx->snapshot_dir : NULL;
+}
+
+cnn_ctx_t* cnn_open(const cnn_options_t* opts, int* err) {
+  cnn_options_t defaults = { 0 };
+  if (opts == NULL)
+    opts = &defaults;
+
+  cnn_ctx_t* ctx = (cnn_ctx_t*)calloc(1, sizeof(cnn_ctx_t));
+  if (ctx == NULL) {
+    if (err) *err = CNN_ERR_NOMEM;
+    return NULL;
+  }
+
+  // SNAPSHOT_FOLDER is NULL in a CNN_EMBEDDED build, which leaves
+  // snapshot_dir empty and selects the embedded weights.
+  const char* dir = opts->snapshot_dir ? opts->snapshot_dir : SNAPSHOT_FOLDER;
+  if (dir != NULL)
+    snprintf(ctx->snapshot_dir, sizeof(ctx->snapshot_dir), "%s", dir);
+  snprintf(ctx->cascade_file, sizeof(ctx->cascade_file), "%s",
+           opts->cascade_file ? opts->cascade_file : CASCADE_FILE);
+  network_t* net = load_cnn_snapshot_from(cnn_snapshot_dir(ctx));
+  if (net == NULL) {
+    free(ctx);
+    if (err) *err = CNN_ERR_IO;
+    return NULL;
+  }
+
+  snprintf(ctx->data_dir, sizeof(ctx->data_dir), "%s",
+           opts->data_dir ? opts->data_dir : DATA_FOLDER);
+
+  // Without an explicit cache file, a missing or outdated one is fine.
+  char cache_file[1024];
+  snprintf(cache_file, sizeof(cache_file), "%s/%s", ctx->data_dir, IMAGE_CACHE);
+  if (opts->image_cache != NULL)
+    snprintf(cache_file, sizeof(cache_file), "%s", opts->image_cache);
+  if (cache_file[0] != '\0')
+    ctx->cache = map_image_cache(cache_file, ctx->data_dir, &ctx->cache_images);
+  if (ctx->cache == NULL && opts->image_cache != NULL && opts->image_cache[0] != '\0') {
+    free_network(net);
+    free(ctx);
+    if (err) *err = CNN_ERR_IO;
+    return NULL;
+  }
+
+  // A missing tuning file is fine, the defaults are used then.
+  tuning_t t = get_tuning(net, 0);
+  const char* tuning_file = opts->tuning_file ? opts->tuning_file : TUNING_FILE;
+  if (tuning_file[0] != '\0' && load_tuning(tuning_file, &t) == 0)
+    apply_tuning(net, &t);
+  ctx->threads = opts->threads > 0 ? opts->threads : t.threads;
+
+  if (opts->cascade > 0.0) {
+    net->cascade = load_cascade(ctx->cascade_file);
+    net->cascade_threshold = opts->cascade;
+    if (net->cascade == NULL) {
+      unmap_image_cache(ctx->cache, ctx->cache_images);
+      free_network(net);
+      free(ctx);
+      if (err) *err = CNN_ERR_IO;
+      return NULL;
+    }
+  }
+  ctx->model = (cnn_model_t*)malloc(sizeof(cnn_model_t));
+  if (ctx->model == NULL) {
+    unmap_image_cache(ctx->cache, ctx->cache_images);
+    free_network(net);
+    free(ctx);
+    if (err) *err = CNN_ERR_NOMEM;
+    return NULL;
+  }
+  ctx->model->net = net;
+  ctx->model->refs = 1;
+  ctx->model->version = 1;
+  ctx->num_workers = opts->workers > 0 ? opts->workers : 1;
+  ctx->max_resident = opts->max_resident;
+
+  pthread_mutex_init(&ctx->model_lock, NULL);
+  pthread_mutex_init(&ctx->reload_lock, NULL);
+  pthread_mutex_init(&ctx->shard_lock, NULL);
+  pthread_mutex_init(&ctx->lock, NULL);
+  pthread_cond_init(&ctx->work_cv, NULL);
+  pthread_cond_init(&ctx->done_cv, NULL);
+
+  if (err) *err = CNN_OK;
+  return ctx;
+}
+
+/*
+ * Take a reference to the current model, for as long as a classification
+ * uses it, and drop it again.
+ */
+
+static cnn_model_t* cnn_acquire(cnn_ctx_t* ctx) {
+  pthread_mutex_lock(&ctx->model_lock);
+  cnn_model_t* model = ctx->model;
+  model->refs++;
+  pthread_mutex_unlock(&ctx->model_lock);
+  return model;
+}
+
+static void cnn_put(cnn_ctx_t* ctx, cnn_model_t* model) {
+  pthread_mutex_lock(&ctx->model_lock);
+  int last = --model->refs == 0;
+  pthread_mutex_unlock(&ctx->model_lock);
+  if (last) {
+    free_network(model->net);
+    free(model);
+  }
+}
+
+/*
+ * Load a network like cnn_open did for the current one, with the same
+ * tuning and cascade threshold, and run it once on RELOAD_WARMUP synthetic
+ * images so that its weights are resident and its code paths are warm
+ * before the first request reaches it. A snapshot that is truncated or
+ * holds weights that are not finite numbers is rejected by the loader.
+ */
+
+#define RELOAD_WARMUP 64
+
+static int cnn_load_model(cnn_ctx_t* ctx, const char* dir, cnn_model_t* old, network_t** out) {
+  network_t* net = load_cnn_snapshot_from(dir);
+  if (net == NULL)
+    return CNN_ERR_IO;
+
+  tuning_t t = get_tuning(old->net, 0);
+  apply_tuning(net, &t);
+  if (old->net->cascade != NULL) {
+    net->cascade = load_cascade(ctx->cascade_file);
+    net->cascade_threshold = old->net->cascade_threshold;
+    if (net->cascade == NULL) {
+      free_network(net);
+      return CNN_ERR_IO;
+    }
+  }
+
+  // A smooth gradient per image, different for every image.
+  uint8_t* records = (uint8_t*)malloc((size_t)RELOAD_WARMUP * CIFAR_RECORD);
+  if (records == NULL) {
+    free_network(net);
+    return CNN_ERR_NOMEM;
+  }
+  const uint8_t* input[RELOAD_WARMUP];
+  double output[RELOAD_WARMUP];
+  for (int i = 0; i < RELOAD_WARMUP; i++) {
+    uint8_t* r = records + (size_t)i * CIFAR_RECORD + 1;
+    for (int j = 0; j < 3072; j++)
+      r[j] = (uint8_t)(i * 4 + (j % 1024) / 8 + (j / 1024) * 40);
+    input[i] = r;
+  }
+  if (ctx->threads > 0)
+    omp_set_num_threads(ctx->threads);
+  net_classify(net, input, output, RELOAD_WARMUP, CAT_LABEL);
+  free(records);
+
+  net->cascade_passed = 0;
+  *out = net;
+  return CNN_OK;
+}
+
+int cnn_reload(cnn_ctx_t* ctx, const char* snapshot_dir) {
+  if (ctx == NULL)
+    return CNN_ERR_ARG;
+
+  pthread_mutex_lock(&ctx->reload_lock);
+  // The directory is remembered only once its snapshot is in use, so a
+  // failed reload does not break the following ones.
+  char dir[sizeof(ctx->snapshot_dir)];
+  snprintf(dir, sizeof(dir), "%s", snapshot_dir ? snapshot_dir : ctx->snapshot_dir);
+  cnn_model_t* old = cnn_acquire(ctx);
+  network_t* net = NULL;
+  int err = cnn_load_model(ctx, dir[0] ? dir : NULL, old, &net);
+  cnn_model_t* model = NULL;
+  if (err == CNN_OK && (model = (cnn_model_t*)malloc(sizeof(cnn_model_t))) == NULL) {
+    free_network(net);
+    err = CNN_ERR_NOMEM;
+  }
+
+  if (err == CNN_OK) {
+    model->net = net;
+    model->refs = 1;
+    model->version = old->version + 1;
+
+    // The context's reference moves to the new model.
+    pthread_mutex_lock(&ctx->model_lock);
+    ctx->model = model;
+    ctx->reloads++;
+    pthread_mutex_unlock(&ctx->model_lock);
+    memcpy(ctx->snapshot_dir, dir, sizeof(dir));
+    cnn_put(ctx, old);
+  } else {
+    pthread_mutex_lock(&ctx->model_lock);
+    ctx->reload_failures++;
+    pthread_mutex_unlock(&ctx->model_lock);
+  }
+  cnn_put(ctx, old);
+  pthread_mutex_unlock(&ctx->reload_lock);
+  return err;
+}
+
+/*
+ * Unmap the least recently used batches that are not in use until need more
+ * bytes fit into the budget, or nothing is left to evict. The caller holds
+ * shard_lock.
+ */
+
+static void cnn_evict(cnn_ctx_t* ctx, size_t need) {
+  while (ctx->max_resident > 0 && ctx->resident + need > ctx->max_resident) {
+    int victim = -1;
+    for (int s = 0; s < MAX_SHARDS; s++) {
+      if (ctx->shards[s] != NULL && ctx->refs[s] == 0 &&
+          (victim == -1 || ctx->last_use[s] < ctx->last_use[victim]))
+        victim = s;
+    }
+    if (victim == -1)
+      return;
+
+    unmap_batch(ctx->shards[victim]);
+    ctx->shards[victim] = NULL;
+    ctx->resident -= SHARD_BYTES;
+    ctx->evictions++;
+  }
+}
+
+static void cnn_unref(cnn_ctx_t* ctx, const int* samples, int n) {
+  if (ctx->cache != NULL)
+    return;
+  for (int i = 0; i < n; i++)
+    ctx->refs[samples[i] / SHARD_SIZE]--;
+}
+
+/*
+ * Look up the input images of n samples, mapping their batches if needed.
+ * input may be NULL if only the loading is wanted. Otherwise the batches
+ * stay mapped until the same samples are passed to cnn_release. If the
+ * batches in use do not fit into the budget, it is exceeded until they are
+ * released.
+ */
+
+static int cnn_resolve(cnn_ctx_t* ctx, const int* samples, int n, const uint8_t** input) {
+  for (int i = 0; i < n; i++) {
+    if (samples[i] < 0 || samples[i] / SHARD_SIZE >= MAX_SHARDS)
+      return CNN_ERR_ARG;
+  }
+
+  if (ctx->cache != NULL) {
+    for (int i = 0; i < n; i++) {
+      if (samples[i] >= ctx->cache_images)
+        return CNN_ERR_ARG;
+      if (input != NULL)
+        input[i] = cached_image(ctx->cache, samples[i]);
+    }
+    pthread_mutex_lock(&ctx->shard_lock);
+    ctx->hits += n;
+    pthread_mutex_unlock(&ctx->shard_lock);
+    return CNN_OK;
+  }
+
+  int err = CNN_OK;
+  int i;
+  pthread_mutex_lock(&ctx->shard_lock);
+  for (i = 0; i < n; i++) {
+    int shard = samples[i] / SHARD_SIZE;
+    if (ctx->shards[shard] != NULL) {
+      ctx->hits++;
+    } else {
+      ctx->misses++;
+      cnn_evict(ctx, SHARD_BYTES);
+      ctx->shards[shard] = map_batch(ctx->data_dir, shard);
+      if (ctx->shards[shard] == NULL) {
+        err = CNN_ERR_IO;
+        break;
+      }
+      ctx->resident += SHARD_BYTES;
+    }
+    ctx->last_use[shard] = ++ctx->clock;
+    if (input != NULL) {
+      ctx->refs[shard]++;
+      input[i] = ctx->shards[shard] + (size_t)(samples[i] % SHARD_SIZE)*CIFAR_RECORD + 1;
+    }
+  }
+  if (err != CNN_OK && input != NULL)
+    cnn_unref(ctx, samples, i);
+  pthread_mutex_unlock(&ctx->shard_lock);
+  return err;
+}
+
+static void cnn_release(cnn_ctx_t* ctx, const int* samples, int n) {
+  pthread_mutex_lock(&ctx->shard_lock);
+  cnn_unref(ctx, samples, n);
+  cnn_evict(ctx, 0);
+  pthread_mutex_unlock(&ctx->shard_lock);
+}
+
+int cnn_set_max_resident(cnn_ctx_t* ctx, size_t bytes) {
+  if (ctx == NULL)
+    return CNN_ERR_ARG;
+  pthread_mutex_lock(&ctx->shard_lock);
+  ctx->max_resident = bytes;
+  cnn_evict(ctx, 0);
+  pthread_mutex_unlock(&ctx->shard_lock);
+  return CNN_OK;
+}
+
+int cnn_get_stats(cnn_ctx_t* ctx, cnn_stats_t* stats) {
+  if (ctx == NULL || stats == NULL)
+    return CNN_ERR_ARG;
+  pthread_mutex_lock(&ctx->shard_lock);
+  stats->hits = ctx->hits;
+  stats->misses = ctx->misses;
+  stats->evictions = ctx->evictions;
+  stats->resident = ctx->resident;
+  stats->max_resident = ctx->max_resident;
+  stats->cache_bytes = ctx->cache ? image_cache_bytes(ctx->cache_images) : 0;
+  pthread_mutex_unlock(&ctx->shard_lock);
+
+  pthread_mutex_lock(&ctx->lock);
+  for (int p = 0; p < CNN_PRIOS; p++) {
+    stats->requests[p] = ctx->requests[p];
+    stats->queue_ms[p] = ctx->queue_ms[p];
+    stats->max_queue_ms[p] = ctx->max_queue_ms[p];
+    stats->deadline_misses[p] = ctx->deadline_misses[p];
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  pthread_mutex_lock(&ctx->model_lock);
+  stats->model_version = ctx->model->version;
+  stats->reloads = ctx->reloads;
+  stats->reload_failures = ctx->reload_failures;
+  pthread_mutex_unlock(&ctx->model_lock);
+  return CNN_OK;
+}
+
+int cnn_prefetch(cnn_ctx_t* ctx, const int* samples, int n) {
+  if (ctx == NULL || samples == NULL || n < 0)
+    return CNN_ERR_ARG;
+  return cnn_resolve(ctx, samples, n, NULL);
+}
+
+/*
+ * Classify the n images input points to with the current model, into
+ * output as in cnn_run.
+ */
+
+static void cnn_infer(cnn_ctx_t* ctx, const uint8_t** input, int n, double* output, int label) {
+  // Only affects parallel regions started by the calling thread.
+  if (ctx->threads > 0)
+    omp_set_num_threads(ctx->threads);
+  cnn_model_t* model = cnn_acquire(ctx);
+  net_classify(model->net, input, output, n, label);
+  cnn_put(ctx, model);
+}
+
+/*
+ * Classify n samples into output, either the probability of one label per
+ * sample or all of them (ALL_CLASSES), see net_classify.
+ */
+
+static int cnn_run(cnn_ctx_t* ctx, const int* samples, int n, double* output, int label) {
+  if (ctx == NULL || samples == NULL || output == NULL || n < 0)
+    return CNN_ERR_ARG;
+  if (n == 0)
+    return CNN_OK;
+
+  const uint8_t** input = (const uint8_t**)malloc(sizeof(uint8_t*)*n);
+  if (input == NULL)
+    return CNN_ERR_NOMEM;
+
+  int err = cnn_resolve(ctx, samples, n, input);
+  if (err == CNN_OK) {
+    cnn_infer(ctx, input, n, output, label);
+    cnn_release(ctx, samples, n);
+  }
+
+  free(input);
+  return err;
+}
+
+/*
+ * Same as cnn_run for images in memory: the network reads them right where
+ * they are, CNN_IMAGE_BYTES each.
+ */
+
+static int cnn_run_images(cnn_ctx_t* ctx, const uint8_t* images, int n, double* output, int label) {
+  if (ctx == NULL || images == NULL || output == NULL || n < 0)
+    return CNN_ERR_ARG;
+  if (n == 0)
+    return CNN_OK;
+
+  const uint8_t** input = (const uint8_t**)malloc(sizeof(uint8_t*)*n);
+  if (input == NULL)
+    return CNN_ERR_NOMEM;
+  for (int i = 0; i < n; i++)
+    input[i] = images + (size_t)i * CNN_IMAGE_BYTES;
+
+  cnn_infer(ctx, input, n, output, label);
+
+  free(input);
+  return CNN_OK;
+}
+
+int cnn_classify(cnn_ctx_t* ctx, const int* samples, int n, double* cat_prob) {
+  return cnn_run(ctx, samples, n, cat_prob, CAT_LABEL);
+}
+
+int cnn_classify_probs(cnn_ctx_t* ctx, const int* samples, int n, double* probs) {
+  return cnn_run(ctx, samples, n, probs, ALL_CLASSES);
+}
+
+int cnn_classify_images(cnn_ctx_t* ctx, const uint8_t* images, int n, double* cat_prob) {
+  return cnn_run_images(ctx, images, n, cat_prob, CAT_LABEL);
+}
+
+int cnn_classify_images_probs(cnn_ctx_t* ctx, const uint8_t* images, int n, double* probs) {
+  return cnn_run_images(ctx, images, n, probs, ALL_CLASSES);
+}
+
+void cnn_topk(const double* probs, int k, int* labels, double* scores) {
+  int taken = 0;
+  for (int j = 0; j < k; j++) {
+    int best = -1;
+    for (int c = 0; c < CNN_CLASSES; c++) {
+      if (!(taken & (1 << c)) && (best == -1 || probs[c] > probs[best]))
+        best = c;
+    }
+    taken |= 1 << best;
+    labels[j] = best;
+    scores[j] = probs[best];
+  }
+}
+
+int cnn_classify_topk(cnn_ctx_t* ctx, const int* samples, int n, int k,
+                      int* labels, double* scores) {
+  if (k < 1 || k > CNN_CLASSES || labels == NULL || scores == NULL)
+    return CNN_ERR_ARG;
+
+  double* probs = (double*)malloc(sizeof(double)*CNN_CLASSES*(n > 0 ? n : 1));
+  if (probs == NULL)
+    return CNN_ERR_NOMEM;
+
+  int err = cnn_classify_probs(ctx, samples, n, probs);
+  for (int i = 0; i < n && err == CNN_OK; i++)
+    cnn_topk(probs + CNN_CLASSES*i, k, labels + k*i, scores + k*i);
+
+  free(probs);
+  return err;
+}
+
+const char* cnn_class_name(int label) {
+  static const char* names[CNN_CLASSES] = {
+    "airplane", "automobile", "bird", "cat", "deer",
+    "dog", "frog", "horse", "ship", "truck"
+  };
+  return (label >= 0 && label < CNN_CLASSES) ? names[label] : "unknown";
+}
+
+/*
+ * Move a request whose last micro-batch is done to the completion queue and
+ * account for it. The caller holds ctx->lock.
+ */
+
+static void cnn_finish(cnn_ctx_t* ctx, cnn_request_t* req) {
+  uint64_t now = timestamp_us();
+  req->ms = (double)(now - req->started) / 1000.0;
+  req->missed = req->deadline != 0 && now > req->deadline;
+
+  ctx->requests[req->priority]++;
+  ctx->queue_ms[req->priority] += req->queue_ms;
+  if (req->queue_ms > ctx->max_queue_ms[req->priority])
+    ctx->max_queue_ms[req->priority] = req->queue_ms;
+  ctx->deadline_misses[req->priority] += req->missed;
+
+  req->next = NULL;
+  if (ctx->done_tail != NULL)
+    ctx->done_tail->next = req;
+  else
+    ctx->done_head = req;
+  ctx->done_tail = req;
+  pthread_cond_broadcast(&ctx->done_cv);
+}
+
+static void* cnn_worker(void* arg) {
+  cnn_ctx_t* ctx = (cnn_ctx_t*)arg;
+
+  pthread_mutex_lock(&ctx->lock);
+  for (;;) {
+    int p = 0;
+    while (p < CNN_PRIOS && ctx->sub_head[p] == NULL)
+      p++;
+    if (p == CNN_PRIOS && ctx->closing)
+      break;
+    if (p == CNN_PRIOS) {
+      pthread_cond_wait(&ctx->work_cv, &ctx->lock);
+      continue;
+    }
+
+    // Take the next micro-batch of the most urgent request.
+    cnn_request_t* req = ctx->sub_head[p];
+    int start = req->taken;
+    int m = (req->n - start < SCHED_CHUNK) ? req->n - start : SCHED_CHUNK;
+    req->taken += m;
+    if (req->taken == req->n)
+      ctx->sub_head[p] = req->next;
+    if (req->started == 0) {
+      req->started = timestamp_us();
+      req->queue_ms = (double)(req->started - req->submitted) / 1000.0;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    int status = cnn_classify(ctx, req->samples + start, m, req->output + start);
+
+    pthread_mutex_lock(&ctx->lock);
+    if (status != CNN_OK)
+      req->status = status;
+    req->finished += m;
+    if (req->finished == req->n)
+      cnn_finish(ctx, req);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return NULL;
+}
+
+/*
+ * Start the worker pool. If not all workers can be started, the context
+ * makes do with those that are; without any it stays unstarted and
+ * CNN_ERR_NOMEM is returned. The caller holds ctx->lock.
+ */
+
+static int cnn_start_workers(cnn_ctx_t* ctx) {
+  ctx->workers = (pthread_t*)malloc(sizeof(pthread_t)*ctx->num_workers);
+  if (ctx->workers == NULL)
+    return CNN_ERR_NOMEM;
+
+  int n = 0;
+  while (n < ctx->num_workers && pthread_create(&ctx->workers[n], NULL, cnn_worker, ctx) == 0)
+    n++;
+  if (n == 0) {
+    free(ctx->workers);
+    ctx->workers = NULL;
+    return CNN_ERR_NOMEM;
+  }
+  ctx->num_workers = n;
+  ctx->started = 1;
+  return CNN_OK;
+}
+
+int64_t cnn_submit_ex(cnn_ctx_t* ctx, const int* samples, int n, double* cat_prob,
+                      void* user, int priority, double deadline_ms) {
+  if (ctx == NULL || samples == NULL || cat_prob == NULL || n < 0 ||
+      priority < 0 || priority >= CNN_PRIOS || deadline_ms < 0)
+    return CNN_ERR_ARG;
+
+  cnn_request_t* req = (cnn_request_t*)calloc(1, sizeof(cnn_request_t));
+  int* copy = (int*)malloc(sizeof(int)*(n > 0 ? n : 1));
+  if (req == NULL || copy == NULL) {
+    free(req);
+    free(copy);
+    return CNN_ERR_NOMEM;
+  }
+  memcpy(copy, samples, sizeof(int)*n);
+  req->samples = copy;
+  req->n = n;
+  req->output = cat_prob;
+  req->user = user;
+  req->priority = priority;
+  req->submitted = timestamp_us();
+  if (deadline_ms > 0)
+    req->deadline = req->submitted + (uint64_t)(deadline_ms * 1000.0);
+
+  pthread_mutex_lock(&ctx->lock);
+  if (!ctx->started && cnn_start_workers(ctx) != CNN_OK) {
+    pthread_mutex_unlock(&ctx->lock);
+    free(req);
+    free(copy);
+    return CNN_ERR_NOMEM;
+  }
+  int64_t id = req->id = ctx->next_id++;
+  req->pending_next = ctx->pending;
+  if (ctx->pending != NULL)
+    ctx->pending->pending_prev = req;
+  ctx->pending = req;
+
+  // Earliest deadline first, the others in the order they came.
+  cnn_request_t** pos = &ctx->sub_head[priority];
+  while (*pos != NULL && (*pos)->deadline != 0 &&
+         (req->deadline == 0 || (*pos)->deadline <= req->deadline))
+    pos = &(*pos)->next;
+  if (req->deadline == 0) {
+    while (*pos != NULL)
+      pos = &(*pos)->next;
+  }
+  req->next = *pos;
+  *pos = req;
+
+  // An empty request has no micro-batch to wait for.
+  if (n == 0) {
+    *pos = req->next;
+    req->started = req->submitted;
+    cnn_finish(ctx, req);
+  }
+  ctx->outstanding++;
+  pthread_cond_broadcast(&ctx->work_cv);
+  pthread_mutex_unlock(&ctx->lock);
+
+  return id;
+}
+
+int64_t cnn_submit(cnn_ctx_t* ctx, const int* samples, int n,
+                   double* cat_prob, void* user) {
+  return cnn_submit_ex(ctx, samples, n, cat_prob, user, CNN_PRIO_INTERACTIVE, 0);
+}
+
+/*
+ * Pop a completion, the first one or the one of request id (if id >= 0).
+ * Returns CNN_ERR_EMPTY if there is none. The caller holds ctx->lock.
+ */
+
+static int cnn_reap(cnn_ctx_t* ctx, int64_t id, cnn_completion_t* c) {
+  cnn_request_t** pos = &ctx->done_head;
+  cnn_request_t* prev = NULL;
+  while (*pos != NULL && id >= 0 && (*pos)->id != id) {
+    prev = *pos;
+    pos = &(*pos)->next;
+  }
+  cnn_request_t* req = *pos;
+  if (req == NULL)
+    return CNN_ERR_EMPTY;
+
+  *pos = req->next;
+  if (ctx->done_tail == req)
+    ctx->done_tail = prev;
+  ctx->outstanding--;
+  if (req->pending_prev != NULL)
+    req->pending_prev->pending_next = req->pending_next;
+  else
+    ctx->pending = req->pending_next;
+  if (req->pending_next != NULL)
+    req->pending_next->pending_prev = req->pending_prev;
+
+  c->id = req->id;
+  c->user = req->user;
+  c->status = req->status;
+  c->ms = req->ms;
+  c->queue_ms = req->queue_ms;
+  c->deadline_missed = req->missed;
+
+  free(req->samples);
+  free(req);
+  return CNN_OK;
+}
+
+int cnn_wait(cnn_ctx_t* ctx, cnn_completion_t* c) {
+  if (ctx == NULL || c == NULL)
+    return CNN_ERR_ARG;
+
+  pthread_mutex_lock(&ctx->lock);
+  while (ctx->done_head == NULL && ctx->outstanding > 0)
+    pthread_cond_wait(&ctx->done_cv, &ctx->lock);
+  int err = cnn_reap(ctx, -1, c);
+  pthread_mutex_unlock(&ctx->lock);
+  return err;
+}
+
+/*
+ * Whether request id is submitted and not reaped yet. The caller holds
+ * ctx->lock.
+ */
+
+static int cnn_pending(cnn_ctx_t* ctx, int64_t id) {
+  for (cnn_request_t* req = ctx->pending; req != NULL; req = req->pending_next)
+    if (req->id == id)
+      return 1;
+  return 0;
+}
+
+int cnn_wait_for(cnn_ctx_t* ctx, int64_t id, cnn_completion_t* c) {
+  if (ctx == NULL || c == NULL || id < 0)
+    return CNN_ERR_ARG;
+
+  // A request that another thread reaps while this one waits ends the wait.
+  pthread_mutex_lock(&ctx->lock);
+  int err = CNN_ERR_ARG;
+  if (id < ctx->next_id)
+    while ((err = cnn_reap(ctx, id, c)) == CNN_ERR_EMPTY && cnn_pending(ctx, id))
+      pthread_cond_wait(&ctx->done_cv, &ctx->lock);
+  pthread_mutex_unlock(&ctx->lock);
+  return err;
+}
+
+int cnn_poll(cnn_ctx_t* ctx, cnn_completion_t* c) {
+  if (ctx == NULL || c == NULL)
+    return CNN_ERR_ARG;
+
+  pthread_mutex_lock(&ctx->lock);
+  int err = cnn_reap(ctx, -1, c);
+  pthread_mutex_unlock(&ctx->lock);
+  return err;
+}
+
+void cnn_close(cnn_ctx_t* ctx) {
+  if (ctx == NULL)
+    return;
+
+  // The workers drain the submission queue before they exit.
+  pthread_mutex_lock(&ctx->lock);
+  ctx->closing = 1;
+  pthread_cond_broadcast(&ctx->work_cv);
+  pthread_mutex_unlock(&ctx->lock);
+  if (ctx->started) {
+    for (int i = 0; i < ctx->num_workers; i++)
+      pthread_join(ctx->workers[i], NULL);
+    free(ctx->workers);
+  }
+
+  cnn_completion_t c;
+  while (cnn_reap(ctx, -1, &c) == CNN_OK)
+    ;
+
+  for (int s = 0; s < MAX_SHARDS; s++)
+    unmap_batch(ctx->shards[s]);
+  unmap_image_cache(ctx->cache, ctx->cache_images);
+
+  cnn_put(ctx, ctx->model);
+
+  pthread_mutex_destroy(&ctx->model_lock);
+  pthread_mutex_destroy(&ctx->reload_lock);
+  pthread_mutex_destroy(&ctx->shard_lock);
+  pthread_mutex_destroy(&ctx->lock);
+  pthread_cond_destroy(&ctx->work_cv);
+  pthread_cond_destroy(&ctx->done_cv);
+
+  free(ctx);
+}
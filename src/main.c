@@ -1,6 +1,29 @@
+#include <sys/stat.h>
+
 // Default constants for test sizes.
 const int BENCHMARK_SIZE = 1200;
 const int PARTEST_SIZE = 1000;
+const int PRUNE_SIZE = 10000;
+const int TUNE_SIZE = 2400;
+const int TUNE_TRIALS = 3;
+
+/*
+ * Classify through run_classification, or, if the optional arguments
+ * [procs] [shm|unix] ask for more than one process, through
+ * run_sharded_classification.
+ */
+
+static double classify_samples(int* samples, int n, double** keep_output,
+                               int argc, char** argv) {
+  int procs = (argc > 0) ? atoi(argv[0]) : 1;
+  int transport = (argc > 1 && !strcmp(argv[1], "unix")) ? SHARD_UNIX : SHARD_SHM;
+  assert(procs > 0 && procs <= MAX_SHARD_PROCS);
+  assert(argc < 2 || !strcmp(argv[1], "unix") || !strcmp(argv[1], "shm"));
+
+  if (procs == 1 && argc < 2)
+    return run_classification(samples, n, keep_output);
+  return run_sharded_classification(samples, n, keep_output, procs, transport);
+}
 
 /*
  * Run benchmark to determine Cat/s for a large data set.
@@ -21,9 +44,11 @@ int do_benchmark(int argc, char** argv) {
     samples[i] = i;
   }
 
-  double time = run_classification(samples, num_samples, NULL);
+  double time = classify_samples(samples, num_samples, NULL, argc-1, argv+1);
 
   free(samples);
+  if (time < 0)
+    return 1;
 
   printf("\nPERFORMANCE: %.2lf Cat/s\n\n", (1000.0 * (double)num_samples / time));
   return 0;
@@ -40,16 +65,19 @@ int do_test(int argc, char** argv) {
   if (argc > 0)
     sample_num = atoi(argv[0]);
 
-  assert(sample_num >= 0 && sample_num < 50000);
+  assert(sample_num >= 0 && sample_num < data_size(DATA_FOLDER));
 
   printf("Making network...\n");
   network_t* net = load_cnn_snapshot();
 
   batch_t* batch = make_batch(net, 1);
-  load_sample(batch[0][0], sample_num);
+  uint8_t data[CIFAR_RECORD];
+  const uint8_t* image = data + 1;
+  load_sample(data, sample_num);
+  decode_sample(batch[0][0], data);
 
   uint64_t start_time = timestamp_us(); 
-  net_forward(net, batch, 0, 0);
+  net_forward(net, batch, &image, 0, 0);
   uint64_t end_time = timestamp_us();
   printf("Time: %lf ms\n", (double)(end_time-start_time) / 1000.0);
 
@@ -68,11 +96,24 @@ int do_test(int argc, char** argv) {
 
 /*
  * Run a large-scale test to catch parallelism errors that do not occur when testing
- * on individual examples.
+ * on individual examples. With "all" or "top<k>" as the last argument, every line
+ * also has the probabilities of all classes, or the k most likely classes with
+ * their probabilities.
  */
 
 int do_partest(int argc, char** argv) {
   int test_size = PARTEST_SIZE;
+  int topk = 0;
+
+  if (argc > 1 && !strcmp(argv[argc-1], "all")) {
+    topk = -1;
+    argc--;
+  } else if (argc > 1 && !strncmp(argv[argc-1], "top", 3)) {
+    topk = atoi(argv[argc-1] + 3);
+    assert(topk > 0 && topk <= CNN_CLASSES);
+    argc--;
+  }
+  assert(topk == 0 || argc < 2);
 
   if (argc > 0)
     test_size = atoi(argv[0]);
@@ -80,27 +121,322 @@ int do_partest(int argc, char** argv) {
   srand(1234);
 
   int* samples = (int*)malloc(sizeof(int)*test_size);
+  int size = data_size(DATA_FOLDER);
+  assert(size > 0);
   for (int i = 0; i < test_size; i++) {
-    samples[i] = rand() % 50000;
+    samples[i] = rand() % size;
   }
 
   double* kept_output;
-  double time = run_classification(samples, test_size, &kept_output);
-
-  for (int i = 0; i < test_size; i++) {
-    printf("PAR%d,%lf\n", i, kept_output[i]);
+  if (topk == 0) {
+    if (classify_samples(samples, test_size, &kept_output, argc-1, argv+1) < 0)
+      return 1;
+    for (int i = 0; i < test_size; i++) {
+      printf("PAR%d,%lf\n", i, kept_output[i]);
+    }
+  } else {
+    run_classification_probs(samples, test_size, &kept_output);
+    for (int i = 0; i < test_size; i++) {
+      const double* probs = kept_output + CNN_CLASSES*i;
+      printf("PAR%d,%lf", i, probs[CNN_CAT]);
+      if (topk < 0) {
+        for (int c = 0; c < CNN_CLASSES; c++)
+          printf(",%lf", probs[c]);
+      } else {
+        int labels[CNN_CLASSES];
+        double scores[CNN_CLASSES];
+        cnn_topk(probs, topk, labels, scores);
+        for (int j = 0; j < topk; j++)
+          printf(",%s:%lf", cnn_class_name(labels[j]), scores[j]);
+      }
+      printf("\n");
+    }
   }
  
   free(samples);
 }
 
+/*
+ * Prune the second and third convolutional layer and the FC layer by weight
+ * magnitude, store the result as a new snapshot and compare the accuracy of
+ * the cat decisions of both networks on the first samples of the data set.
+ */
+
+static int count_correct(int* samples, double* output, uint8_t** labels, int n) {
+  int correct = 0;
+  for (int i = 0; i < n; i++) {
+    int cat = labels[samples[i] / 10000][(samples[i] % 10000) * CIFAR_RECORD] == CAT_LABEL;
+    correct += (output[i] > 0.5) == cat;
+  }
+  return correct;
+}
+
+int do_prune(int argc, char** argv) {
+  if (argc < 1) {
+    printf("Usage: ./cnn prune <sparsity> [samples] [output dir]\n");
+    return 2;
+  }
+
+  double sparsity = atof(argv[0]);
+  int num_samples = (argc > 1) ? atoi(argv[1]) : PRUNE_SIZE;
+  const char* dir = (argc > 2) ? argv[2] : "../data/pruned";
+  assert(sparsity >= 0.0 && sparsity < 1.0);
+  assert(num_samples > 0 && num_samples <= data_size(DATA_FOLDER));
+
+  printf("Pruning %.0lf%% of the weights of layers 4, 7 and 10...\n", sparsity * 100.0);
+  network_t* net = load_cnn_snapshot();
+  long dense_macs = conv_macs(net->l0) + conv_macs(net->l3) + conv_macs(net->l6) + fc_macs(net->l9);
+  conv_prune(net->l3, sparsity);
+  conv_prune(net->l6, sparsity);
+  fc_prune(net->l9, sparsity);
+  long sparse_macs = conv_macs(net->l0) + conv_macs(net->l3) + conv_macs(net->l6) + fc_macs(net->l9);
+  printf("Sparse kernels: conv4 %s, conv7 %s, fc10 %s\n",
+         net->l3->sp_start ? "yes" : "no", net->l6->sp_start ? "yes" : "no",
+         net->l9->sp_start ? "yes" : "no");
+
+  mkdir(dir, 0755);
+  if (save_cnn_snapshot(net, dir) != 0) {
+    printf("ERROR: Cannot write snapshot to %s\n", dir);
+    return 1;
+  }
+  free_network(net);
+  printf("Wrote pruned snapshot to %s\n", dir);
+
+  int* samples = (int*)malloc(sizeof(int)*num_samples);
+  double* dense = (double*)malloc(sizeof(double)*num_samples);
+  double* pruned = (double*)malloc(sizeof(double)*num_samples);
+  for (int i = 0; i < num_samples; i++) {
+    samples[i] = i;
+  }
+
+  int batches = (num_samples - 1) / 10000 + 1;
+  uint8_t** labels = (uint8_t**)calloc(batches, sizeof(uint8_t*));
+  for (int b = 0; b < batches; b++) {
+    labels[b] = load_batch(DATA_FOLDER, b);
+    assert(labels[b] != NULL);
+  }
+
+  cnn_options_t opts = { 0 };
+  cnn_ctx_t* dense_ctx = cnn_open(NULL, NULL);
+  opts.snapshot_dir = dir;
+  cnn_ctx_t* pruned_ctx = cnn_open(&opts, NULL);
+  assert(dense_ctx != NULL && pruned_ctx != NULL);
+  cnn_prefetch(dense_ctx, samples, num_samples);
+  cnn_prefetch(pruned_ctx, samples, num_samples);
+
+  uint64_t t0 = timestamp_us();
+  cnn_classify(dense_ctx, samples, num_samples, dense);
+  uint64_t t1 = timestamp_us();
+  cnn_classify(pruned_ctx, samples, num_samples, pruned);
+  uint64_t t2 = timestamp_us();
+
+  int agree = 0;
+  double max_diff = 0.0;
+  for (int i = 0; i < num_samples; i++) {
+    agree += (dense[i] > 0.5) == (pruned[i] > 0.5);
+    if (fabs(dense[i] - pruned[i]) > max_diff)
+      max_diff = fabs(dense[i] - pruned[i]);
+  }
+
+  printf("\n                 MACs/image   accuracy   Cat/s\n");
+  printf("DENSE         %12ld   %7.2lf%%   %.2lf\n", dense_macs,
+         100.0 * count_correct(samples, dense, labels, num_samples) / num_samples,
+         1e6 * num_samples / (double)(t1 - t0));
+  printf("PRUNED        %12ld   %7.2lf%%   %.2lf\n", sparse_macs,
+         100.0 * count_correct(samples, pruned, labels, num_samples) / num_samples,
+         1e6 * num_samples / (double)(t2 - t1));
+  printf("\nAGREEMENT: %.2lf%% of cat decisions, max probability change %lf\n\n",
+         100.0 * agree / num_samples, max_diff);
+
+  cnn_close(dense_ctx);
+  cnn_close(pruned_ctx);
+  for (int b = 0; b < batches; b++)
+    free(labels[b]);
+  free(labels);
+  free(samples);
+  free(dense);
+  free(pruned);
+  return 0;
+}
+
+/*
+ * Find the fastest configuration for this machine: the kernel variants, the
+ * mini-batch size of the classifier head, stage group tiling with the tile
+ * that fits this machine's L2 cache and the number of threads are tried
+ * one after another, each time keeping the best value found so far, and the
+ * winner is written to the tuning file that cnn_open picks up.
+ */
+
+static double tune_trial(network_t* net, const tuning_t* t, const uint8_t** input,
+                         double* output, int n) {
+  apply_tuning(net, t);
+  omp_set_num_threads(t->threads > 0 ? t->threads : omp_get_num_procs());
+
+  double best = 0.0;
+  for (int r = 0; r < TUNE_TRIALS; r++) {
+    uint64_t start_time = timestamp_us();
+    net_classify_cats(net, input, output, n);
+    uint64_t end_time = timestamp_us();
+    double rate = 1e6 * n / (double)(end_time - start_time);
+    if (rate > best)
+      best = rate;
+  }
+
+  printf("cross_image %d  batched_head %d  head_batch %2d  stage_tile %2d  threads %2d  %10.2lf Cat/s\n",
+         t->cross_image, t->batched_head, t->head_batch, t->stage_tile, t->threads, best);
+  return best;
+}
+
+int do_tune(int argc, char** argv) {
+  int num_samples = TUNE_SIZE;
+  const char* fn = TUNING_FILE;
+
+  if (argc > 0)
+    num_samples = atoi(argv[0]);
+  if (argc > 1)
+    fn = argv[1];
+  assert(num_samples > 0 && num_samples <= 10000);
+
+  printf("Making network...\n");
+  network_t* net = load_cnn_snapshot();
+  uint8_t* data = load_batch(DATA_FOLDER, 0);
+  assert(data != NULL);
+
+  const uint8_t** input = (const uint8_t**)malloc(sizeof(uint8_t*)*num_samples);
+  double* output = (double*)malloc(sizeof(double)*num_samples);
+  for (int i = 0; i < num_samples; i++) {
+    input[i] = data + (size_t)i * CIFAR_RECORD + 1;
+  }
+
+  printf("Tuning on %d pictures...\n\n", num_samples);
+  tuning_t best = get_tuning(net, omp_get_num_procs());
+  double best_rate = tune_trial(net, &best, input, output, num_samples);
+  tuning_t t;
+
+  // kernel variants
+  for (int cross = 0; cross <= 1; cross++)
+    for (int head = 0; head <= 1; head++) {
+      t = best;
+      t.cross_image = cross;
+      t.batched_head = head;
+      if (memcmp(&t, &best, sizeof(t)) == 0)
+        continue;
+      double rate = tune_trial(net, &t, input, output, num_samples);
+      if (rate > best_rate) {
+        best = t;
+        best_rate = rate;
+      }
+    }
+
+  // mini-batch size of the head
+  for (int b = IMG_LANES; b <= MAX_HEAD_BATCH && best.batched_head; b *= 2) {
+    t = best;
+    t.head_batch = b;
+    if (b == best.head_batch)
+      continue;
+    double rate = tune_trial(net, &t, input, output, num_samples);
+    if (rate > best_rate) {
+      best = t;
+      best_rate = rate;
+    }
+  }
+
+  // stage group tiling, off or with the tile for L2
+  if (best.batched_head) {
+    t = best;
+    t.stage_tile = t.stage_tile ? 0 : pick_stage_tile(net, l2_cache_size());
+    double rate = tune_trial(net, &t, input, output, num_samples);
+    if (rate > best_rate) {
+      best = t;
+      best_rate = rate;
+    }
+  }
+
+  // threads: powers of two and all cores
+  int procs = omp_get_num_procs();
+  for (int p = 1; p <= procs; p *= 2) {
+    t = best;
+    t.threads = (p * 2 > procs) ? procs : p;
+    if (t.threads == best.threads)
+      continue;
+    double rate = tune_trial(net, &t, input, output, num_samples);
+    if (rate > best_rate) {
+      best = t;
+      best_rate = rate;
+    }
+  }
+
+  printf("\nBEST: ");
+  tune_trial(net, &best, input, output, num_samples);
+
+  if (save_tuning(fn, &best) != 0) {
+    printf("ERROR: Cannot write %s\n", fn);
+    return 1;
+  }
+  printf("Wrote %s\n\n", fn);
+
+  free(input);
+  free(output);
+  free(data);
+  free_network(net);
+  return 0;
+}
+
+/*
+ * Convert a snapshot into the C source of the embedded weights.
+ */
+
+int do_embed(int argc, char** argv) {
+  const char* dir = (argc > 0) ? argv[0] : SNAPSHOT_FOLDER;
+  const char* fn = (argc > 1) ? argv[1] : "../src/weights.h";
+
+  network_t* net = load_cnn_snapshot_from(dir);
+  if (net == NULL) {
+    printf("ERROR: Cannot load snapshot from %s\n", dir ? dir : "the binary");
+    return 1;
+  }
+  if (save_embedded_weights(net, fn) != 0) {
+    printf("ERROR: Cannot write %s\n", fn);
+    return 1;
+  }
+  printf("Wrote %s\n", fn);
+
+  free_network(net);
+  return 0;
+}
+
+/*
+ * Usage: cnn precache [file]
+ *
+ * Writes the image cache of the data set (see write_image_cache), to
+ * images.cache in the data directory by default, where libcnn finds it.
+ */
+
+int do_precache(int argc, char** argv) {
+  char fn[1024];
+  snprintf(fn, sizeof(fn), "%s/%s", DATA_FOLDER, IMAGE_CACHE);
+  if (argc > 0)
+    snprintf(fn, sizeof(fn), "%s", argv[0]);
+
+  printf("Converting %d pictures...\n", data_size(DATA_FOLDER));
+  uint64_t start_time = timestamp_us();
+  int images = write_image_cache(DATA_FOLDER, fn);
+  uint64_t end_time = timestamp_us();
+  if (images < 0) {
+    printf("ERROR: Cannot write %s\n", fn);
+    return 1;
+  }
+  printf("Wrote %d pictures to %s in %.2lf s\n", images, fn, (end_time - start_time) / 1e6);
+  return 0;
+}
+
 /*
  * The actual main function.
  */
 
 int main(int argc, char** argv) {
   if (argc < 2) {
-    printf("Usage: ./cnn <benchmark|test|partest> [args]\n");
+    printf("Usage: ./cnn <benchmark|test|partest|apitest|prune|tune|stream|perf|sched|cascade|sweep|gen|precache|embed> [args]\n");
     return 2;
   }
 
@@ -116,6 +452,50 @@ int main(int argc, char** argv) {
     return do_partest(argc-2, argv+2);
   }
 
+  if (!strcmp(argv[1], "apitest")) {
+    return do_apitest(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "prune")) {
+    return do_prune(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "tune")) {
+    return do_tune(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "stream")) {
+    return do_stream(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "perf")) {
+    return do_perf(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "sched")) {
+    return do_sched(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "cascade")) {
+    return do_cascade(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "sweep")) {
+    return do_sweep(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "gen")) {
+    return do_gen(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "precache")) {
+    return do_precache(argc-2, argv+2);
+  }
+
+  if (!strcmp(argv[1], "embed")) {
+    return do_embed(argc-2, argv+2);
+  }
+
   printf("ERROR: Unknown command\n");
 
   return 2;
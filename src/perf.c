@@ -0,0 +1,451 @@
+// Hardware counters -----------------------------------------------------------
+
+// 'cnn perf' runs the benchmark and then a second, single-threaded pass over
+// the same images that times every stage of net_forward separately and, if
+// the kernel lets us, reads the hardware counters of the thread around it
+// (perf_event_open): cycles, instructions, L1D read misses and LLC misses.
+//
+// Each stage is then placed on a simple roofline: its arithmetic intensity
+// (FLOP per byte of memory traffic) is compared with the ridge point of this
+// machine (peak FLOP/s over bandwidth, both measured at startup by small AVX
+// and memcpy loops). The memory traffic is LLC misses * 64 bytes against the
+// DRAM bandwidth when the counters are there. Otherwise it is the size of the
+// stage's input, output and weights against the bandwidth of the L2 cache,
+// which is where the volumes of a group of images live.
+//
+// Last, the batched classifier runs single-threaded with and without stage
+// group tiling (see net_forward_tiled), with the tile picked for this
+// machine's L2, and the two are compared on speed, on the counters and on
+// the modelled traffic into L2.
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+#define PERF_EVENTS 4
+#define PERF_STAGES (LAYERS)
+#define PERF_TILE_TRIALS 3
+#define CACHE_LINE 64
+
+static const char* perf_event_names[PERF_EVENTS] = {
+  "cycles", "instructions", "L1D misses", "LLC misses"
+};
+
+static const char* perf_stage_names[PERF_STAGES] = {
+  "conv1", "relu2", "pool3", "conv4", "relu5", "pool6",
+  "conv7", "relu8", "pool9", "fc10", "softmax11"
+};
+
+typedef struct perf_group {
+  int leader;                 // fd of the group leader, -1 if none opened
+  int fd[PERF_EVENTS];        // fd of each event, or -1
+  int index[PERF_EVENTS];     // position of each event in a group read, or -1
+  int count;                  // number of events in the group
+} perf_group_t;
+
+typedef struct perf_stage {
+  uint64_t ns;
+  uint64_t events[PERF_EVENTS];
+  double flops;               // per image
+  double bytes;               // per image, from the layer sizes
+} perf_stage_t;
+
+static int perf_open_event(uint32_t type, uint64_t config, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = (group == -1);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// Open as many of the events as possible in one group on the calling thread.
+static void perf_open(perf_group_t* g) {
+  uint32_t types[PERF_EVENTS] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+  };
+  uint64_t configs[PERF_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    PERF_COUNT_HW_CACHE_MISSES
+  };
+
+  g->leader = -1;
+  g->count = 0;
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    int fd = perf_open_event(types[e], configs[e], g->leader);
+    g->fd[e] = fd;
+    g->index[e] = -1;
+    if (fd < 0)
+      continue;
+    if (g->leader == -1)
+      g->leader = fd;
+    g->index[e] = g->count++;
+  }
+
+  if (g->leader != -1)
+    ioctl(g->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+// Read all counters of the group with a single system call.
+static void perf_read(perf_group_t* g, uint64_t* values) {
+  uint64_t buf[1 + PERF_EVENTS];
+  memset(values, 0, sizeof(uint64_t)*PERF_EVENTS);
+  if (g->leader == -1 || read(g->leader, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t))
+    return;
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    if (g->index[e] >= 0 && (uint64_t)g->index[e] < buf[0])
+      values[e] = buf[1 + g->index[e]];
+  }
+}
+
+static uint64_t perf_now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// Peak double precision FLOP/s of one core: independent AVX adds and
+// multiplies, which can issue in the same cycle. 12 chains plus the two
+// constants still fit into the 16 registers.
+#define PERF_CHAINS 6
+
+static double perf_peak_flops() {
+  __m256d a[PERF_CHAINS], m[PERF_CHAINS];
+  __m256d one = _mm256_set1_pd(1e-9), k = _mm256_set1_pd(0.999999999);
+  for (int i = 0; i < PERF_CHAINS; i++) {
+    a[i] = _mm256_set1_pd(i);
+    m[i] = _mm256_set1_pd(1.0 + i);
+  }
+
+  const long iters = 20000000;
+  uint64_t t0 = perf_now_ns();
+  for (long it = 0; it < iters; it++) {
+    for (int i = 0; i < PERF_CHAINS; i++) {
+      a[i] = _mm256_add_pd(a[i], one);
+      m[i] = _mm256_mul_pd(m[i], k);
+    }
+  }
+  uint64_t t1 = perf_now_ns();
+
+  // Keep the results alive.
+  double sink[4];
+  __m256d s = _mm256_setzero_pd();
+  for (int i = 0; i < PERF_CHAINS; i++)
+    s = _mm256_add_pd(s, _mm256_add_pd(a[i], m[i]));
+  _mm256_storeu_pd(sink, s);
+  if (sink[0] == 42.0)
+    printf(" ");
+
+  return (double)iters * PERF_CHAINS * 2 * 4 / ((t1 - t0) * 1e-9);
+}
+
+// Bandwidth of one core in bytes/s for copies between two buffers of the
+// given size, counting both the read and the write. 64 MB is far beyond the
+// last level cache, 64 KB (twice) fits into L2.
+static double perf_bandwidth(size_t size) {
+  char* a = (char*)malloc(size);
+  char* b = (char*)malloc(size);
+  memset(a, 1, size);
+  memset(b, 2, size);
+
+  int reps = (int)((256 << 20) / size);
+  uint64_t best = ~0ull;
+  for (int r = 0; r < 3; r++) {
+    uint64_t t0 = perf_now_ns();
+    for (int i = 0; i < reps; i++) {
+      memcpy(b, a, size);
+      a[i % size] = b[size - 1 - i % size];
+    }
+    uint64_t t1 = perf_now_ns();
+    if (t1 - t0 < best)
+      best = t1 - t0;
+  }
+
+  free(a);
+  free(b);
+  return 2.0 * size * reps / (best * 1e-9);
+}
+
+static double vol_bytes(vol_t* v) {
+  return (double)stage_vol_bytes(v);
+}
+
+// FLOPs and memory footprint of every stage for one image, where the weights
+// are shared by the IMG_LANES images of a group.
+static void perf_model(network_t* net, perf_stage_t* s) {
+  conv_layer_t* conv[3] = { net->l0, net->l3, net->l6 };
+  for (int c = 0; c < 3; c++) {
+    conv_layer_t* l = conv[c];
+    s[3*c].flops = 2.0 * conv_macs(l);
+    s[3*c].bytes = (c == 0 ? 3072.0 : vol_bytes(net->v[3*c])) + vol_bytes(net->v[3*c + 1]) +
+                   (double)stage_weight_bytes(l) / IMG_LANES;
+    s[3*c + 1].flops = net->v[3*c + 1]->sx * net->v[3*c + 1]->sy * net->v[3*c + 1]->depth;
+    s[3*c + 1].bytes = vol_bytes(net->v[3*c + 1]) + vol_bytes(net->v[3*c + 2]);
+    s[3*c + 2].flops = s[3*c + 1].flops * 3.0 / 4.0;
+    s[3*c + 2].bytes = vol_bytes(net->v[3*c + 2]) + vol_bytes(net->v[3*c + 3]);
+  }
+  s[9].flops = 2.0 * fc_macs(net->l9);
+  s[9].bytes = vol_bytes(net->v[9]) + vol_bytes(net->v[10]) +
+               8.0 * (fc_macs(net->l9) + net->l9->out_depth) / IMG_LANES;
+  s[10].flops = 3.0 * net->v[10]->depth;
+  s[10].bytes = vol_bytes(net->v[10]) + vol_bytes(net->v[11]);
+}
+
+/*
+ * The instrumented pass: the stages of net_forward on groups of IMG_LANES
+ * images, one stage for the whole group at a time.
+ */
+
+static void perf_run(network_t* net, const uint8_t** input, int n, perf_group_t* g,
+                     perf_stage_t* s) {
+  batch_t* v = make_batch(net, IMG_LANES);
+  uint64_t before[PERF_EVENTS], after[PERF_EVENTS];
+
+  for (int i = 0; i < n; i += IMG_LANES) {
+    int m = (n - i < IMG_LANES) ? n - i : IMG_LANES;
+    int x4 = net->cross_image && m == IMG_LANES;
+
+    for (int st = 0; st < PERF_STAGES; st++) {
+      perf_read(g, before);
+      uint64_t t0 = perf_now_ns();
+      for (int j = 0; j < m; j++) {
+        switch (st) {
+          case 0:
+            if (x4)
+              conv_forward_1_x4(net->l0, input + i, v[1]);
+            else
+              conv_forward_1(net->l0, input + i + j, v[1] + j);
+            break;
+          case 1: relu_forward_1(net->l1, v[1] + j, v[2] + j); break;
+          case 2: pool_forward_1(net->l2, v[2] + j, v[3] + j); break;
+          case 3: conv_forward_2(net->l3, v[3] + j, v[4] + j); break;
+          case 4: relu_forward_2(net->l4, v[4] + j, v[5] + j); break;
+          case 5: pool_forward_2(net->l5, v[5] + j, v[6] + j); break;
+          case 6: conv_forward_3(net->l6, v[6] + j, v[7] + j); break;
+          case 7: relu_forward_3(net->l7, v[7] + j, v[8] + j); break;
+          case 8: pool_forward_3(net->l8, v[8] + j, v[9] + j); break;
+          case 9:
+            if (x4)
+              fc_forward_x4(net->l9, v[9], v[10]);
+            else
+              fc_forward(net->l9, v[9] + j, v[10] + j);
+            break;
+          case 10:
+            if (x4)
+              softmax_forward_x4(net->l10, v[10], v[11]);
+            else
+              softmax_forward(net->l10, v[10] + j, v[11] + j);
+            break;
+        }
+        // The cross-image variants do the whole group at once.
+        if (x4 && (st == 0 || st == 9 || st == 10))
+          break;
+      }
+      uint64_t t1 = perf_now_ns();
+      perf_read(g, after);
+
+      s[st].ns += t1 - t0;
+      for (int e = 0; e < PERF_EVENTS; e++)
+        s[st].events[e] += after[e] - before[e];
+    }
+  }
+
+  free_batch(v, IMG_LANES);
+}
+
+// Modelled bytes per image that have to come into L2 from further out, with
+// stage tiles of tile images or IMG_LANES images through all layers at a
+// time (tile 0): the input image, plus the conv weights once per tile (or
+// group of IMG_LANES) if everything touched between two uses of them does
+// not fit into the share of L2 that pick_stage_tile leaves to the layers.
+static double perf_l2_traffic(network_t* net, int tile, long cache) {
+  long weights = stage_weight_bytes(net->l0) + stage_weight_bytes(net->l3) +
+                 stage_weight_bytes(net->l6);
+  long ws = stage_interleaved_bytes(net);
+  int n = (tile > 0) ? tile : IMG_LANES;
+  if (tile > 0) {
+    ws = weights + IMG_LANES * stage_vol_bytes(net->v[1]) + stage_vol_bytes(net->v[4]) +
+         stage_vol_bytes(net->v[7]);
+    ws += tile * (32 * 32 * 3 + stage_vol_bytes(net->v[3]) + stage_vol_bytes(net->v[6]) +
+                  stage_vol_bytes(net->v[9]));
+  }
+
+  double traffic = 32 * 32 * 3;
+  if (ws > cache * STAGE_CACHE_SHARE)
+    traffic += (double)weights / n;
+  return traffic;
+}
+
+static void perf_tiling(network_t* net, const uint8_t** input, int n, perf_group_t* g,
+                        const int* have) {
+  long cache = l2_cache_size();
+  int tile = pick_stage_tile(net, cache);
+  printf("STAGE TILING: %ld KB L2, %.0lf%% for the layers, tile of %d images (%s now)\n",
+         cache >> 10, 100.0 * STAGE_CACHE_SHARE, tile, net->stage_tile ? "on" : "off");
+  printf("  all layers touch  %5ld KB per %d images without tiling\n",
+         stage_interleaved_bytes(net) >> 10, IMG_LANES);
+  for (int s = 0; s < STAGE_GROUPS; s++)
+    printf("  conv%d-pool%d touches %5ld KB per tile\n", 3*s + 1, 3*s + 3,
+           stage_bytes(net, s, tile) >> 10);
+
+  tuning_t saved = get_tuning(net, 0);
+  double* output = (double*)malloc(sizeof(double)*n);
+  omp_set_num_threads(1);
+  net->batched_head = 1;
+
+  printf("\nMODE             Cat/s  L1D miss/img  LLC miss/img  L2 refill B/img\n");
+  double rate[2], events[2][PERF_EVENTS], traffic[2];
+  for (int mode = 0; mode < 2; mode++) {
+    net->stage_tile = mode ? tile : 0;
+    net_classify_cats(net, input, output, n);
+
+    uint64_t best = ~0ull;
+    uint64_t before[PERF_EVENTS], after[PERF_EVENTS];
+    memset(events[mode], 0, sizeof(events[mode]));
+    for (int r = 0; r < PERF_TILE_TRIALS; r++) {
+      perf_read(g, before);
+      uint64_t t0 = perf_now_ns();
+      net_classify_cats(net, input, output, n);
+      uint64_t t1 = perf_now_ns();
+      perf_read(g, after);
+      if (t1 - t0 < best)
+        best = t1 - t0;
+      for (int e = 0; e < PERF_EVENTS; e++)
+        events[mode][e] += (double)(after[e] - before[e]) / ((double)PERF_TILE_TRIALS * n);
+    }
+    rate[mode] = n / (best * 1e-9);
+    traffic[mode] = perf_l2_traffic(net, net->stage_tile, cache);
+
+    printf("%-11s %10.2lf", mode ? "tiled" : "interleaved", rate[mode]);
+    for (int e = 2; e < PERF_EVENTS; e++) {
+      if (have[e])
+        printf(" %13.1lf", events[mode][e]);
+      else
+        printf(" %13s", "n/a");
+    }
+    printf(" %15.0lf*\n", traffic[mode]);
+  }
+
+  printf("%-11s %9.1lf%%", "change", 100.0 * (rate[1] / rate[0] - 1.0));
+  for (int e = 2; e < PERF_EVENTS; e++) {
+    if (have[e] && events[0][e] > 0)
+      printf(" %12.1lf%%", 100.0 * (events[1][e] / events[0][e] - 1.0));
+    else
+      printf(" %13s", "n/a");
+  }
+  printf(" %14.1lf%%\n", 100.0 * (traffic[1] / traffic[0] - 1.0));
+  printf("\n* modelled: the input plus the conv weights whenever they do not stay in L2\n\n");
+
+  apply_tuning(net, &saved);
+  free(output);
+}
+
+/*
+ * Usage: cnn perf [size]
+ */
+
+int do_perf(int argc, char** argv) {
+  int num_samples = (argc > 0) ? atoi(argv[0]) : 1200;
+  assert(num_samples > 0 && num_samples <= data_size(DATA_FOLDER));
+
+  printf("RUNNING BENCHMARK ON %d PICTURES...\n", num_samples);
+  int* samples = (int*)malloc(sizeof(int)*num_samples);
+  for (int i = 0; i < num_samples; i++)
+    samples[i] = i;
+  double time = run_classification(samples, num_samples, NULL);
+  printf("\nPERFORMANCE: %.2lf Cat/s\n\n", (1000.0 * (double)num_samples / time));
+
+  int err;
+  cnn_ctx_t* ctx = cnn_open(NULL, &err);
+  if (ctx == NULL) {
+    fprintf(stderr, "ERROR: %s\n", cnn_strerror(err));
+    return 1;
+  }
+  const uint8_t** input = (const uint8_t**)malloc(sizeof(uint8_t*)*num_samples);
+  for (int i = 0; i < num_samples; i++)
+    samples[i] = i;
+  err = cnn_resolve(ctx, samples, num_samples, input);
+  if (err != CNN_OK) {
+    fprintf(stderr, "ERROR: %s\n", cnn_strerror(err));
+    cnn_close(ctx);
+    free(samples);
+    free(input);
+    return 1;
+  }
+
+  printf("Measuring the machine...\n");
+  double peak = perf_peak_flops();
+  double dram_bw = perf_bandwidth(64 << 20);
+  double l2_bw = perf_bandwidth(64 << 10);
+  printf("Peak %.2lf GFLOP/s, DRAM %.2lf GB/s (ridge %.2lf FLOP/B), L2 %.2lf GB/s (ridge %.2lf FLOP/B), one core\n",
+         peak * 1e-9, dram_bw * 1e-9, peak / dram_bw, l2_bw * 1e-9, peak / l2_bw);
+
+  perf_group_t g;
+  perf_open(&g);
+  int have[PERF_EVENTS];
+  for (int e = 0; e < PERF_EVENTS; e++)
+    have[e] = g.index[e] >= 0;
+  if (g.leader == -1) {
+    printf("Hardware counters unavailable (%s), memory traffic is estimated from the layer sizes\n",
+           strerror(errno));
+  } else {
+    for (int e = 0; e < PERF_EVENTS; e++) {
+      if (!have[e])
+        printf("Counter for %s unavailable\n", perf_event_names[e]);
+    }
+  }
+
+  double bw = have[3] ? dram_bw : l2_bw;
+  double ridge = peak / bw;
+
+  perf_stage_t s[PERF_STAGES];
+  memset(s, 0, sizeof(s));
+  perf_model(ctx->model->net, s);
+  printf("Running instrumented pass on %d pictures (one thread)...\n\n", num_samples);
+  perf_run(ctx->model->net, input, num_samples, &g, s);
+
+  printf("STAGE         us/img  GFLOP/s     IPC  L1D miss/img  LLC miss/img   bytes/img  FLOP/B  bound    %%roof\n");
+  for (int st = 0; st < PERF_STAGES; st++) {
+    double sec = s[st].ns * 1e-9;
+    double flops = s[st].flops * num_samples;
+    double bytes = have[3] ? (double)s[st].events[3] * CACHE_LINE : s[st].bytes * num_samples;
+    double ai = (bytes > 0) ? flops / bytes : 0.0;
+    double roof = (ai < ridge) ? ai * bw : peak;
+    double rate = (sec > 0) ? flops / sec : 0.0;
+
+    printf("%-10s %9.2lf %8.2lf", perf_stage_names[st], 1e6 * sec / num_samples, rate * 1e-9);
+    if (have[0] && have[1] && s[st].events[0] > 0)
+      printf(" %7.2lf", (double)s[st].events[1] / s[st].events[0]);
+    else
+      printf(" %7s", "n/a");
+    for (int e = 2; e < PERF_EVENTS; e++) {
+      if (have[e])
+        printf(" %13.1lf", (double)s[st].events[e] / num_samples);
+      else
+        printf(" %13s", "n/a");
+    }
+    printf(" %11.0lf%s %7.2lf  %-7s %6.1lf%%\n", bytes / num_samples, have[3] ? " " : "*", ai,
+           (ai < ridge) ? "memory" : "compute", 100.0 * rate / roof);
+  }
+  if (!have[3])
+    printf("\n* estimated from the layer sizes, against the L2 bandwidth\n");
+  printf("\n");
+
+  perf_tiling(ctx->model->net, input, num_samples, &g, have);
+
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    if (g.fd[e] >= 0)
+      close(g.fd[e]);
+  }
+  cnn_release(ctx, samples, num_samples);
+  free(samples);
+  free(input);
+  cnn_close(ctx);
+  return 0;
+}
@@ -3,42 +3,279 @@
 #include <Python.h>
 
 #include <stdio.h>
+#include <sys/time.h>
+
+#include "cnn.h"
 
 // These are wrapper functions that the Python server is calling into
 // in order to launch classification.
 
-double run_classification(int* samples, int n, double** keep_output);
+// The network and the data set stay loaded in this context for the lifetime
+// of the server process.
+static cnn_ctx_t* ctx = NULL;
+static cnn_options_t opts = { 0 };
+
+// Stage times of the last RunCNNClassifier or ClassifyImages call in ms, see
+// GetTrace.
+static double trace_load, trace_fetch, trace_infer;
+
+static double ms_between(struct timeval* a, struct timeval* b)
+{
+  return (b->tv_sec - a->tv_sec) * 1000.0 + (b->tv_usec - a->tv_usec) / 1000.0;
+}
+
+static PyObject* py_set_max_resident(PyObject* self, PyObject* args)
+{
+  long mb;
+
+  if (!PyArg_ParseTuple(args, "l", &mb) || mb < 0) {
+    return NULL;
+  }
+
+  opts.max_resident = (size_t)mb << 20;
+  if (ctx != NULL)
+    cnn_set_max_resident(ctx, opts.max_resident);
+  Py_RETURN_NONE;
+}
+
+// Replace each of the n items of results by 0 (cat) or -1 (no cat) from
+// output, and return the probs or top lists for topk >= 0 (see
+// RunCNNClassifier), NULL otherwise.
+static PyObject* build_results(PyObject* results, const double* output, Py_ssize_t n, int topk)
+{
+  int width = (topk >= 0) ? CNN_CLASSES : 1;
+  PyObject* extra = (topk >= 0) ? PyList_New(n) : NULL;
+  for (int i = 0; i < n; i++) {
+    const double* probs = output + width*i;
+    double cat = probs[(topk >= 0) ? CNN_CAT : 0];
+    PyList_SetItem(results, (Py_ssize_t)i, PyInt_FromLong((cat > 0.5) ? 0 : -1));
+
+    if (topk == 0) {
+      PyObject* row = PyList_New(CNN_CLASSES);
+      for (int c = 0; c < CNN_CLASSES; c++)
+        PyList_SetItem(row, c, PyFloat_FromDouble(probs[c]));
+      PyList_SetItem(extra, (Py_ssize_t)i, row);
+    } else if (topk > 0) {
+      int labels[CNN_CLASSES];
+      double scores[CNN_CLASSES];
+      cnn_topk(probs, topk, labels, scores);
+      PyObject* row = PyList_New(topk);
+      for (int j = 0; j < topk; j++)
+        PyList_SetItem(row, j, Py_BuildValue("[id]", labels[j], scores[j]));
+      PyList_SetItem(extra, (Py_ssize_t)i, row);
+    }
+  }
+  return extra;
+}
 
+// RunCNNClassifier(samples[, topk]) replaces every sample in the list by 0
+// (cat) or -1 (no cat) and returns the time it took in ms. With topk = 0 it
+// returns (ms, probs) instead, where probs has the probabilities of all
+// classes for every sample, and with topk = k > 0 (ms, top), where top has
+// the k most likely [label, probability] pairs for every sample.
 static PyObject* py_run_cnn_classifier(PyObject* self, PyObject* args)
 {
-  PyObject *input = PyList_New(0);
+  PyObject *input;
+  int topk = -1;
+
+  if (!PyArg_ParseTuple(args, "O!|i", &PyList_Type, &input, &topk)) {
+    return NULL;
+  }
+  if (topk > CNN_CLASSES) {
+    PyErr_SetString(PyExc_ValueError, "topk must be at most 10");
+    return NULL;
+  }
 
-  if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &input)) {
+  struct timeval load_time, fetch_time, start_time, end_time;
+
+  int err;
+  gettimeofday(&load_time, NULL);
+  if (ctx == NULL && (ctx = cnn_open(&opts, &err)) == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, cnn_strerror(err));
     return NULL;
   }
+  gettimeofday(&fetch_time, NULL);
 
-  int* samples = (int*)malloc(sizeof(int)*PyList_Size(input));
-  for (int i = 0; i < PyList_Size(input); i++) {
+  Py_ssize_t n = PyList_Size(input);
+  int* samples = (int*)malloc(sizeof(int)*n);
+  int width = (topk >= 0) ? CNN_CLASSES : 1;
+  double* output = (double*)malloc(sizeof(double)*width*(n > 0 ? n : 1));
+  for (int i = 0; i < n; i++) {
     samples[i] = (int) PyInt_AsLong(PyList_GetItem(input, (Py_ssize_t) i));
   }
 
-  double dt = run_classification(samples, PyList_Size(input), NULL);
+  // Other Python threads may run while we classify.
+  Py_BEGIN_ALLOW_THREADS
+  err = cnn_prefetch(ctx, samples, n);
+  gettimeofday(&start_time, NULL);
+  if (err == CNN_OK && topk >= 0)
+    err = cnn_classify_probs(ctx, samples, n, output);
+  else if (err == CNN_OK)
+    err = cnn_classify(ctx, samples, n, output);
+  gettimeofday(&end_time, NULL);
+  Py_END_ALLOW_THREADS
+
+  trace_load = ms_between(&load_time, &fetch_time);
+  trace_fetch = ms_between(&fetch_time, &start_time);
+  trace_infer = ms_between(&start_time, &end_time);
 
-  for (int i = 0; i < PyList_Size(input); i++) {
-    PyList_SetItem(input, (Py_ssize_t)i, PyInt_FromLong(samples[i]));
+  if (err != CNN_OK) {
+    free(samples);
+    free(output);
+    PyErr_SetString(PyExc_RuntimeError, cnn_strerror(err));
+    return NULL;
   }
 
+  PyObject* extra = build_results(input, output, n, topk);
+
   free(samples);
+  free(output);
 
+  double dt = trace_infer;
+  if (extra != NULL)
+    return Py_BuildValue("(dN)", dt, extra);
   return Py_BuildValue("d", dt);
 }
 
+// ClassifyImages(pixels[, topk]) classifies images that are not in the data
+// set. pixels is a str (or any other buffer) of CNN_IMAGE_BYTES per image,
+// see cnn_classify_images, and the network reads them right out of it.
+// Returns (ms, results) with 0 or -1 per image, or (ms, results, probs/top)
+// with topk as in RunCNNClassifier.
+static PyObject* py_classify_images(PyObject* self, PyObject* args)
+{
+  Py_buffer pixels;
+  int topk = -1;
+
+  if (!PyArg_ParseTuple(args, "s*|i", &pixels, &topk)) {
+    return NULL;
+  }
+  if (topk > CNN_CLASSES || pixels.len % CNN_IMAGE_BYTES != 0) {
+    PyBuffer_Release(&pixels);
+    PyErr_SetString(PyExc_ValueError, (topk > CNN_CLASSES) ? "topk must be at most 10" :
+                    "pixels must be a multiple of 3072 bytes");
+    return NULL;
+  }
+
+  struct timeval load_time, start_time, end_time;
+
+  int err;
+  gettimeofday(&load_time, NULL);
+  if (ctx == NULL && (ctx = cnn_open(&opts, &err)) == NULL) {
+    PyBuffer_Release(&pixels);
+    PyErr_SetString(PyExc_RuntimeError, cnn_strerror(err));
+    return NULL;
+  }
+
+  Py_ssize_t n = pixels.len / CNN_IMAGE_BYTES;
+  int width = (topk >= 0) ? CNN_CLASSES : 1;
+  double* output = (double*)malloc(sizeof(double)*width*(n > 0 ? n : 1));
+
+  // The buffer stays ours until it is released, with or without the GIL.
+  Py_BEGIN_ALLOW_THREADS
+  gettimeofday(&start_time, NULL);
+  if (topk >= 0)
+    err = cnn_classify_images_probs(ctx, (const uint8_t*)pixels.buf, n, output);
+  else
+    err = cnn_classify_images(ctx, (const uint8_t*)pixels.buf, n, output);
+  gettimeofday(&end_time, NULL);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&pixels);
+
+  trace_load = ms_between(&load_time, &start_time);
+  trace_fetch = 0.0;
+  trace_infer = ms_between(&start_time, &end_time);
+
+  if (err != CNN_OK) {
+    free(output);
+    PyErr_SetString(PyExc_RuntimeError, cnn_strerror(err));
+    return NULL;
+  }
+
+  PyObject* results = PyList_New(n);
+  PyObject* extra = build_results(results, output, n, topk);
+  free(output);
+
+  double dt = trace_infer;
+  if (extra != NULL)
+    return Py_BuildValue("(dNN)", dt, results, extra);
+  return Py_BuildValue("(dN)", dt, results);
+}
+
+// Reload([snapshot_dir]) loads a new snapshot and switches to it while
+// other threads go on classifying with the old one (see cnn_reload), and
+// returns the new model version. Without a directory, the current snapshot
+// directory is read again. The first call loads the network from it instead.
+static PyObject* py_reload(PyObject* self, PyObject* args)
+{
+  const char* dir = NULL;
+
+  if (!PyArg_ParseTuple(args, "|z", &dir)) {
+    return NULL;
+  }
+
+  int err = CNN_OK;
+  cnn_stats_t st;
+  if (ctx == NULL) {
+    opts.snapshot_dir = dir;
+    ctx = cnn_open(&opts, &err);
+    opts.snapshot_dir = NULL;
+  } else {
+    // Requests on other Python threads go on while the new one loads.
+    Py_BEGIN_ALLOW_THREADS
+    err = cnn_reload(ctx, dir);
+    Py_END_ALLOW_THREADS
+  }
+
+  if (err != CNN_OK) {
+    PyErr_SetString(PyExc_RuntimeError, cnn_strerror(err));
+    return NULL;
+  }
+  cnn_get_stats(ctx, &st);
+  return Py_BuildValue("K", (unsigned long long)st.model_version);
+}
+
+// GetTrace() returns the time the last RunCNNClassifier call spent loading
+// the network (only the first call does), fetching the samples from the data
+// set and classifying them, in ms.
+static PyObject* py_get_trace(PyObject* self, PyObject* args)
+{
+  return Py_BuildValue("{s:d,s:d,s:d}", "load", trace_load, "fetch", trace_fetch,
+                       "infer", trace_infer);
+}
+
+// GetStats() returns the data set cache counters and the model version and
+// reload counters (see cnn_get_stats), or None before the network is loaded.
+static PyObject* py_get_stats(PyObject* self, PyObject* args)
+{
+  cnn_stats_t st;
+  if (ctx == NULL || cnn_get_stats(ctx, &st) != CNN_OK)
+    Py_RETURN_NONE;
+  return Py_BuildValue("{s:K,s:K,s:K,s:n,s:n,s:n,s:K,s:K,s:K}",
+                       "hits", (unsigned long long)st.hits,
+                       "misses", (unsigned long long)st.misses,
+                       "evictions", (unsigned long long)st.evictions,
+                       "resident", (Py_ssize_t)st.resident,
+                       "max_resident", (Py_ssize_t)st.max_resident,
+                       "cache_bytes", (Py_ssize_t)st.cache_bytes,
+                       "model_version", (unsigned long long)st.model_version,
+                       "reloads", (unsigned long long)st.reloads,
+                       "reload_failures", (unsigned long long)st.reload_failures);
+}
+
 static PyMethodDef myModule_methods[] = {
   {"RunCNNClassifier", py_run_cnn_classifier, METH_VARARGS},
+  {"ClassifyImages", py_classify_images, METH_VARARGS},
+  {"SetMaxResidentMB", py_set_max_resident, METH_VARARGS},
+  {"Reload", py_reload, METH_VARARGS},
+  {"GetTrace", py_get_trace, METH_NOARGS},
+  {"GetStats", py_get_stats, METH_NOARGS},
   {NULL, NULL}
 };
 
 void initcnnModule()
 {
-  (void) Py_InitModule("cnnModule", myModule_methods);
+  PyObject* m = Py_InitModule("cnnModule", myModule_methods);
+  if (m != NULL)
+    PyModule_AddIntConstant(m, "IMAGE_BYTES", CNN_IMAGE_BYTES);
 }
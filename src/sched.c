@@ -0,0 +1,95 @@
+// Scheduling ------------------------------------------------------------------
+
+// 'cnn sched' shows how interactive requests fare next to bulk work on the
+// same context. It submits one large bulk request and then, while that is
+// running, a stream of small interactive requests with a deadline, and
+// reports the queueing delay and the missed deadlines of both classes. The
+// same load is run a second time with everything in the interactive class
+// and without deadlines, i.e. in plain FIFO order, for comparison.
+
+#define SCHED_INTERVAL_US 5000
+
+static void sched_run(int bulk, int interactive, int size, double deadline_ms, int prio) {
+  cnn_options_t opts = { 0 };
+  int err;
+  cnn_ctx_t* ctx = cnn_open(&opts, &err);
+  if (ctx == NULL) {
+    fprintf(stderr, "ERROR: %s\n", cnn_strerror(err));
+    exit(1);
+  }
+
+  int total = bulk + interactive * size;
+  int* samples = (int*)malloc(sizeof(int)*total);
+  double* output = (double*)malloc(sizeof(double)*total);
+  for (int i = 0; i < total; i++)
+    samples[i] = i;
+  err = cnn_prefetch(ctx, samples, total);
+  if (err != CNN_OK) {
+    fprintf(stderr, "ERROR: %s\n", cnn_strerror(err));
+    exit(1);
+  }
+
+  uint64_t start_time = timestamp_us();
+  int64_t id = cnn_submit_ex(ctx, samples, bulk, output, NULL,
+                             prio ? CNN_PRIO_BULK : CNN_PRIO_INTERACTIVE, 0);
+  for (int i = 0; i < interactive && id >= 0; i++) {
+    usleep(SCHED_INTERVAL_US);
+    int off = bulk + i * size;
+    id = cnn_submit_ex(ctx, samples + off, size, output + off, NULL,
+                       CNN_PRIO_INTERACTIVE, prio ? deadline_ms : 0);
+  }
+  if (id < 0) {
+    fprintf(stderr, "ERROR: %s\n", cnn_strerror((int)id));
+    exit(1);
+  }
+
+  // Without priorities, count the deadlines of the small requests here.
+  cnn_completion_t c;
+  int late = 0;
+  while (cnn_wait(ctx, &c) == CNN_OK) {
+    if (c.status != CNN_OK) {
+      fprintf(stderr, "ERROR: %s\n", cnn_strerror(c.status));
+      exit(1);
+    }
+    if (c.id > 0 && c.queue_ms + c.ms > deadline_ms)
+      late++;
+  }
+  uint64_t end_time = timestamp_us();
+
+  cnn_stats_t st;
+  cnn_get_stats(ctx, &st);
+  printf("%s: %d images in %.2lf ms\n", prio ? "PRIORITY" : "FIFO", total,
+         (end_time - start_time) / 1000.0);
+  for (int p = 0; p < CNN_PRIOS; p++) {
+    if (st.requests[p] == 0)
+      continue;
+    uint64_t missed = prio ? st.deadline_misses[p] : (uint64_t)late;
+    printf("  %-11s %4llu requests, queued %8.2lf ms on average, %8.2lf ms at most, %llu deadlines missed\n",
+           p == CNN_PRIO_INTERACTIVE ? "interactive" : "bulk", (unsigned long long)st.requests[p],
+           st.queue_ms[p] / st.requests[p], st.max_queue_ms[p], (unsigned long long)missed);
+  }
+
+  free(samples);
+  free(output);
+  cnn_close(ctx);
+}
+
+/*
+ * Usage: cnn sched [bulk images] [interactive requests] [images per request]
+ *                  [deadline ms]
+ */
+
+int do_sched(int argc, char** argv) {
+  int bulk = (argc > 0) ? atoi(argv[0]) : 2400;
+  int interactive = (argc > 1) ? atoi(argv[1]) : 20;
+  int size = (argc > 2) ? atoi(argv[2]) : 4;
+  double deadline_ms = (argc > 3) ? atof(argv[3]) : 100.0;
+  assert(bulk > 0 && interactive >= 0 && size > 0 && deadline_ms > 0);
+  assert(bulk + interactive * size <= data_size(DATA_FOLDER));
+
+  printf("%d bulk images, %d interactive requests of %d images every %d ms, deadline %.0lf ms\n",
+         bulk, interactive, size, SCHED_INTERVAL_US / 1000, deadline_ms);
+  sched_run(bulk, interactive, size, deadline_ms, 0);
+  sched_run(bulk, interactive, size, deadline_ms, 1);
+  return 0;
+}
@@ -0,0 +1,506 @@
+// Sharded classification --------------------------------------------------------
+
+// Runs one classification across several local worker processes (see
+// run_sharded_classification). The coordinator opens a libcnn context and
+// maps the data set before it forks, so all workers share the network
+// weights (copy-on-write pages that are never written) and the data set
+// (page cache). Each worker classifies a contiguous part of the sample list
+// in chunks of SHARD_CHUNK and sends one shard_result_t per chunk back to
+// the coordinator, which merges them in order.
+//
+// There are two transports for these messages:
+//   shm   a ring of shard_result_t in shared memory, guarded by a robust
+//         process-shared mutex. The workers read their part of the sample
+//         list directly from the memory inherited from the coordinator.
+//   unix  a stream socket per worker on a Unix domain socket. The worker
+//         connects, receives a shard_job_t with its samples and writes
+//         results. Nothing else is shared, so a remote worker only needs a
+//         different socket type.
+//
+// A worker that dies only costs its missing results: the coordinator notices
+// (waitpid, or EOF on the socket) and classifies those samples itself.
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <stddef.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#define SHARD_CHUNK 64
+#define SHARD_RING_SLOTS 64
+#define MAX_SHARD_PROCS 64
+
+#define SHARD_SHM  0
+#define SHARD_UNIX 1
+
+// The messages of the protocol. Only the first n entries of prob are sent
+// over a socket.
+typedef struct shard_job {
+  int32_t start;       // index of the first sample in the job
+  int32_t n;           // number of samples, followed by n int32_t indices
+} shard_job_t;
+
+typedef struct shard_result {
+  int32_t start;       // index of the first result in the job
+  int32_t n;           // number of results, at most SHARD_CHUNK
+  double prob[SHARD_CHUNK];
+} shard_result_t;
+
+// The shared memory ring of the shm transport. The workers produce, the
+// coordinator consumes.
+typedef struct shard_ring {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  int head;
+  int count;
+  shard_result_t slot[SHARD_RING_SLOTS];
+} shard_ring_t;
+
+// Lock the ring, recovering the lock if its owner died while holding it.
+// The slot it may have been writing is not published yet, so the ring
+// itself is consistent.
+static void ring_lock(shard_ring_t* ring) {
+  if (pthread_mutex_lock(&ring->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&ring->lock);
+}
+
+static shard_ring_t* ring_create() {
+  shard_ring_t* ring = (shard_ring_t*)mmap(NULL, sizeof(shard_ring_t), PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED)
+    return NULL;
+
+  pthread_mutexattr_t ma;
+  pthread_mutexattr_init(&ma);
+  pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&ring->lock, &ma);
+  pthread_mutexattr_destroy(&ma);
+
+  pthread_condattr_t ca;
+  pthread_condattr_init(&ca);
+  pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+  pthread_cond_init(&ring->not_empty, &ca);
+  pthread_cond_init(&ring->not_full, &ca);
+  pthread_condattr_destroy(&ca);
+
+  ring->head = 0;
+  ring->count = 0;
+  return ring;
+}
+
+static void ring_destroy(shard_ring_t* ring) {
+  pthread_mutex_destroy(&ring->lock);
+  pthread_cond_destroy(&ring->not_empty);
+  pthread_cond_destroy(&ring->not_full);
+  munmap(ring, sizeof(shard_ring_t));
+}
+
+static void ring_put(shard_ring_t* ring, const shard_result_t* r) {
+  ring_lock(ring);
+  while (ring->count == SHARD_RING_SLOTS)
+    pthread_cond_wait(&ring->not_full, &ring->lock);
+  ring->slot[(ring->head + ring->count) % SHARD_RING_SLOTS] = *r;
+  ring->count++;
+  pthread_cond_signal(&ring->not_empty);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+// Take the next result, waiting at most 100 ms for one. Returns 0 on
+// success and -1 on timeout, so the caller can check for dead workers.
+static int ring_get(shard_ring_t* ring, shard_result_t* r) {
+  struct timespec until;
+  clock_gettime(CLOCK_MONOTONIC, &until);
+  until.tv_nsec += 100000000;
+  if (until.tv_nsec >= 1000000000) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000;
+  }
+
+  int ok = -1;
+  ring_lock(ring);
+  while (ring->count == 0) {
+    if (pthread_cond_timedwait(&ring->not_empty, &ring->lock, &until) == ETIMEDOUT)
+      break;
+  }
+  if (ring->count > 0) {
+    *r = ring->slot[ring->head];
+    ring->head = (ring->head + 1) % SHARD_RING_SLOTS;
+    ring->count--;
+    pthread_cond_signal(&ring->not_full);
+    ok = 0;
+  }
+  pthread_mutex_unlock(&ring->lock);
+  return ok;
+}
+
+// Read or write exactly size bytes of a socket. Return 0 on success.
+static int read_full(int fd, void* buf, size_t size) {
+  char* p = (char*)buf;
+  while (size > 0) {
+    ssize_t k = read(fd, p, size);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return -1;
+    p += k;
+    size -= k;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void* buf, size_t size) {
+  const char* p = (const char*)buf;
+  while (size > 0) {
+    ssize_t k = write(fd, p, size);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return -1;
+    p += k;
+    size -= k;
+  }
+  return 0;
+}
+
+static int send_result(int fd, const shard_result_t* r) {
+  return write_full(fd, r, offsetof(shard_result_t, prob) + sizeof(double)*r->n);
+}
+
+static int recv_result(int fd, shard_result_t* r) {
+  if (read_full(fd, r, offsetof(shard_result_t, prob)) != 0 ||
+      r->n < 0 || r->n > SHARD_CHUNK)
+    return -1;
+  return read_full(fd, r->prob, sizeof(double)*r->n);
+}
+
+/*
+ * The worker side: classify samples [start, start+n) of the job chunk by
+ * chunk and publish every chunk through the ring (shm) or the socket fd
+ * (unix). In the unix case samples and start/n are read from the socket.
+ */
+
+static int shard_worker(cnn_ctx_t* ctx, int transport, shard_ring_t* ring, int fd,
+                        const int* samples, int start, int n) {
+  int* own = NULL;
+  int base = 0;
+  if (transport == SHARD_UNIX) {
+    shard_job_t job;
+    if (read_full(fd, &job, sizeof(job)) != 0 || job.n < 0)
+      return 1;
+    own = (int*)malloc(sizeof(int)*(job.n > 0 ? job.n : 1));
+    if (read_full(fd, own, sizeof(int32_t)*job.n) != 0)
+      return 1;
+    samples = own;
+    base = start = job.start;
+    n = job.n;
+  }
+
+  shard_result_t r;
+  for (int i = start; i < start + n; i += SHARD_CHUNK) {
+    r.start = i;
+    r.n = (start + n - i < SHARD_CHUNK) ? start + n - i : SHARD_CHUNK;
+    if (cnn_classify(ctx, samples + i - base, r.n, r.prob) != CNN_OK)
+      return 1;
+    if (transport == SHARD_SHM)
+      ring_put(ring, &r);
+    else if (send_result(fd, &r) != 0)
+      return 1;
+  }
+
+  free(own);
+  return 0;
+}
+
+/*
+ * Collect the workers that have exited, waiting for all of them if block is
+ * set. alive[w] is cleared once worker w is gone. Returns the number of
+ * workers that failed.
+ */
+
+static int reap_workers(pid_t* pid, int* alive, int procs, int block) {
+  int failed = 0;
+  for (int w = 0; w < procs; w++) {
+    int status;
+    if (alive[w] && waitpid(pid[w], &status, block ? 0 : WNOHANG) == pid[w]) {
+      alive[w] = 0;
+      failed += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+  }
+  return failed;
+}
+
+static int any_alive(int* alive, int procs) {
+  for (int w = 0; w < procs; w++) {
+    if (alive[w])
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Undo a start that failed halfway: kill the first forked workers and
+ * release the ring or the listening socket at path.
+ */
+
+static void shard_abort(pid_t* pid, int forked, shard_ring_t* ring, int listener,
+                        const char* path) {
+  for (int w = 0; w < forked; w++)
+    kill(pid[w], SIGKILL);
+  for (int w = 0; w < forked; w++)
+    waitpid(pid[w], NULL, 0);
+  if (ring != NULL)
+    ring_destroy(ring);
+  if (listener >= 0) {
+    close(listener);
+    unlink(path);
+  }
+}
+
+/*
+ * Same as run_classification, but splits the samples across procs worker
+ * processes that talk to this one through the given transport (SHARD_SHM
+ * or SHARD_UNIX). The reported time covers everything from starting the
+ * workers to having merged the last result. Returns -1 if the ring, the
+ * socket or the workers cannot be set up.
+ */
+
+double run_sharded_classification(int* samples, int n, double** keep_output,
+                                  int procs, int transport) {
+  assert(procs > 0 && procs <= MAX_SHARD_PROCS);
+
+  // libgomp does not survive a fork once it has started threads, and
+  // cnn_open already runs parallel regions (make_vol). Keep the
+  // coordinator to one thread, so that no OpenMP threads exist when it
+  // forks and each worker starts its own. The caller's thread count is
+  // restored once all workers are forked.
+  int threads = omp_get_max_threads();
+  omp_set_num_threads(1);
+
+  printf("Making network...\n");
+  int err;
+  cnn_ctx_t* ctx = cnn_open(NULL, &err);
+  if (ctx == NULL) {
+    fprintf(stderr, "ERROR: %s\n", cnn_strerror(err));
+    exit(1);
+  }
+
+  printf("Loading batches...\n");
+  err = cnn_prefetch(ctx, samples, n);
+  if (err != CNN_OK) {
+    fprintf(stderr, "ERROR: %s\n", cnn_strerror(err));
+    exit(1);
+  }
+
+  // Split the cores between the workers, unless the tuning file says
+  // otherwise.
+  int tuned_threads = ctx->threads;
+  if (ctx->threads == 0)
+    ctx->threads = (omp_get_num_procs() / procs > 0) ? omp_get_num_procs() / procs : 1;
+
+  double* output = (double*)malloc(sizeof(double)*(n > 0 ? n : 1));
+  char* done = (char*)calloc(n > 0 ? n : 1, 1);
+  int first[MAX_SHARD_PROCS + 1];
+  for (int w = 0; w <= procs; w++)
+    first[w] = (int)((long)n * w / procs);
+
+  shard_ring_t* ring = NULL;
+  int listener = -1;
+  struct sockaddr_un addr;
+  const char* setup_error = NULL;
+  if (transport == SHARD_SHM) {
+    ring = ring_create();
+    if (ring == NULL)
+      setup_error = "Cannot map the result ring";
+  } else {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/cnn-shard-%d.sock", (int)getpid());
+    unlink(addr.sun_path);
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+      setup_error = "Cannot create the shard socket";
+    else if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+      setup_error = "Cannot bind the shard socket";
+    else if (listen(listener, procs) != 0)
+      setup_error = "Cannot listen on the shard socket";
+  }
+  if (setup_error != NULL) {
+    fprintf(stderr, "ERROR: %s: %s\n", setup_error, strerror(errno));
+    shard_abort(NULL, 0, ring, listener, addr.sun_path);
+    free(output);
+    free(done);
+    cnn_close(ctx);
+    omp_set_num_threads(threads);
+    return -1.0;
+  }
+
+  printf("Running classification on %d %s workers...\n", procs,
+         transport == SHARD_SHM ? "shm" : "unix");
+  fflush(stdout);
+  uint64_t start_time = timestamp_us();
+
+  pid_t pid[MAX_SHARD_PROCS];
+  int alive[MAX_SHARD_PROCS];
+  pid_t parent = getpid();
+  for (int w = 0; w < procs; w++) {
+    pid[w] = fork();
+    if (pid[w] < 0) {
+      fprintf(stderr, "ERROR: Cannot fork shard worker %d: %s\n", w, strerror(errno));
+      shard_abort(pid, w, ring, listener, addr.sun_path);
+      free(output);
+      free(done);
+      cnn_close(ctx);
+      omp_set_num_threads(threads);
+      return -1.0;
+    }
+    alive[w] = 1;
+    if (pid[w] == 0) {
+      // Do not outlive the coordinator.
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      if (getppid() != parent)
+        _exit(1);
+      int fd = -1;
+      if (transport == SHARD_UNIX) {
+        close(listener);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+          _exit(1);
+      }
+      _exit(shard_worker(ctx, transport, ring, fd, samples, first[w], first[w+1] - first[w]));
+    }
+  }
+  omp_set_num_threads(threads);
+
+  // Send every worker that connects its job (identified by the pid of the
+  // peer), until each one has either connected or exited.
+  struct pollfd fds[MAX_SHARD_PROCS];
+  int failed = 0;
+  for (int w = 0; w < procs; w++) {
+    fds[w].fd = -1;
+    fds[w].events = POLLIN;
+  }
+  if (transport == SHARD_UNIX) {
+    for (;;) {
+      int pending = 0;
+      for (int w = 0; w < procs; w++)
+        pending += alive[w] && fds[w].fd == -1;
+      if (pending == 0)
+        break;
+
+      struct pollfd lfd = { listener, POLLIN, 0 };
+      if (poll(&lfd, 1, 100) <= 0) {
+        failed += reap_workers(pid, alive, procs, 0);
+        continue;
+      }
+
+      int fd = accept(listener, NULL, NULL);
+      struct ucred cred;
+      socklen_t len = sizeof(cred);
+      if (fd < 0 || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        continue;
+      int w = 0;
+      while (w < procs && pid[w] != cred.pid)
+        w++;
+      if (w == procs || fds[w].fd != -1) {
+        close(fd);
+        continue;
+      }
+
+      fds[w].fd = fd;
+      shard_job_t job = { first[w], first[w+1] - first[w] };
+      if (write_full(fd, &job, sizeof(job)) != 0 ||
+          write_full(fd, samples + job.start, sizeof(int32_t)*job.n) != 0) {
+        close(fd);
+        fds[w].fd = -2;
+      }
+    }
+    close(listener);
+    unlink(addr.sun_path);
+  }
+
+  // Merge the results until all are in or nobody is left to send any.
+  int received = 0;
+  shard_result_t r;
+  while (received < n) {
+    if (transport == SHARD_SHM) {
+      if (ring_get(ring, &r) == 0) {
+        memcpy(output + r.start, r.prob, sizeof(double)*r.n);
+        memset(done + r.start, 1, r.n);
+        received += r.n;
+        continue;
+      }
+      // The ring was empty for a while, see whether anyone is left.
+      failed += reap_workers(pid, alive, procs, 0);
+      if (!any_alive(alive, procs) && ring->count == 0)
+        break;
+    } else {
+      int open_fds = 0;
+      for (int w = 0; w < procs; w++)
+        open_fds += fds[w].fd >= 0;
+      if (open_fds == 0)
+        break;
+      if (poll(fds, procs, -1) <= 0)
+        continue;
+      for (int w = 0; w < procs; w++) {
+        if (fds[w].fd < 0 || fds[w].revents == 0)
+          continue;
+        if (recv_result(fds[w].fd, &r) != 0 || r.start < 0 || r.start + r.n > n) {
+          close(fds[w].fd);
+          fds[w].fd = -2;
+          continue;
+        }
+        memcpy(output + r.start, r.prob, sizeof(double)*r.n);
+        memset(done + r.start, 1, r.n);
+        received += r.n;
+      }
+    }
+  }
+
+  failed += reap_workers(pid, alive, procs, 1);
+  for (int w = 0; w < procs; w++) {
+    if (fds[w].fd >= 0)
+      close(fds[w].fd);
+  }
+
+  // Classify whatever the failed workers left behind.
+  if (received < n) {
+    printf("WARNING: %d worker(s) failed, classifying %d samples locally\n", failed, n - received);
+    // The workers are gone, so the local pass may use every core again.
+    ctx->threads = tuned_threads;
+    for (int i = 0; i < n; i++) {
+      if (!done[i] && cnn_classify(ctx, samples + i, 1, output + i) != CNN_OK) {
+        fprintf(stderr, "ERROR: Cannot classify sample %d\n", samples[i]);
+        exit(1);
+      }
+    }
+  }
+
+  uint64_t end_time = timestamp_us();
+
+  for (int i = 0; i < n; i++) {
+    samples[i] = (output[i] > 0.5) ? 0 : -1;
+  }
+
+  double dt = (double)(end_time-start_time) / 1000.0;
+  printf("TIME: %lf ms\n", dt);
+
+  if (ring != NULL)
+    ring_destroy(ring);
+  free(done);
+  cnn_close(ctx);
+
+  if (keep_output == NULL)
+    free(output);
+  else
+    *keep_output = output;
+
+  return dt;
+}
@@ -0,0 +1,280 @@
+// Streaming classification ----------------------------------------------------
+
+// 'cnn stream' loads the network once and then classifies whatever arrives
+// on stdin, or on each connection to a Unix domain socket, until the input
+// ends. The input is either a list of sample indices (text, separated by
+// white space or commas) or a sequence of raw 3073-byte CIFAR records. It is
+// classified in micro-batches: a batch is run as soon as STREAM_BATCH items
+// are there or no more input is available right now, and its results are
+// written and flushed right away, one line per item:
+//
+//   <key>,<cat probability>[,<probability of class 0>,...,<class 9>]
+//
+// where key is the sample index, or the position of the record in the
+// stream for raw input. Indices that are not in the data set give
+// "<key>,error" (with key -1 if it is not a number at all or too long to be
+// one). A summary goes to stderr when the input ends.
+//
+// SIGHUP reloads the snapshot in the background (see cnn_reload): batches
+// that are running finish on the old network, the next ones get the new
+// one.
+
+#include <ctype.h>
+
+#define STREAM_BATCH 64
+#define STREAM_BUF (STREAM_BATCH * CIFAR_RECORD)
+
+typedef struct stream_opts {
+  int raw;     // input is raw records instead of sample indices
+  int all;     // also write the probabilities of all classes
+} stream_opts_t;
+
+// Whether there is input that can be read without blocking.
+static int stream_readable(int fd) {
+  struct pollfd p = { fd, POLLIN, 0 };
+  return poll(&p, 1, 0) > 0;
+}
+
+/*
+ * Classify the stream that arrives on fd and write the results to out.
+ * Returns the number of items classified.
+ */
+
+static long stream_serve(cnn_ctx_t* ctx, int fd, FILE* out, stream_opts_t* opts) {
+  char* buf = (char*)malloc(STREAM_BUF);
+  uint8_t* records = (uint8_t*)malloc((size_t)STREAM_BATCH * CIFAR_RECORD);
+  double* prob = (double*)malloc(sizeof(double) * 10 * STREAM_BATCH);
+  long key[STREAM_BATCH];
+  int ok[STREAM_BATCH];
+  int held[STREAM_BATCH];
+  const uint8_t* input[STREAM_BATCH];
+  size_t len = 0;
+  int pending = 0;
+  int eof = 0;
+  int skip = 0;    // still dropping the tail of an over-long token
+  long seq = 0;
+  long total = 0;
+  int batches = 0;
+
+  uint64_t start_time = timestamp_us();
+  for (;;) {
+    // Block for input only if there is nothing else to do.
+    if (!eof && len < STREAM_BUF && (pending == 0 || stream_readable(fd))) {
+      ssize_t k = read(fd, buf + len, STREAM_BUF - len);
+      if (k < 0 && errno == EINTR)
+        continue;
+      if (k <= 0)
+        eof = 1;
+      else
+        len += k;
+    }
+
+    // Take as many complete items from the buffer as fit into the batch.
+    size_t pos = 0;
+    while (pending < STREAM_BATCH) {
+      if (opts->raw) {
+        if (len - pos < CIFAR_RECORD)
+          break;
+        memcpy(records + (size_t)pending * CIFAR_RECORD, buf + pos, CIFAR_RECORD);
+        input[pending] = records + (size_t)pending * CIFAR_RECORD + 1;
+        key[pending] = seq++;
+        ok[pending] = 1;
+        pos += CIFAR_RECORD;
+      } else {
+        while (skip && pos < len && !isspace((unsigned char)buf[pos]) && buf[pos] != ',')
+          pos++;
+        if (skip && pos == len && !eof)
+          break;
+        skip = 0;
+        while (pos < len && (isspace((unsigned char)buf[pos]) || buf[pos] == ','))
+          pos++;
+        size_t end = pos;
+        while (end < len && !isspace((unsigned char)buf[end]) && buf[end] != ',')
+          end++;
+        char tok[32];
+        if (end - pos >= sizeof(tok)) {
+          // No index is that long, report it and drop whatever of it is
+          // still to come.
+          ok[pending] = 0;
+          key[pending] = -1;
+          skip = (end == len && !eof);
+          pos = end;
+          pending++;
+          continue;
+        }
+        if (end == pos || (end == len && !eof))
+          break;
+        snprintf(tok, sizeof(tok), "%.*s", (int)(end - pos), buf + pos);
+        char* rest;
+        long idx = strtol(tok, &rest, 10);
+        int sample = (int)idx;
+        ok[pending] = *rest == '\0' && idx >= 0 && idx <= INT32_MAX &&
+                      cnn_resolve(ctx, &sample, 1, input + pending) == CNN_OK;
+        key[pending] = (*rest == '\0') ? idx : -1;
+        pos = end;
+      }
+      pending++;
+    }
+    memmove(buf, buf + pos, len - pos);
+    len -= pos;
+
+    // Run the batch once it is full or the input has dried up for now.
+    if (pending > 0 && (pending == STREAM_BATCH || eof || !stream_readable(fd))) {
+      int m = 0;
+      int h = 0;
+      for (int i = 0; i < pending; i++) {
+        if (ok[i])
+          input[m++] = input[i];
+        if (ok[i] && !opts->raw)
+          held[h++] = (int)key[i];
+      }
+      cnn_infer(ctx, input, m, prob, opts->all ? ALL_CLASSES : CAT_LABEL);
+      cnn_release(ctx, held, h);
+
+      for (int i = 0, j = 0; i < pending; i++) {
+        if (!ok[i]) {
+          fprintf(out, "%ld,error\n", key[i]);
+          continue;
+        }
+        if (opts->all) {
+          fprintf(out, "%ld,%lf", key[i], prob[10*j + CAT_LABEL]);
+          for (int c = 0; c < 10; c++)
+            fprintf(out, ",%lf", prob[10*j + c]);
+          fprintf(out, "\n");
+        } else {
+          fprintf(out, "%ld,%lf\n", key[i], prob[j]);
+        }
+        j++;
+      }
+      fflush(out);
+
+      total += m;
+      batches++;
+      pending = 0;
+    }
+
+    if (eof && pending == 0 && (opts->raw ? len < CIFAR_RECORD : len == 0))
+      break;
+  }
+  uint64_t end_time = timestamp_us();
+
+  if (len > 0)
+    fprintf(stderr, "WARNING: Ignoring %d bytes of an incomplete record\n", (int)len);
+  fprintf(stderr, "STREAM: %ld images in %d micro-batches, %.2lf Cat/s\n", total, batches,
+          total > 0 ? 1e6 * total / (double)(end_time - start_time) : 0.0);
+
+  free(buf);
+  free(records);
+  free(prob);
+  return total;
+}
+
+static void stream_report(cnn_ctx_t* ctx) {
+  cnn_stats_t st;
+  cnn_get_stats(ctx, &st);
+  fprintf(stderr, "DATA: %llu hits, %llu misses, %llu evictions, %zu MB resident\n",
+          (unsigned long long)st.hits, (unsigned long long)st.misses,
+          (unsigned long long)st.evictions, st.resident >> 20);
+}
+
+// Reload the snapshot on every SIGHUP, which all other threads block.
+static void* stream_reloader(void* arg) {
+  cnn_ctx_t* ctx = (cnn_ctx_t*)arg;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+  for (;;) {
+    int sig;
+    if (sigwait(&set, &sig) != 0)
+      continue;
+    uint64_t start_time = timestamp_us();
+    int err = cnn_reload(ctx, NULL);
+    uint64_t end_time = timestamp_us();
+    cnn_stats_t st;
+    cnn_get_stats(ctx, &st);
+    if (err == CNN_OK)
+      fprintf(stderr, "RELOAD: model version %llu in %.2lf ms\n",
+              (unsigned long long)st.model_version, (end_time - start_time) / 1000.0);
+    else
+      fprintf(stderr, "RELOAD: %s, still serving version %llu\n", cnn_strerror(err),
+              (unsigned long long)st.model_version);
+  }
+  return NULL;
+}
+
+/*
+ * Usage: cnn stream [raw] [all] [mem:<MB>] [unix:<path>]
+ *
+ * mem limits the memory used for the data set (see cnn_set_max_resident).
+ */
+
+int do_stream(int argc, char** argv) {
+  stream_opts_t opts = { 0, 0 };
+  const char* path = NULL;
+  cnn_options_t ctx_opts = { 0 };
+  for (int i = 0; i < argc; i++) {
+    if (!strcmp(argv[i], "raw")) {
+      opts.raw = 1;
+    } else if (!strcmp(argv[i], "all")) {
+      opts.all = 1;
+    } else if (!strncmp(argv[i], "unix:", 5)) {
+      path = argv[i] + 5;
+    } else if (!strncmp(argv[i], "mem:", 4)) {
+      ctx_opts.max_resident = (size_t)atol(argv[i] + 4) << 20;
+    } else {
+      fprintf(stderr, "Usage: ./cnn stream [raw] [all] [mem:<MB>] [unix:<path>]\n");
+      return 2;
+    }
+  }
+
+  // Blocked before any thread exists, so that only the reloader gets it.
+  sigset_t hup;
+  sigemptyset(&hup);
+  sigaddset(&hup, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &hup, NULL);
+
+  int err;
+  cnn_ctx_t* ctx = cnn_open(&ctx_opts, &err);
+  if (ctx == NULL) {
+    fprintf(stderr, "ERROR: %s\n", cnn_strerror(err));
+    return 1;
+  }
+  pthread_t reloader;
+  pthread_create(&reloader, NULL, stream_reloader, ctx);
+  pthread_detach(reloader);
+
+  if (path == NULL) {
+    stream_serve(ctx, 0, stdout, &opts);
+    stream_report(ctx);
+    cnn_close(ctx);
+    return 0;
+  }
+
+  // Serve one connection after the other, forever.
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  unlink(addr.sun_path);
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(listener, 16) != 0) {
+    fprintf(stderr, "ERROR: Cannot listen on %s\n", path);
+    return 1;
+  }
+  fprintf(stderr, "Listening on %s\n", path);
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0)
+      continue;
+    FILE* out = fdopen(dup(fd), "w");
+    if (out != NULL) {
+      stream_serve(ctx, fd, out, &opts);
+      stream_report(ctx);
+      fclose(out);
+    }
+    close(fd);
+  }
+}
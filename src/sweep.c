@@ -0,0 +1,358 @@
+// Scaling sweep ---------------------------------------------------------------
+
+// 'cnn sweep' measures a grid of image counts x thread counts x kernel
+// variants, each cell with several trials, and derives the speedup and the
+// parallel efficiency over the smallest thread count of the grid. Thread
+// counts above the number of cores are skipped. With several runs the whole
+// grid is measured again for each, and a cell reports the median of its
+// per-run medians and their spread (max - min over the median).
+//
+// The results can be written as CSV and JSON and compared against a
+// baseline in the same CSV format: a cell whose median rate, speedup or
+// efficiency falls below the baseline's by more than the threshold counts as
+// a regression, and any regression makes the command fail. Speedup and
+// efficiency are only compared for cells with more threads than the
+// smallest count, so the baseline needs at least two thread counts, i.e. it
+// has to be recorded on a machine with at least two cores.
+
+#define SWEEP_MAX 16
+#define SWEEP_TRIALS 5
+#define SWEEP_THRESHOLD 0.25
+
+typedef struct sweep_variant {
+  const char* name;
+  int cross_image;
+  int batched_head;
+} sweep_variant_t;
+
+static const sweep_variant_t sweep_variants[] = {
+  { "cross+head", 1, 1 },
+  { "cross", 1, 0 },
+  { "head", 0, 1 },
+  { "plain", 0, 0 },
+};
+
+#define SWEEP_VARIANTS (int)(sizeof(sweep_variants) / sizeof(sweep_variant_t))
+
+// What regressed in a cell.
+#define SWEEP_RATE 1
+#define SWEEP_SPEEDUP 2
+#define SWEEP_EFFICIENCY 4
+
+typedef struct sweep_cell {
+  int size;
+  int threads;
+  int variant;
+  double best;        // Cat/s
+  double median;      // Cat/s, median of the per-run medians
+  double spread;      // (max - min) / median of the per-run medians
+  double speedup;     // best over the best with the fewest threads
+  double efficiency;  // speedup per additional thread factor
+  double baseline;    // median rate in the baseline, 0 if none
+  double base_speedup;
+  double base_efficiency;
+  int regressed;      // SWEEP_RATE, SWEEP_SPEEDUP and/or SWEEP_EFFICIENCY
+  double run_median[SWEEP_MAX];
+} sweep_cell_t;
+
+// Parse a comma-separated list of at most SWEEP_MAX positive numbers.
+static int sweep_list(const char* s, int* out) {
+  int n = 0;
+  while (*s && n < SWEEP_MAX) {
+    out[n] = atoi(s);
+    assert(out[n] > 0);
+    n++;
+    s = strchr(s, ',');
+    if (s == NULL)
+      break;
+    s++;
+  }
+  return n;
+}
+
+static int compare_double(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static double median_of(double* v, int n) {
+  qsort(v, n, sizeof(double), compare_double);
+  return (n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+// Measure run r of cell c.
+static void sweep_measure(network_t* net, const uint8_t** input, double* output,
+                          sweep_cell_t* c, int trials, int r) {
+  tuning_t t = get_tuning(net, c->threads);
+  t.cross_image = sweep_variants[c->variant].cross_image;
+  t.batched_head = sweep_variants[c->variant].batched_head;
+  apply_tuning(net, &t);
+  omp_set_num_threads(c->threads);
+
+  double rate[SWEEP_MAX];
+  for (int k = 0; k < trials; k++) {
+    uint64_t start_time = timestamp_us();
+    net_classify_cats(net, input, output, c->size);
+    uint64_t end_time = timestamp_us();
+    rate[k] = 1e6 * c->size / (double)(end_time - start_time);
+  }
+  c->run_median[r] = median_of(rate, trials);
+  if (rate[trials - 1] > c->best)
+    c->best = rate[trials - 1];
+}
+
+static void sweep_summarize(sweep_cell_t* c, int runs) {
+  double m[SWEEP_MAX];
+  memcpy(m, c->run_median, sizeof(double) * runs);
+  c->median = median_of(m, runs);
+  c->spread = (m[runs - 1] - m[0]) / c->median;
+}
+
+// Fill in the baseline median rates, speedups and efficiencies of the cells
+// from a CSV file written by sweep_csv. Returns -1 if the file cannot be
+// read.
+static int sweep_load_baseline(const char* fn, sweep_cell_t* cells, int n) {
+  FILE* fin = fopen(fn, "r");
+  if (fin == NULL)
+    return -1;
+
+  char line[256];
+  char name[32];
+  int size, threads;
+  double best, median, speedup, efficiency;
+  while (fgets(line, sizeof(line), fin) != NULL) {
+    if (sscanf(line, "%d,%d,%31[^,],%lf,%lf,%lf,%lf", &size, &threads, name,
+               &best, &median, &speedup, &efficiency) < 7)
+      continue;
+    for (int i = 0; i < n; i++) {
+      if (cells[i].size == size && cells[i].threads == threads &&
+          !strcmp(sweep_variants[cells[i].variant].name, name)) {
+        cells[i].baseline = median;
+        cells[i].base_speedup = speedup;
+        cells[i].base_efficiency = efficiency;
+      }
+    }
+  }
+  fclose(fin);
+  return 0;
+}
+
+// Compare cell c against its baseline, allowing a drop of threshold.
+static void sweep_compare(sweep_cell_t* c, int min_threads, double threshold) {
+  c->regressed = 0;
+  if (c->median < c->baseline * (1.0 - threshold))
+    c->regressed |= SWEEP_RATE;
+  if (c->threads > min_threads) {
+    if (c->speedup < c->base_speedup * (1.0 - threshold))
+      c->regressed |= SWEEP_SPEEDUP;
+    if (c->efficiency < c->base_efficiency * (1.0 - threshold))
+      c->regressed |= SWEEP_EFFICIENCY;
+  }
+}
+
+static int sweep_csv(const char* fn, const sweep_cell_t* cells, int n) {
+  FILE* fout = fopen(fn, "w");
+  if (fout == NULL)
+    return -1;
+
+  fprintf(fout, "size,threads,variant,best,median,speedup,efficiency,spread\n");
+  for (int i = 0; i < n; i++) {
+    const sweep_cell_t* c = cells + i;
+    fprintf(fout, "%d,%d,%s,%.2lf,%.2lf,%.3lf,%.3lf,%.3lf\n", c->size, c->threads,
+            sweep_variants[c->variant].name, c->best, c->median, c->speedup, c->efficiency,
+            c->spread);
+  }
+  return fclose(fout) == 0 ? 0 : -1;
+}
+
+static int sweep_json(const char* fn, const sweep_cell_t* cells, int n) {
+  FILE* fout = fopen(fn, "w");
+  if (fout == NULL)
+    return -1;
+
+  fprintf(fout, "[\n");
+  for (int i = 0; i < n; i++) {
+    const sweep_cell_t* c = cells + i;
+    fprintf(fout, "  {\"size\": %d, \"threads\": %d, \"variant\": \"%s\", \"best\": %.2lf, "
+            "\"median\": %.2lf, \"spread\": %.3lf, \"speedup\": %.3lf, \"efficiency\": %.3lf",
+            c->size, c->threads, sweep_variants[c->variant].name, c->best, c->median,
+            c->spread, c->speedup, c->efficiency);
+    if (c->baseline > 0)
+      fprintf(fout, ", \"baseline\": %.2lf, \"base_speedup\": %.3lf, \"base_efficiency\": %.3lf, "
+              "\"regression\": %s", c->baseline, c->base_speedup, c->base_efficiency,
+              c->regressed ? "true" : "false");
+    fprintf(fout, "}%s\n", (i + 1 < n) ? "," : "");
+  }
+  fprintf(fout, "]\n");
+  return fclose(fout) == 0 ? 0 : -1;
+}
+
+/*
+ * Usage: cnn sweep [sizes:<n,...>] [threads:<n,...>] [variants:<name,...>]
+ *                  [trials:<n>] [runs:<n>] [csv:<file>] [json:<file>]
+ *                  [baseline:<file>] [threshold:<fraction>]
+ *
+ * The defaults are sizes:1200,2400, threads:1,2, all variants, 5 trials,
+ * 1 run and a threshold of 0.25.
+ */
+
+int do_sweep(int argc, char** argv) {
+  int sizes[SWEEP_MAX] = { 1200, 2400 };
+  int threads[SWEEP_MAX] = { 1, 2 };
+  int use[SWEEP_VARIANTS];
+  int num_sizes = 2;
+  int num_threads = 2;
+  int trials = SWEEP_TRIALS;
+  int runs = 1;
+  double threshold = SWEEP_THRESHOLD;
+  const char* csv = NULL;
+  const char* json = NULL;
+  const char* baseline = NULL;
+  for (int v = 0; v < SWEEP_VARIANTS; v++)
+    use[v] = 1;
+
+  for (int i = 0; i < argc; i++) {
+    char* arg = strchr(argv[i], ':');
+    arg = (arg != NULL) ? arg + 1 : argv[i];
+    if (!strncmp(argv[i], "sizes:", 6)) {
+      num_sizes = sweep_list(arg, sizes);
+    } else if (!strncmp(argv[i], "threads:", 8)) {
+      num_threads = sweep_list(arg, threads);
+    } else if (!strncmp(argv[i], "variants:", 9)) {
+      for (int v = 0; v < SWEEP_VARIANTS; v++) {
+        const char* s = strstr(arg, sweep_variants[v].name);
+        size_t len = strlen(sweep_variants[v].name);
+        use[v] = s != NULL && (s == arg || s[-1] == ',') && (s[len] == '\0' || s[len] == ',');
+      }
+    } else if (!strncmp(argv[i], "trials:", 7)) {
+      trials = atoi(arg);
+    } else if (!strncmp(argv[i], "runs:", 5)) {
+      runs = atoi(arg);
+    } else if (!strncmp(argv[i], "csv:", 4)) {
+      csv = arg;
+    } else if (!strncmp(argv[i], "json:", 5)) {
+      json = arg;
+    } else if (!strncmp(argv[i], "baseline:", 9)) {
+      baseline = arg;
+    } else if (!strncmp(argv[i], "threshold:", 10)) {
+      threshold = atof(arg);
+    } else {
+      printf("Usage: ./cnn sweep [sizes:<n,...>] [threads:<n,...>] [variants:<name,...>] [trials:<n>]\n"
+             "                   [runs:<n>] [csv:<file>] [json:<file>] [baseline:<file>]\n"
+             "                   [threshold:<fraction>]\n");
+      return 2;
+    }
+  }
+  assert(trials > 0 && trials <= SWEEP_MAX);
+  assert(runs > 0 && runs <= SWEEP_MAX);
+  assert(threshold >= 0.0 && threshold < 1.0);
+
+  // More threads than cores only measure the scheduler.
+  int cores = omp_get_num_procs();
+  int kept = 0;
+  for (int t = 0; t < num_threads; t++) {
+    if (threads[t] <= cores)
+      threads[kept++] = threads[t];
+    else
+      printf("Skipping %d threads on %d cores\n", threads[t], cores);
+  }
+  num_threads = kept;
+  assert(num_threads > 0);
+  if (num_threads == 1)
+    printf("WARNING: One thread count only, there is no speedup or efficiency to measure\n");
+
+  int max_size = 0;
+  for (int s = 0; s < num_sizes; s++) {
+    assert(sizes[s] <= 10000);
+    if (sizes[s] > max_size)
+      max_size = sizes[s];
+  }
+  int min_threads = threads[0];
+  for (int t = 1; t < num_threads; t++)
+    if (threads[t] < min_threads)
+      min_threads = threads[t];
+
+  printf("Making network...\n");
+  network_t* net = load_cnn_snapshot();
+  uint8_t* data = load_batch(DATA_FOLDER, 0);
+  assert(data != NULL);
+  const uint8_t** input = (const uint8_t**)malloc(sizeof(uint8_t*)*max_size);
+  double* output = (double*)malloc(sizeof(double)*max_size);
+  for (int i = 0; i < max_size; i++)
+    input[i] = data + (size_t)i * CIFAR_RECORD + 1;
+
+  sweep_cell_t* cells = (sweep_cell_t*)calloc(num_sizes * num_threads * SWEEP_VARIANTS,
+                                              sizeof(sweep_cell_t));
+  int n = 0;
+  for (int s = 0; s < num_sizes; s++)
+    for (int v = 0; v < SWEEP_VARIANTS; v++)
+      for (int t = 0; t < num_threads; t++) {
+        if (!use[v])
+          continue;
+        cells[n].size = sizes[s];
+        cells[n].threads = threads[t];
+        cells[n].variant = v;
+        n++;
+      }
+  if (baseline != NULL && sweep_load_baseline(baseline, cells, n) != 0) {
+    printf("ERROR: Cannot read %s\n", baseline);
+    return 1;
+  }
+
+  printf("Sweeping %d cells, %d runs of %d trials each, on %d cores...\n", n, runs, trials, cores);
+  for (int r = 0; r < runs; r++)
+    for (int i = 0; i < n; i++)
+      sweep_measure(net, input, output, cells + i, trials, r);
+  for (int i = 0; i < n; i++)
+    sweep_summarize(cells + i, runs);
+
+  printf("\n  SIZE  THREADS  VARIANT          BEST      MEDIAN  SPREAD   SPEEDUP  EFFICIENCY    BASELINE\n");
+  int regressions = 0;
+  int scaling = 0;
+  for (int i = 0; i < n; i++) {
+    sweep_cell_t* c = cells + i;
+    double base_rate = 0.0;
+    for (int j = 0; j < n; j++) {
+      if (cells[j].size == c->size && cells[j].variant == c->variant && cells[j].threads == min_threads)
+        base_rate = cells[j].best;
+    }
+    c->speedup = c->best / base_rate;
+    c->efficiency = c->speedup * min_threads / c->threads;
+
+    printf("%6d  %7d  %-10s %10.2lf  %10.2lf  %5.1lf%%  %7.2lfx  %9.1lf%%", c->size, c->threads,
+           sweep_variants[c->variant].name, c->best, c->median, 100.0 * c->spread, c->speedup,
+           100.0 * c->efficiency);
+    if (c->baseline > 0) {
+      sweep_compare(c, min_threads, threshold);
+      regressions += c->regressed != 0;
+      scaling += c->threads > min_threads;
+      printf("  %+9.1lf%%", 100.0 * (c->median / c->baseline - 1.0));
+      if (c->regressed)
+        printf("  REGRESSION:%s%s%s", (c->regressed & SWEEP_RATE) ? " rate" : "",
+               (c->regressed & SWEEP_SPEEDUP) ? " speedup" : "",
+               (c->regressed & SWEEP_EFFICIENCY) ? " efficiency" : "");
+    }
+    printf("\n");
+  }
+
+  if (csv != NULL && sweep_csv(csv, cells, n) != 0)
+    printf("ERROR: Cannot write %s\n", csv);
+  if (json != NULL && sweep_json(json, cells, n) != 0)
+    printf("ERROR: Cannot write %s\n", json);
+  if (baseline != NULL) {
+    printf("\n%d of %d cells more than %.0lf%% below %s\n", regressions, n,
+           100.0 * threshold, baseline);
+    if (scaling == 0)
+      printf("WARNING: No cell with more than %d thread(s) is in both the sweep and the baseline,\n"
+             "         speedup and efficiency were not checked\n", min_threads);
+  }
+  printf("\n");
+
+  free(cells);
+  free(input);
+  free(output);
+  free(data);
+  free_network(net);
+  return regressions > 0;
+}
@@ -1,7 +1,44 @@
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
-// Place where test data is stored on instructional machines.
-static const char* DATA_FOLDER = "/home/ff/cs61c/proj-data/cifar_10_bin";
+// Place where test data is stored on instructional machines. Setting the
+// CNN_DATA environment variable points all commands at another directory,
+// for example one written by 'cnn gen'.
+static const char* DEFAULT_DATA_FOLDER = "/home/ff/cs61c/proj-data/cifar_10_bin";
+
+static const char* data_folder() {
+  const char* dir = getenv("CNN_DATA");
+  return (dir != NULL && dir[0] != '\0') ? dir : DEFAULT_DATA_FOLDER;
+}
+
+#define DATA_FOLDER (data_folder())
+
+// Place where the trained weights are stored, relative to the test folder.
+// Builds with CNN_EMBEDDED (make embedded) carry the weights in the binary
+// instead, see load_cnn_embedded.
+#ifdef CNN_EMBEDDED
+static const char* SNAPSHOT_FOLDER = NULL;
+#else
+static const char* SNAPSHOT_FOLDER = "../data/snapshot";
+#endif
+
+// Place where 'cnn tune' stores the best configuration for this machine.
+static const char* TUNING_FILE = "../data/tuning.txt";
+
+// Place where 'cnn cascade train' stores the weights of the first stage.
+static const char* CASCADE_FILE = "../data/cascade.txt";
+
+// The knobs that 'cnn tune' tries (see do_tune). threads is the number of
+// OpenMP threads, 0 for the runtime default.
+typedef struct tuning {
+  int cross_image;
+  int batched_head;
+  int head_batch;
+  int stage_tile;
+  int threads;
+} tuning_t;
 
 // Function to dump the content of a volume for comparison.
 void dump_vol(vol_t* v) {
@@ -14,70 +51,270 @@ void dump_vol(vol_t* v) {
   printf("\n");
 }
 
+// Write the weights of a network as C source for a CNN_EMBEDDED build: one
+// aligned static const array per layer in the packed layout the forward
+// functions use, plus the biases. Returns 0 on success.
+static void embed_array(FILE* fout, const char* name, const double* w, int n) {
+  fprintf(fout, "static const double %s[%d] __attribute__((aligned(32))) = {", name, n);
+  for (int i = 0; i < n; i++)
+    fprintf(fout, "%s%a,", (i % 4 == 0) ? "\n  " : " ", w[i]);
+  fprintf(fout, "\n};\n\n");
+}
+
+int save_embedded_weights(network_t* net, const char* fn) {
+  FILE* fout = fopen(fn, "w");
+  if (fout == NULL)
+    return -1;
+
+  conv_layer_t* conv[3] = { net->l0, net->l3, net->l6 };
+  const char* names[3] = { "l0", "l3", "l6" };
+  char name[64];
+
+  fprintf(fout, "// Generated by 'cnn embed', do not edit.\n\n");
+  for (int c = 0; c < 3; c++) {
+    conv_layer_t* l = conv[c];
+    snprintf(name, sizeof(name), "embed_%s_packed", names[c]);
+    embed_array(fout, name, l->packed, l->out_depth * l->sy * l->sx * l->in_depth);
+    snprintf(name, sizeof(name), "embed_%s_biases", names[c]);
+    embed_array(fout, name, l->biases->w, l->out_depth);
+  }
+  embed_array(fout, "embed_l9_packed", net->l9->packed, net->l9->out_depth * net->l9->num_inputs);
+  embed_array(fout, "embed_l9_biases", net->l9->biases->w, net->l9->out_depth);
+
+  return fclose(fout) == 0 ? 0 : -1;
+}
+
+#ifdef CNN_EMBEDDED
+#include "weights.h"
+
+// The forward functions use the embedded arrays directly. The filters are
+// restored from them as well, so pruning and saving work as usual.
+static void embed_conv(conv_layer_t* l, const double* packed, size_t size, const double* biases) {
+  assert(size == sizeof(double) * l->out_depth * l->sy * l->sx * l->in_depth);
+  l->packed = (double*)packed;
+  memcpy(l->biases->w, biases, sizeof(double) * l->out_depth);
+  conv_unpack(l);
+}
+
+network_t* load_cnn_embedded() {
+  network_t* net = make_network();
+
+  embed_conv(net->l0, embed_l0_packed, sizeof(embed_l0_packed), embed_l0_biases);
+  embed_conv(net->l3, embed_l3_packed, sizeof(embed_l3_packed), embed_l3_biases);
+  embed_conv(net->l6, embed_l6_packed, sizeof(embed_l6_packed), embed_l6_biases);
+
+  fc_layer_t* l = net->l9;
+  assert(sizeof(embed_l9_packed) == sizeof(double) * l->out_depth * l->num_inputs);
+  l->packed = (double*)embed_l9_packed;
+  memcpy(l->biases->w, embed_l9_biases, sizeof(double) * l->out_depth);
+  fc_unpack(l);
+
+  return net;
+}
+#endif
+
+// Load the snapshot of the CNN stored in directory dir. Returns NULL if one
+// of the layer files is missing or malformed. A NULL dir selects the
+// embedded weights of a CNN_EMBEDDED build.
+network_t* load_cnn_snapshot_from(const char* dir) {
+#ifdef CNN_EMBEDDED
+  if (dir == NULL)
+    return load_cnn_embedded();
+#endif
+  if (dir == NULL)
+    return NULL;
+
+  network_t* net = make_network();
+  char fn[1024];
+  int err = 0;
+
+  snprintf(fn, sizeof(fn), "%s/layer1_conv.txt", dir);
+  err |= conv_load(net->l0, fn);
+  snprintf(fn, sizeof(fn), "%s/layer4_conv.txt", dir);
+  err |= conv_load(net->l3, fn);
+  snprintf(fn, sizeof(fn), "%s/layer7_conv.txt", dir);
+  err |= conv_load(net->l6, fn);
+  snprintf(fn, sizeof(fn), "%s/layer10_fc.txt", dir);
+  err |= fc_load(net->l9, fn);
+
+  if (err) {
+    free_network(net);
+    return NULL;
+  }
+  return net;
+}
+
+// Store the weights of a network as a snapshot in directory dir, in the
+// format read by load_cnn_snapshot_from. Returns 0 on success.
+int save_cnn_snapshot(network_t* net, const char* dir) {
+  char fn[1024];
+  int err = 0;
+
+  snprintf(fn, sizeof(fn), "%s/layer1_conv.txt", dir);
+  err |= conv_save(net->l0, fn);
+  snprintf(fn, sizeof(fn), "%s/layer4_conv.txt", dir);
+  err |= conv_save(net->l3, fn);
+  snprintf(fn, sizeof(fn), "%s/layer7_conv.txt", dir);
+  err |= conv_save(net->l6, fn);
+  snprintf(fn, sizeof(fn), "%s/layer10_fc.txt", dir);
+  err |= fc_save(net->l9, fn);
+
+  return err;
+}
+
 // Load the snapshot of the CNN we are going to run.
 network_t* load_cnn_snapshot() {
-  network_t* net = make_network();
-  conv_load(net->l0, "../data/snapshot/layer1_conv.txt");
-  conv_load(net->l3, "../data/snapshot/layer4_conv.txt");
-  conv_load(net->l6, "../data/snapshot/layer7_conv.txt");
-  fc_load(net->l9, "../data/snapshot/layer10_fc.txt");
+  network_t* net = load_cnn_snapshot_from(SNAPSHOT_FOLDER);
+  assert(net != NULL);
   return net;  
 }
 
-// Load an image from the cifar10 data set.
-void load_sample(vol_t *v, int sample_num) {
-  printf("Loading input sample %d...\n", sample_num);
-  
-  int batch = sample_num / 10000;
-  int ix = sample_num % 10000;
+// Read a tuning file, which has one "<knob> <value>" line per knob and may
+// contain comments starting with '#'. Knobs missing from the file keep the
+// value they have in t. Returns 0 on success and -1 if the file cannot be
+// read or has an invalid value, in which case t is left as it was.
+int load_tuning(const char* fn, tuning_t* t) {
+  FILE* fin = fopen(fn, "r");
+  if (fin == NULL)
+    return -1;
 
-  char fn[1024];
-  sprintf(fn, "%s/data_batch_%d.bin", DATA_FOLDER, batch+1);
-  // fprintf(stdout, "fn is %s\n", fn);
+  tuning_t loaded = *t;
+  char line[256];
+  char key[64];
+  int val;
+  int err = 0;
+  while (fgets(line, sizeof(line), fin) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%63s %d", key, &val) != 2)
+      continue;
+    if (!strcmp(key, "cross_image")) {
+      loaded.cross_image = (val != 0);
+    } else if (!strcmp(key, "batched_head")) {
+      loaded.batched_head = (val != 0);
+    } else if (!strcmp(key, "head_batch")) {
+      if (val < 1 || val > MAX_HEAD_BATCH)
+        err = -1;
+      else
+        loaded.head_batch = val;
+    } else if (!strcmp(key, "stage_tile")) {
+      if (val < 0 || val > MAX_HEAD_BATCH)
+        err = -1;
+      else
+        loaded.stage_tile = val;
+    } else if (!strcmp(key, "threads")) {
+      if (val < 0)
+        err = -1;
+      else
+        loaded.threads = val;
+    }
+  }
 
-  FILE* fin = fopen(fn, "rb");
-//  printf("%s\n", fin);
-  assert(fin != NULL);
+  fclose(fin);
+  if (err == 0)
+    *t = loaded;
+  return err;
+}
 
-  fseek(fin, ix*3073, SEEK_SET);
+// Write a tuning file for load_tuning. Returns 0 on success.
+int save_tuning(const char* fn, const tuning_t* t) {
+  FILE* fout = fopen(fn, "w");
+  if (fout == NULL)
+    return -1;
 
-  uint8_t data[3073];
-  assert(fread(data, 1, 3073, fin) == 3073);
+  fprintf(fout, "# written by 'cnn tune'\n");
+  fprintf(fout, "cross_image %d\n", t->cross_image);
+  fprintf(fout, "batched_head %d\n", t->batched_head);
+  fprintf(fout, "head_batch %d\n", t->head_batch);
+  fprintf(fout, "stage_tile %d\n", t->stage_tile);
+  fprintf(fout, "threads %d\n", t->threads);
 
-  int outp = 1;
-  for (int z = 0; z < 3; z++)
-    for (int y = 0; y < 32; y++)
-      for (int x = 0; x < 32; x++) {
-        set_vol(v, x, y, z, ((double)data[outp++])/255.0-0.5);
-      }
+  return fclose(fout) == 0 ? 0 : -1;
+}
+
+// The tuning a network currently runs with.
+tuning_t get_tuning(network_t* net, int threads) {
+  tuning_t t;
+  t.cross_image = net->cross_image;
+  t.batched_head = net->batched_head;
+  t.head_batch = net->head_batch;
+  t.stage_tile = net->stage_tile;
+  t.threads = threads;
+  return t;
+}
+
+// Switch a network to the kernels of a tuning.
+void apply_tuning(network_t* net, const tuning_t* t) {
+  net->cross_image = t->cross_image;
+  net->batched_head = t->batched_head;
+  net->head_batch = t->head_batch;
+  net->stage_tile = t->stage_tile;
+}
 
+// Read the weights of a cascade (see cascade_t): the bias on the first line
+// and then one weight per line. Returns NULL if the file cannot be read, is
+// incomplete or there is no memory for the cascade.
+cascade_t* load_cascade(const char* fn) {
+  FILE* fin = fopen(fn, "r");
+  if (fin == NULL)
+    return NULL;
+
+  cascade_t* c = NULL;
+  if (posix_memalign((void**)&c, 32, sizeof(cascade_t)) != 0) {
+    fclose(fin);
+    return NULL;
+  }
+  int ok = fscanf(fin, "%lf", &c->bias) == 1;
+  for (int i = 0; i < CASCADE_FEATURES && ok; i++)
+    ok = fscanf(fin, "%lf", &c->w[i]) == 1;
   fclose(fin);
+
+  if (!ok) {
+    free(c);
+    return NULL;
+  }
+  return c;
 }
 
-// Load an entire batch of images from the cifar10 data set (which is divided
-// into 5 batches with 10,000 images each).
-vol_t** load_batch(int batch) {
-  printf("Loading input batch %d...\n", batch);
+// Write the weights of a cascade for load_cascade. Returns 0 on success.
+int save_cascade(const char* fn, const cascade_t* c) {
+  FILE* fout = fopen(fn, "w");
+  if (fout == NULL)
+    return -1;
 
-  char fn[1024];
-  sprintf(fn, "%s/data_batch_%d.bin", DATA_FOLDER, batch+1);
+  fprintf(fout, "%.17g\n", c->bias);
+  for (int i = 0; i < CASCADE_FEATURES; i++)
+    fprintf(fout, "%.17g\n", c->w[i]);
 
-  FILE* fin = fopen(fn, "rb");
-  assert(fin != NULL);
-  vol_t** batchdata = (vol_t**)malloc(sizeof(vol_t*) * 10000);
+  return fclose(fout) == 0 ? 0 : -1;
+}
 
-  for (int i = 0; i < 10000; i++) {
-    batchdata[i] = make_vol(32, 32, 3, 0.0);
+// Size of one record in the cifar10 data set: a label byte followed by three
+// 32x32 planes of pixel bytes.
+#define CIFAR_RECORD 3073
 
-    uint8_t data[3073];
-    assert(fread(data, 1, 3073, fin) == 3073);
+// Convert the pixels of a record to the input volume of the network (see
+// decode_image). The network itself reads the record directly (see
+// conv_forward_1), this is only needed to look at the input layer.
+void decode_sample(vol_t* v, const uint8_t* data) {
+  decode_image(v->w, data + 1);
+}
+
+// Load an entire batch of images from the cifar10 data set in directory dir
+// (which is divided into batches of 10,000 images each, 5 for cifar10). The records are
+// kept as they are in the file, 3 KB per image. Returns NULL if the batch
+// file cannot be read.
+uint8_t* load_batch(const char* dir, int batch) {
+  char fn[1024];
+  snprintf(fn, sizeof(fn), "%s/data_batch_%d.bin", dir, batch+1);
+
+  FILE* fin = fopen(fn, "rb");
+  if (fin == NULL)
+    return NULL;
 
-    int outp = 1;
-    for (int z = 0; z < 3; z++)
-      for (int y = 0; y < 32; y++)
-        for (int x = 0; x < 32; x++) {
-          set_vol(batchdata[i], x, y, z, ((double)data[outp++])/255.0-0.5);
-        }
+  uint8_t* batchdata = (uint8_t*)malloc((size_t)CIFAR_RECORD * 10000);
+  if (batchdata == NULL ||
+      fread(batchdata, CIFAR_RECORD, 10000, fin) != 10000) {
+    free(batchdata);
+    batchdata = NULL;
   }
 
   fclose(fin);
@@ -85,42 +322,211 @@ vol_t** load_batch(int batch) {
   return batchdata;
 }
 
-vol_t** batches[50];
+// Number of images in the data set in directory dir: 10,000 for each of
+// data_batch_1.bin, data_batch_2.bin, ... up to the first one missing.
+int data_size(const char* dir) {
+  char fn[1024];
+  struct stat st;
+  int batches = 0;
+  for (;;) {
+    snprintf(fn, sizeof(fn), "%s/data_batch_%d.bin", dir, batches+1);
+    if (stat(fn, &st) != 0 || st.st_size < (off_t)CIFAR_RECORD * 10000)
+      break;
+    batches++;
+  }
+  return batches * 10000;
+}
+
+// Map a batch of the data set read-only into memory, like load_batch. The
+// pages come from the page cache, so all processes that map the same batch
+// share a single copy. Free the result with unmap_batch.
+uint8_t* map_batch(const char* dir, int batch) {
+  char fn[1024];
+  snprintf(fn, sizeof(fn), "%s/data_batch_%d.bin", dir, batch+1);
 
-// Perform the classification (this calls into the functions from cnn.c
-double run_classification(int* samples, int n, double** keep_output) {
-  printf("Making network...\n");
-  network_t* net = load_cnn_snapshot();
+  int fd = open(fn, O_RDONLY);
+  if (fd < 0)
+    return NULL;
 
-  printf("Loading batches...\n");
-  for (int i = 0; i < n; i++) {
-    int batch = samples[i]/10000;
-    if (batches[batch] == NULL) {
-      batches[batch] = load_batch(batch);
+  struct stat st;
+  void* p = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)CIFAR_RECORD * 10000)
+    p = mmap(NULL, (size_t)CIFAR_RECORD * 10000, PROT_READ, MAP_SHARED, fd, 0);
+
+  close(fd);
+
+  return (p == MAP_FAILED) ? NULL : (uint8_t*)p;
+}
+
+void unmap_batch(uint8_t* batchdata) {
+  if (batchdata != NULL)
+    munmap(batchdata, (size_t)CIFAR_RECORD * 10000);
+}
+
+// Load the record of an image from the cifar10 data set.
+void load_sample(uint8_t* data, int sample_num) {
+  printf("Loading input sample %d...\n", sample_num);
+  
+  int batch = sample_num / 10000;
+  int ix = sample_num % 10000;
+
+  uint8_t* batchdata = map_batch(DATA_FOLDER, batch);
+  assert(batchdata != NULL);
+  memcpy(data, batchdata + (size_t)ix * CIFAR_RECORD, CIFAR_RECORD);
+  unmap_batch(batchdata);
+}
+
+// The image cache ('cnn precache') holds the whole data set preconverted to
+// the layout the network reads: the pixel planes of every image without
+// the label byte (CNN_IMAGE_BYTES), one after the other behind a header of
+// IMAGE_CACHE_HEADER bytes, so every image starts on a cache line and all
+// of them are a single mapping. The labels follow the images. libcnn uses
+// the cache instead of the batch files if it is in the data directory.
+#define IMAGE_CACHE "images.cache"
+#define IMAGE_CACHE_MAGIC "CNNIMG01"
+#define IMAGE_CACHE_HEADER 4096
+
+static size_t image_cache_bytes(int images) {
+  return IMAGE_CACHE_HEADER + (size_t)images * (CNN_IMAGE_BYTES + 1);
+}
+
+// Pixels of image i of a mapped cache.
+static inline const uint8_t* cached_image(const uint8_t* cache, int i) {
+  return cache + IMAGE_CACHE_HEADER + (size_t)i * CNN_IMAGE_BYTES;
+}
+
+// Write the cache for the data set in dir to fn, each batch converted in
+// parallel. The file is written under a temporary name and renamed when
+// complete. Returns the number of images, or -1 on failure.
+int write_image_cache(const char* dir, const char* fn) {
+  int images = data_size(dir);
+  if (images == 0)
+    return -1;
+
+  char tmp[1024];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -1;
+  size_t bytes = image_cache_bytes(images);
+  uint8_t* cache = MAP_FAILED;
+  if (ftruncate(fd, bytes) == 0)
+    cache = (uint8_t*)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (cache == MAP_FAILED) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+
+  int64_t count = images;
+  memcpy(cache, IMAGE_CACHE_MAGIC, 8);
+  memcpy(cache + 8, &count, sizeof(count));
+  uint8_t* labels = cache + IMAGE_CACHE_HEADER + (size_t)images * CNN_IMAGE_BYTES;
+  int err = 0;
+  for (int b = 0; b < images / 10000 && !err; b++) {
+    uint8_t* batchdata = map_batch(dir, b);
+    if (batchdata == NULL) {
+      err = -1;
+      break;
+    }
+    #pragma omp parallel for
+    for (int i = 0; i < 10000; i++) {
+      const uint8_t* rec = batchdata + (size_t)i * CIFAR_RECORD;
+      memcpy((uint8_t*)cached_image(cache, b * 10000 + i), rec + 1, CNN_IMAGE_BYTES);
+      labels[b * 10000 + i] = rec[0];
     }
+    unmap_batch(batchdata);
   }
 
-  vol_t** input = (vol_t**)malloc(sizeof(vol_t*)*n);
-  double* output = (double*)malloc(sizeof(double)*n);
+  if (munmap(cache, bytes) != 0 || fsync(fd) != 0)
+    err = -1;
+  if (close(fd) != 0 || err != 0 || rename(tmp, fn) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return images;
+}
 
-  for (int i = 0; i < n; i++) {
-    input[i] = batches[samples[i]/10000][samples[i]%10000];
+// Map the cache fn read-only. It is only used if it is complete, has as
+// many images as the data set in dir and is newer than its batch files.
+// Returns NULL otherwise, or the mapping and its number of images in
+// *images. Free it with unmap_image_cache.
+uint8_t* map_image_cache(const char* fn, const char* dir, int* images) {
+  int fd = open(fn, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st, batch_st;
+  int64_t count = 0;
+  int ok = fstat(fd, &st) == 0 && st.st_size >= IMAGE_CACHE_HEADER;
+  if (ok) {
+    char magic[8];
+    ok = pread(fd, magic, 8, 0) == 8 && !memcmp(magic, IMAGE_CACHE_MAGIC, 8) &&
+         pread(fd, &count, sizeof(count), 8) == sizeof(count) &&
+         count == data_size(dir) && count > 0 &&
+         (size_t)st.st_size == image_cache_bytes((int)count);
+  }
+  for (int b = 0; ok && b < count / 10000; b++) {
+    char batch_fn[1024];
+    snprintf(batch_fn, sizeof(batch_fn), "%s/data_batch_%d.bin", dir, b+1);
+    ok = stat(batch_fn, &batch_st) == 0 && batch_st.st_mtime <= st.st_mtime;
+  }
+
+  void* p = MAP_FAILED;
+  if (ok)
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+
+  *images = (int)count;
+  return (uint8_t*)p;
+}
+
+void unmap_image_cache(uint8_t* cache, int images) {
+  if (cache != NULL)
+    munmap(cache, image_cache_bytes(images));
+}
+
+// Perform the classification (this calls into the functions from cnn.c
+// through a context of the libcnn API, see libcnn.c). keep_output receives
+// the cat probabilities, or with all set the probabilities of all classes
+// (10 per sample).
+static double run_classification_as(int* samples, int n, double** keep_output, int all) {
+  printf("Making network...\n");
+  int err;
+  cnn_ctx_t* ctx = cnn_open(NULL, &err);
+  if (ctx == NULL) {
+    fprintf(stderr, "ERROR: %s\n", cnn_strerror(err));
+    exit(1);
+  }
+
+  printf("Loading batches...\n");
+  err = cnn_prefetch(ctx, samples, n);
+  if (err != CNN_OK) {
+    fprintf(stderr, "ERROR: %s\n", cnn_strerror(err));
+    exit(1);
   }
 
+  int width = all ? CNN_CLASSES : 1;
+  double* output = (double*)malloc(sizeof(double)*n*width);
+
   printf("Running classification...\n");
   uint64_t start_time = timestamp_us(); 
-  net_classify_cats(net, input, output, n);
+  if (all)
+    cnn_classify_probs(ctx, samples, n, output);
+  else
+    cnn_classify(ctx, samples, n, output);
   uint64_t end_time = timestamp_us();
 
   for (int i = 0; i < n; i++) {
-    samples[i] = (output[i] > 0.5) ? 0 : -1;
+    samples[i] = (output[i*width + (all ? CNN_CAT : 0)] > 0.5) ? 0 : -1;
   }
 
   double dt = (double)(end_time-start_time) / 1000.0;
   printf("TIME: %lf ms\n", dt);
 
-  free_network(net);
-  free(input);
+  cnn_close(ctx);
 
   if (keep_output == NULL)
     free(output);
@@ -129,3 +535,11 @@ double run_classification(int* samples, int n, double** keep_output) {
 
   return dt;
 }
+
+double run_classification(int* samples, int n, double** keep_output) {
+  return run_classification_as(samples, n, keep_output, 0);
+}
+
+double run_classification_probs(int* samples, int n, double** keep_probs) {
+  return run_classification_as(samples, n, keep_probs, 1);
+}
@@ -0,0 +1,24 @@
+import os
+import sys
+
+# Classifies the first records of the data set the way POST /classify does,
+# through cnnModule.ClassifyImages on the raw pixels, and prints
+# "<index>,<cat probability>" lines like 'cnn stream raw'.
+
+sys.path.insert(0, '..')
+from cnnModule import *
+
+if len(sys.argv) < 2:
+	print 'Usage: python classify_test.py <images>'
+	sys.exit(2)
+
+n = int(sys.argv[1])
+folder = os.environ.get('CNN_DATA') or '/home/ff/cs61c/proj-data/cifar_10_bin'
+with open(os.path.join(folder, 'data_batch_1.bin'), 'rb') as fin:
+	records = fin.read(n * (IMAGE_BYTES + 1))
+
+# Drop the label byte in front of every image.
+pixels = ''.join([records[i * (IMAGE_BYTES + 1) + 1:(i + 1) * (IMAGE_BYTES + 1)] for i in range(n)])
+dt, responses, probs = ClassifyImages(pixels, 0)
+for i in range(n):
+	print '%d,%f' % (i, probs[i][3])
@@ -4,9 +4,13 @@ layers = 12
 delta = 0.00000000001
 
 if len(sys.argv) < 3:
-	print 'Usage: python compare_layers.py <file> <reference>'
+	print 'Usage: python compare_layers.py <file> <reference> [tolerance]'
 	sys.exit(2)
 
+# Half precision builds (make test-half) only match within a tolerance.
+if len(sys.argv) > 3:
+	delta = float(sys.argv[3])
+
 with open(sys.argv[1], 'r') as fin:
 	indata = fin.readlines()
 
@@ -4,30 +4,53 @@ layers = 12
 delta = 0.00000000001
 
 if len(sys.argv) < 3:
-	print 'Usage: python compare_output.py <file> <reference>'
+	print 'Usage: python compare_output.py <file> <reference> [tolerance]'
 	sys.exit(2)
 
+# Half precision builds (make test-half) only match within a tolerance.
+if len(sys.argv) > 3:
+	delta = float(sys.argv[3])
+
 with open(sys.argv[1], 'r') as fin:
 	indata = fin.readlines()
 
 with open(sys.argv[2], 'r') as fref:
 	refdata = fref.readlines()
 
+if len(indata) != len(refdata):
+	print 'ERROR: %d outputs instead of %d' % (len(indata), len(refdata))
+	sys.exit(2)
+
+# Every line is a key (PAR<i> for partest, anything else for the other tests)
+# followed by values: numbers, <label>:<number> pairs or plain words, which
+# have to match the reference within the tolerance or exactly.
+def number(s):
+	try:
+		return float(s)
+	except ValueError:
+		return None
+
 for i in range(len(indata)):
-	invals = indata[i].split(',')
-	if invals[0] != 'PAR' + str(i):
-		print 'ERROR: Invalid input data for output ' + str(i)
+	invals = indata[i].strip().split(',')
+	refvals = refdata[i].strip().split(',')
+	if invals[0] != refvals[0] or len(invals) != len(refvals):
+		print 'ERROR: Invalid input data for output %d (%s, should be %s)' % \
+			(i, invals[0], refvals[0])
 		sys.exit(2)
 
-	refvals = refdata[i].split(',')
-	if refvals[0] != 'PAR' + str(i):
-		print 'ERROR: Invalid reference data for output ' + str(i)
-		sys.exit(2)
-	
-	for j in range(1,2):
-		if abs(float(invals[j])-float(refvals[j])) > delta:
-			print 'ERROR: Value %d at output %d is wrong: %f (should be %f)' % \
-				(j, i, float(invals[j]), float(refvals[j]))
+	for j in range(1, len(refvals)):
+		inval = invals[j].split(':')
+		refval = refvals[j].split(':')
+		if len(inval) != len(refval) or inval[:-1] != refval[:-1]:
+			print 'ERROR: Value %d at output %s is wrong: %s (should be %s)' % \
+				(j, refvals[0], invals[j], refvals[j])
+			sys.exit(1)
+		x = number(inval[-1])
+		y = number(refval[-1])
+		if (y is None and inval[-1] != refval[-1]) or \
+		   (y is not None and (x is None or abs(x - y) > delta)):
+			print 'ERROR: Value %d at output %s is wrong: %s (should be %s)' % \
+				(j, refvals[0], invals[j], refvals[j])
 			sys.exit(1)
 
 print 'OK'